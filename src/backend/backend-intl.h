@@ -19,6 +19,17 @@ struct ptree_ref {
 
 #define FS_PENDED_LISTS 16
 
+/* consecutive pairs for the same ptree and key, so they can be added to the
+ * tree's leaf in one go */
+#define FS_ADD_RUN 1024
+
+struct fs_add_run {
+    fs_ptree *pt;
+    fs_rid pk;
+    int length;
+    fs_rid pairs[FS_ADD_RUN][2];
+};
+
 struct _fs_backend {
     const char *db_name;
     fs_metadata *md;
@@ -40,6 +51,7 @@ struct _fs_backend {
     int ptree_length;
     struct ptree_ref *ptrees_priv;
     fs_lockable_t *pended[FS_PENDED_LISTS];
+    struct fs_add_run add_run;	/* pended pairs waiting for fs_commit */
     GHashTable *rid_id_map;
     int ptree_open_flags;
     int ptree_open_count;
@@ -37,6 +37,7 @@
 #include "sort.h"
 #include "lock.h"
 #include "mhash.h"
+#include "compact.h"
 #include "tlist.h"
 
 /* used to indicate to backend processes that they need to reopen thier
@@ -303,6 +304,30 @@ void fs_backend_ptree_limited_open(fs_backend *be, int n)
     be->ptree_open_count++;
 }
 
+static void add_run_flush(fs_backend *be)
+{
+    struct fs_add_run *r = &be->add_run;
+
+    if (r->length) {
+	fs_ptree_add_pairs(r->pt, r->pk, r->length, r->pairs);
+    }
+    r->length = 0;
+}
+
+static void add_run_add(fs_backend *be, fs_ptree *pt, fs_rid pk, fs_rid pair[2])
+{
+    struct fs_add_run *r = &be->add_run;
+
+    if (r->length && (r->pt != pt || r->pk != pk || r->length == FS_ADD_RUN)) {
+	add_run_flush(be);
+    }
+    r->pt = pt;
+    r->pk = pk;
+    r->pairs[r->length][0] = pair[0];
+    r->pairs[r->length][1] = pair[1];
+    r->length++;
+}
+
 static int fs_commit(fs_backend *be, fs_segment seg, int force_trans)
 {
     fs_rid_set *rs = NULL;
@@ -326,7 +351,6 @@ static int fs_commit(fs_backend *be, fs_segment seg, int force_trans)
 	fs_rid quad[4];
 	fs_rid pred = FS_RID_NULL;
 	fs_ptree *current_tree = NULL;
-	fs_ptree *previous_tree = NULL;
         //fs_lockable_lock(be->predicates, LOCK_EX); locked by transaction...
 	for (int i=0; i<FS_PENDED_LISTS; i++) {
 	    fs_lockable_lock(be->pended[i], LOCK_EX); /* XXX retval */
@@ -336,6 +360,11 @@ static int fs_commit(fs_backend *be, fs_segment seg, int force_trans)
 	    fs_list_sort_chunked_r(be->pended[i], quad_sort_by_psmo);
 	    while (fs_list_next_sort_uniqed_r(be->pended[i], quad)) {
 		if (quad[2] != pred) {
+		    /* finish with the last tree before looking up the next one,
+		     * opening a ptree can close the oldest open tree */
+		    add_run_flush(be);
+		    if (current_tree)
+			fs_lockable_lock(current_tree, LOCK_UN);
 		    pred = quad[2];
 		    current_tree = fs_backend_get_ptree(be, pred, 0);
 		    if (!current_tree) {
@@ -348,44 +377,42 @@ static int fs_commit(fs_backend *be, fs_segment seg, int force_trans)
 		    if (!current_tree) {
 			fs_error(LOG_CRIT, "failed to create ptree for %016llx",
 				 pred);
+			continue;
 		    }
-		    if (current_tree != previous_tree) {
-                        if (previous_tree)
-                            fs_lockable_lock(previous_tree, LOCK_UN);
-                        fs_lockable_lock(current_tree, LOCK_EX);
-                        previous_tree = current_tree;
-                    }
+		    fs_lockable_lock(current_tree, LOCK_EX);
 		}
+		if (!current_tree) continue;
 		fs_rid pair[2] = { quad[0], quad[3] };
-		fs_ptree_add(current_tree, quad[1], pair, 0);
+		add_run_add(be, current_tree, quad[1], pair);
 	    }
+            add_run_flush(be);
             if (current_tree)
                 fs_lockable_lock(current_tree, LOCK_UN);
 
 	    /* process O ptrees */
 	    pred = FS_RID_NULL;
 	    current_tree = NULL;
-            previous_tree = NULL;
 	    fs_list_rewind_r(be->pended[i]);
 	    fs_list_sort_chunked_r(be->pended[i], quad_sort_by_poms);
 	    while (fs_list_next_sort_uniqed_r(be->pended[i], quad)) {
 		if (quad[2] != pred) {
+		    add_run_flush(be);
+		    if (current_tree)
+			fs_lockable_lock(current_tree, LOCK_UN);
 		    pred = quad[2];
 		    current_tree = fs_backend_get_ptree(be, pred, 1);
 		    if (!current_tree) {
 			fs_error(LOG_CRIT, "failed to get ptree for %016llx",
 				 pred);
+			continue;
 		    }
+		    fs_lockable_lock(current_tree, LOCK_EX);
 		}
-		if (current_tree != previous_tree) {
-                    if (previous_tree)
-                        fs_lockable_lock(previous_tree, LOCK_UN);
-                    fs_lockable_lock(current_tree, LOCK_EX);
-                    previous_tree = current_tree;
-                }
+		if (!current_tree) continue;
 		fs_rid pair[2] = { quad[0], quad[1] };
-		fs_ptree_add(current_tree, quad[3], pair, 0);
+		add_run_add(be, current_tree, quad[3], pair);
 	    }
+            add_run_flush(be);
             if (current_tree)
                 fs_lockable_lock(current_tree, LOCK_UN);
 
@@ -552,6 +579,11 @@ int fs_backend_open_files_intl(fs_backend *be, fs_segment seg, int flags, int fi
     }
 
     be->segment = seg;
+    if (fs_backend_recover_publish(fs_backend_get_kb(be), seg)) {
+        fs_error(LOG_CRIT, "failed to recover files for segment %d", seg);
+
+        return 1;
+    }
     if (!be->checked_transaction) {
 	be->transaction = 0; //fs_lock_taken(be, "trans");
 	be->checked_transaction = 1;
@@ -0,0 +1,478 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <glib.h>
+#include <sys/file.h>
+
+#include "backend.h"
+#include "backend-intl.h"
+#include "compact.h"
+#include "lock.h"
+#include "frozen.h"
+#include "common/params.h"
+#include "common/error.h"
+
+#define COMPACT_SUFFIX ".compact"
+#define FREEZE_SUFFIX ".freeze"
+
+static int copy_file(const char *from, const char *to)
+{
+    char buffer[65536];
+    int ret = 0;
+
+    int in = open(from, FS_O_NOATIME | O_RDONLY);
+    if (in == -1) {
+        fs_error(LOG_ERR, "cannot open %s: %s", from, strerror(errno));
+
+        return 1;
+    }
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, FS_FILE_MODE);
+    if (out == -1) {
+        fs_error(LOG_ERR, "cannot create %s: %s", to, strerror(errno));
+        close(in);
+
+        return 1;
+    }
+    ssize_t len;
+    while ((len = read(in, buffer, sizeof(buffer))) > 0) {
+        if (write(out, buffer, len) != len) {
+            fs_error(LOG_ERR, "write to %s failed: %s", to, strerror(errno));
+            ret = 1;
+
+            break;
+        }
+    }
+    if (len == -1) {
+        fs_error(LOG_ERR, "read from %s failed: %s", from, strerror(errno));
+        ret = 1;
+    }
+    close(out);
+    close(in);
+
+    return ret;
+}
+
+struct rename {
+    char *from;
+    char *to;
+};
+
+static void add_rename(GSList **renames, char *from, char *to)
+{
+    struct rename *r = malloc(sizeof(struct rename));
+    r->from = from;
+    r->to = to;
+    *renames = g_slist_prepend(*renames, r);
+}
+
+static int sync_dir(const char *kb, fs_segment seg)
+{
+    char *dirname = g_strdup_printf(FS_SEG_DIR, kb, seg);
+    int fd = open(dirname, O_RDONLY);
+    int ret = 0;
+    if (fd == -1 || fs_fsync(fd)) {
+        fs_error(LOG_ERR, "cannot sync %s: %s", dirname, strerror(errno));
+        ret = 1;
+    }
+    if (fd != -1) close(fd);
+    g_free(dirname);
+
+    return ret;
+}
+
+/* the publish log lists the renames that make up one change to the segment.
+ * It's only written once all the new files are complete, so if it's found
+ * at open time the renames are finished off, never rolled back */
+static int write_publish_log(const char *kb, fs_segment seg, GSList *renames)
+{
+    char *logname = g_strdup_printf(FS_PUBLISH, kb, seg);
+    char *tmpname = g_strconcat(logname, COMPACT_SUFFIX, NULL);
+    int ret = 0;
+
+    FILE *log = fopen(tmpname, "w");
+    if (!log) {
+        fs_error(LOG_ERR, "cannot create %s: %s", tmpname, strerror(errno));
+        ret = 1;
+        goto done;
+    }
+    for (GSList *it = renames; it; it = it->next) {
+        struct rename *r = it->data;
+        fprintf(log, "%s\t%s\n", r->from, r->to);
+    }
+    if (fflush(log) || fs_fsync(fileno(log))) {
+        fs_error(LOG_ERR, "cannot write %s: %s", tmpname, strerror(errno));
+        ret = 1;
+    }
+    fclose(log);
+    if (!ret && rename(tmpname, logname)) {
+        fs_error(LOG_ERR, "rename(%s, %s): %s", tmpname, logname,
+                 strerror(errno));
+        ret = 1;
+    }
+    if (ret) {
+        unlink(tmpname);
+    } else {
+        ret = sync_dir(kb, seg);
+    }
+
+done:
+    g_free(tmpname);
+    g_free(logname);
+
+    return ret;
+}
+
+static int finish_publish(const char *kb, fs_segment seg)
+{
+    char *logname = g_strdup_printf(FS_PUBLISH, kb, seg);
+    int ret = sync_dir(kb, seg);
+    if (!ret && unlink(logname)) {
+        fs_error(LOG_ERR, "cannot remove %s: %s", logname, strerror(errno));
+        ret = 1;
+    }
+    g_free(logname);
+
+    return ret;
+}
+
+/* rename the new files over the originals in the order they were added, or
+ * remove them all if something went wrong. The publish log makes the set of
+ * renames atomic across a crash */
+static int publish_renames(fs_backend *be, GSList *renames, int errs)
+{
+    const char *kb = fs_backend_get_kb(be);
+    const fs_segment seg = fs_backend_get_segment(be);
+
+    renames = g_slist_reverse(renames);
+    if (!errs && renames) {
+        errs += write_publish_log(kb, seg, renames);
+    }
+    for (GSList *it = renames; it; it = it->next) {
+        struct rename *r = it->data;
+        if (errs) {
+            unlink(r->from);
+        } else if (rename(r->from, r->to)) {
+            fs_error(LOG_CRIT, "rename(%s, %s): %s", r->from, r->to,
+                     strerror(errno));
+            errs++;
+        }
+        g_free(r->from);
+        g_free(r->to);
+        free(r);
+    }
+    /* a failed rename leaves the log in place, to be retried at open */
+    if (!errs && renames) {
+        errs += finish_publish(kb, seg);
+    }
+    g_slist_free(renames);
+
+    return errs;
+}
+
+int fs_backend_recover_publish(const char *kb, fs_segment seg)
+{
+    char *logname = g_strdup_printf(FS_PUBLISH, kb, seg);
+    FILE *log = fopen(logname, "r");
+    g_free(logname);
+    if (!log) {
+        /* nothing was interrupted */
+        return 0;
+    }
+
+    fs_error(LOG_INFO, "segment %d: finishing interrupted file replacement",
+             seg);
+    int errs = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), log)) {
+        char *tab = strchr(line, '\t');
+        char *nl = strchr(line, '\n');
+        if (!tab || !nl) {
+            fs_error(LOG_CRIT, "segment %d: bad line in publish log", seg);
+            errs++;
+            continue;
+        }
+        *tab = '\0';
+        *nl = '\0';
+        /* renames that already happened have no source left */
+        if (access(line, F_OK) == 0 && rename(line, tab+1)) {
+            fs_error(LOG_CRIT, "rename(%s, %s): %s", line, tab+1,
+                     strerror(errno));
+            errs++;
+        }
+    }
+    fclose(log);
+    if (!errs) {
+        errs += finish_publish(kb, seg);
+    }
+
+    return errs;
+}
+
+/* make a copy of a ptree, and rewrite the copy to use the table dest */
+static int compact_ptree(fs_backend *be, fs_rid pred, char pk, fs_ptable *dest,
+                         GSList **renames)
+{
+    char *fname = g_strdup_printf(FS_PTREE, fs_backend_get_kb(be),
+                                  fs_backend_get_segment(be), pk, pred);
+    char *tmpname = g_strconcat(fname, COMPACT_SUFFIX, NULL);
+    if (copy_file(fname, tmpname)) {
+        g_free(fname);
+        g_free(tmpname);
+
+        return 1;
+    }
+    add_rename(renames, tmpname, fname);
+
+    fs_ptree *pt = fs_ptree_open_filename(tmpname, O_RDWR, be->pairs);
+    if (!pt) {
+        return 1;
+    }
+    if (fs_lockable_lock(pt, LOCK_EX)) {
+        fs_ptree_close(pt);
+
+        return 1;
+    }
+    fs_ptree_rewrite_table(pt, dest);
+    int ret = fs_lockable_lock(pt, LOCK_UN);
+    if (fs_fsync(((fs_lockable_t *)pt)->fd)) {
+        fs_error(LOG_ERR, "fsync(%s): %s", tmpname, strerror(errno));
+        ret = 1;
+    }
+    fs_ptree_close(pt);
+
+    return ret;
+}
+
+/* a chain marked as a superset may still hold triples that were deleted from
+ * the ptrees. Walking it to the end checks each one, marks those that are gone
+ * and clears the mark, so the copy is exact */
+static int settle_superset(fs_backend *be, fs_rid model, fs_index_node chain)
+{
+    fs_tbchain_it *it = fs_tbchain_new_iterator(be->model_list, model, chain);
+    if (!it) {
+        return 1;
+    }
+    fs_rid triple[3];
+    while (fs_tbchain_it_next(it, triple)) ;
+    fs_tbchain_it_free(it);
+
+    return 0;
+}
+
+int fs_backend_compact(fs_backend *be, fs_segment seg)
+{
+    int errs = 0;
+    GSList *renames = NULL;
+    const char *kb = fs_backend_get_kb(be);
+
+    if (seg != be->segment || !be->models || !be->predicates) {
+        fs_error(LOG_ERR, "files for segment %d are not open", seg);
+
+        return 1;
+    }
+    /* a running backend would go on using the files this replaces */
+    if (!fs_lock_kb_held()) {
+        fs_error(LOG_ERR, "KB “%s” is not locked, it may be running",
+                 fs_backend_get_kb(be));
+
+        return 1;
+    }
+
+    if (fs_lockable_lock(be->models, LOCK_EX)) {
+        return 1;
+    }
+    if (fs_lockable_lock(be->predicates, LOCK_EX)) {
+        fs_lockable_lock(be->models, LOCK_UN);
+
+        return 1;
+    }
+
+    /* pair table, and the ptrees that refer to it */
+    fs_ptable *pairs = fs_ptable_open(be, "pairs-compact",
+                                      O_RDWR | O_CREAT | O_TRUNC);
+    if (!pairs) {
+        errs++;
+        goto unlock;
+    }
+    for (int i=0; i<be->ptree_length && !errs; i++) {
+        const fs_rid pred = be->ptrees_priv[i].pred;
+        errs += compact_ptree(be, pred, 's', pairs, &renames);
+        errs += compact_ptree(be, pred, 'o', pairs, &renames);
+    }
+    add_rename(&renames, g_strdup_printf(FS_PTABLE, kb, seg, "pairs-compact"),
+               g_strdup_printf(FS_PTABLE, kb, seg, "pairs"));
+    fs_error(LOG_INFO, "segment %d pair table compacted from %u to %u rows",
+             seg, fs_ptable_length(be->pairs), fs_ptable_length(pairs));
+    errs += fs_ptable_sync(pairs);
+    fs_ptable_close(pairs);
+
+    /* model list chains, and the model hash that points into them */
+    fs_tbchain *mlist = NULL;
+    fs_lockable_t *models = NULL;
+    if (!errs) {
+        mlist = fs_tbchain_open(be, "mlist-compact", O_RDWR | O_CREAT | O_TRUNC);
+        add_rename(&renames,
+                   g_strdup_printf(FS_TBCHAIN, kb, seg, "mlist-compact"),
+                   g_strdup_printf(FS_TBCHAIN, kb, seg, "mlist"));
+        models = fs_mhash_open(be, "models-compact", O_RDWR | O_CREAT | O_TRUNC);
+        add_rename(&renames,
+                   g_strdup_printf(FS_MHASH, kb, seg, "models-compact"),
+                   g_strdup_printf(FS_MHASH, kb, seg, "models"));
+    }
+    if (mlist && models && !fs_lockable_lock(models, LOCK_EX)) {
+        fs_rid_vector *keys = fs_mhash_get_keys_r(be->models);
+        int settled = 0;
+        for (int i=0; i<keys->length; i++) {
+            fs_index_node val = 0;
+            fs_mhash_get_r(be->models, keys->data[i], &val);
+            if (val > 1) {
+                if (fs_tbchain_get_bit(be->model_list, val,
+                                       FS_TBCHAIN_SUPERSET)) {
+                    errs += settle_superset(be, keys->data[i], val);
+                    settled++;
+                }
+                val = fs_tbchain_copy_chain(be->model_list, val, mlist);
+            }
+            errs += fs_mhash_put_r(models, keys->data[i], val);
+        }
+        fs_rid_vector_free(keys);
+        if (settled) {
+            fs_error(LOG_INFO, "segment %d: checked %d superset model lists",
+                     seg, settled);
+        }
+        fs_error(LOG_INFO, "segment %d model list compacted from %u to %u "
+                 "blocks", seg, fs_tbchain_allocated_blocks(be->model_list),
+                 fs_tbchain_allocated_blocks(mlist));
+        errs += fs_tbchain_sync(mlist);
+        errs += fs_lockable_lock(models, LOCK_UN) ? 1 : 0;
+    } else if (!errs) {
+        errs++;
+    }
+    if (mlist) fs_tbchain_close(mlist);
+    if (models) fs_mhash_close(models);
+
+unlock:
+    /* renamed in the order added: the ptrees, the pair table, the model list
+     * and then the model hash. The publish log written first means a crash
+     * part way through is finished off when the segment is next opened */
+    errs = publish_renames(be, renames, errs);
+
+    fs_lockable_lock(be->predicates, LOCK_UN);
+    fs_lockable_lock(be->models, LOCK_UN);
+
+    /* our open files refer to the old versions */
+    fs_backend_close_files(be, seg);
+
+    return errs;
+}
+
+/* write a ptree's pairs to a new frozen file, and make an empty tree to take
+ * its place for later changes */
+static int freeze_ptree(fs_backend *be, fs_rid pred, char pk, GSList **renames)
+{
+    char *fname = g_strdup_printf(FS_PTREE, fs_backend_get_kb(be),
+                                  fs_backend_get_segment(be), pk, pred);
+    char *fzname = g_strconcat(fname, FS_FROZEN_SUFFIX, NULL);
+
+    fs_ptree *pt = fs_ptree_open_filename(fname, O_RDWR, be->pairs);
+    if (!pt) {
+        g_free(fzname);
+        g_free(fname);
+
+        return 1;
+    }
+    if (fs_lockable_lock(pt, LOCK_SH)) {
+        fs_ptree_close(pt);
+        g_free(fzname);
+        g_free(fname);
+
+        return 1;
+    }
+    char *tmpfzname = g_strconcat(fzname, FREEZE_SUFFIX, NULL);
+    int ret = fs_ptree_freeze(pt, tmpfzname);
+    fs_lockable_lock(pt, LOCK_UN);
+    fs_ptree_close(pt);
+    add_rename(renames, tmpfzname, fzname);
+
+    char *tmpname = g_strconcat(fname, FREEZE_SUFFIX, NULL);
+    fs_ptree *empty = fs_ptree_open_filename(tmpname, O_RDWR | O_CREAT | O_TRUNC,
+                                             be->pairs);
+    if (empty) {
+        fs_ptree_close(empty);
+    } else {
+        ret = 1;
+    }
+    add_rename(renames, tmpname, fname);
+
+    return ret;
+}
+
+int fs_backend_freeze(fs_backend *be, fs_segment seg)
+{
+    int errs = 0;
+    GSList *renames = NULL;
+
+    if (seg != be->segment || !be->models || !be->predicates) {
+        fs_error(LOG_ERR, "files for segment %d are not open", seg);
+
+        return 1;
+    }
+    /* a running backend would go on using the files this replaces */
+    if (!fs_lock_kb_held()) {
+        fs_error(LOG_ERR, "KB “%s” is not locked, it may be running",
+                 fs_backend_get_kb(be));
+
+        return 1;
+    }
+
+    if (fs_lockable_lock(be->models, LOCK_EX)) {
+        return 1;
+    }
+    if (fs_lockable_lock(be->predicates, LOCK_EX)) {
+        fs_lockable_lock(be->models, LOCK_UN);
+
+        return 1;
+    }
+
+    for (int i=0; i<be->ptree_length && !errs; i++) {
+        const fs_rid pred = be->ptrees_priv[i].pred;
+        errs += freeze_ptree(be, pred, 's', &renames);
+        errs += freeze_ptree(be, pred, 'o', &renames);
+    }
+    if (!errs) {
+        fs_error(LOG_INFO, "segment %d: froze %d predicates", seg,
+                 be->ptree_length);
+    }
+
+    errs = publish_renames(be, renames, errs);
+
+    fs_lockable_lock(be->predicates, LOCK_UN);
+    fs_lockable_lock(be->models, LOCK_UN);
+
+    /* our open files refer to the old versions */
+    fs_backend_close_files(be, seg);
+
+    return errs;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
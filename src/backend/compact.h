@@ -0,0 +1,25 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include "backend.h"
+
+/* rewrite the pair table and model list of segment seg so that every chain is
+ * physically contiguous and freed rows and blocks are released. The segment's
+ * files must be open, and no other process may be using the segment, as the
+ * rewritten files replace the originals by rename. Returns 0 on success */
+int fs_backend_compact(fs_backend *be, fs_segment seg);
+
+/* move the contents of every ptree in segment seg into its frozen file, and
+ * leave the ptrees empty to take later changes. The pair rows they used are
+ * left in the table for fs_backend_compact() to reclaim. The same conditions
+ * apply as for fs_backend_compact(). Returns 0 on success */
+int fs_backend_freeze(fs_backend *be, fs_segment seg);
+
+/* complete any replacement of segment seg's files by fs_backend_compact() or
+ * fs_backend_freeze() that was interrupted, called before the files are
+ * opened. Returns 0 on success */
+int fs_backend_recover_publish(const char *kb, fs_segment seg);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
@@ -0,0 +1,602 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <glib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "frozen.h"
+#include "lockable.h"
+#include "common/params.h"
+#include "common/error.h"
+
+#define FS_FROZEN_ID 0x4a584631
+#define FS_FROZEN_REVISION 0
+
+/* one index entry for every FS_FROZEN_STRIDE keys */
+#define FS_FROZEN_STRIDE 64
+
+/* longest encoding of a pair, two 64 bit varints */
+#define FS_FROZEN_PAIR_MAX 20
+
+#define FS_PACKED __attribute__((__packed__))
+
+struct frozen_header {
+    int32_t id;             // "JXF1"
+    int32_t revision;
+    uint64_t keys;          // number of distinct keys
+    uint64_t pairs;         // number of pairs, including deleted ones
+    uint64_t deleted;       // pairs marked in the bitmap
+    uint64_t data_length;   // bytes of encoded keys, following the header
+    uint64_t index_offset;  // file offset of the sparse index
+    uint64_t index_length;  // entries in the sparse index
+    uint64_t bitmap_offset; // file offset of the deleted pairs bitmap
+    char padding[448];      // allign to a block
+} FS_PACKED;
+
+struct frozen_index {
+    fs_rid pk;              // first key of the stride
+    uint64_t offset;        // offset of the key in the data
+    uint64_t ordinal;       // number of the key's first pair
+} FS_PACKED;
+
+/* Each key is encoded as varints: the difference from the previous key (the
+ * first key of each stride is stored whole), the number of pairs, and the
+ * length of the encoded pairs. Pairs are sorted, pair[0] is stored as the
+ * difference from the previous pair's, pair[1] likewise if pair[0] did not
+ * change, otherwise whole. */
+
+struct _fs_frozen {
+    int fd;
+    int flags;
+    char *filename;
+    size_t length;
+    unsigned char *ptr;
+    struct frozen_header *header;
+    struct frozen_index *index;
+    const unsigned char *data;
+    unsigned char *bitmap;
+};
+
+struct _fs_frozen_it {
+    fs_frozen *fz;
+    fs_rid pair[2];
+    int traverse;
+    uint64_t key;               // number of the next key to decode
+    const unsigned char *kp;    // position of the next key
+    fs_rid prev_pk;
+    fs_rid pk;                  // current key
+    uint32_t length;            // pairs in the current key
+    uint32_t remaining;         // pairs in the current key not yet decoded
+    const unsigned char *pp;    // position of the next pair
+    uint64_t ordinal;           // number of the next pair
+    fs_rid row[2];              // last pair decoded
+};
+
+struct _fs_frozen_writer {
+    char *filename;
+    FILE *out;
+    uint64_t keys;
+    uint64_t pairs;
+    uint64_t offset;
+    fs_rid last_pk;
+    fs_rid prev_pk;
+    GArray *index;
+    unsigned char *buffer;
+    size_t buffer_size;
+};
+
+static int put_varint(unsigned char *out, uint64_t v)
+{
+    int len = 0;
+
+    while (v >= 0x80) {
+        out[len++] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    out[len++] = v;
+
+    return len;
+}
+
+static uint64_t get_varint(const unsigned char **in)
+{
+    const unsigned char *p = *in;
+    uint64_t v = 0;
+    int shift = 0;
+
+    do {
+        v |= (uint64_t)(*p & 0x7f) << shift;
+        shift += 7;
+    } while (*p++ & 0x80);
+    *in = p;
+
+    return v;
+}
+
+static int pair_cmp(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    if (a[0] < b[0]) return -1;
+    if (a[0] > b[0]) return 1;
+    if (a[1] < b[1]) return -1;
+    if (a[1] > b[1]) return 1;
+
+    return 0;
+}
+
+fs_frozen_writer *fs_frozen_writer_new(const char *filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, FS_FILE_MODE);
+    if (fd == -1) {
+        fs_error(LOG_ERR, "cannot create frozen file '%s': %s", filename, strerror(errno));
+
+        return NULL;
+    }
+    fs_frozen_writer *w = calloc(1, sizeof(fs_frozen_writer));
+    w->out = fdopen(fd, "w");
+    struct frozen_header header;
+    memset(&header, 0, sizeof(header));
+    if (fwrite(&header, sizeof(header), 1, w->out) != 1) {
+        fs_error(LOG_ERR, "write to '%s' failed: %s", filename, strerror(errno));
+        fclose(w->out);
+        free(w);
+
+        return NULL;
+    }
+    w->filename = g_strdup(filename);
+    w->index = g_array_new(FALSE, FALSE, sizeof(struct frozen_index));
+
+    return w;
+}
+
+int fs_frozen_writer_add(fs_frozen_writer *w, fs_rid pk, int count, fs_rid pairs[][2])
+{
+    if (count == 0) return 0;
+    if (w->keys && pk <= w->last_pk) {
+        fs_error(LOG_ERR, "key %016llx added to '%s' out of order", pk, w->filename);
+
+        return 1;
+    }
+
+    qsort(pairs, count, sizeof(fs_rid) * 2, pair_cmp);
+    if (w->buffer_size < (size_t)count * FS_FROZEN_PAIR_MAX) {
+        w->buffer_size = (size_t)count * FS_FROZEN_PAIR_MAX;
+        w->buffer = realloc(w->buffer, w->buffer_size);
+    }
+    size_t len = 0;
+    for (int i=0; i<count; i++) {
+        const fs_rid dm = i ? pairs[i][0] - pairs[i-1][0] : pairs[i][0];
+        len += put_varint(w->buffer + len, dm);
+        if (i && !dm) {
+            len += put_varint(w->buffer + len, pairs[i][1] - pairs[i-1][1]);
+        } else {
+            len += put_varint(w->buffer + len, pairs[i][1]);
+        }
+    }
+
+    if (w->keys % FS_FROZEN_STRIDE == 0) {
+        struct frozen_index entry = { pk, w->offset, w->pairs };
+        g_array_append_val(w->index, entry);
+        w->prev_pk = 0;
+    }
+    unsigned char head[30];
+    int hlen = put_varint(head, pk - w->prev_pk);
+    hlen += put_varint(head + hlen, count);
+    hlen += put_varint(head + hlen, len);
+    if (fwrite(head, hlen, 1, w->out) != 1 ||
+        fwrite(w->buffer, len, 1, w->out) != 1) {
+        fs_error(LOG_ERR, "write to '%s' failed: %s", w->filename, strerror(errno));
+
+        return 1;
+    }
+    w->offset += hlen + len;
+    w->prev_pk = pk;
+    w->last_pk = pk;
+    w->keys++;
+    w->pairs += count;
+
+    return 0;
+}
+
+int fs_frozen_writer_finish(fs_frozen_writer *w)
+{
+    int ret = 0;
+    struct frozen_header header;
+    memset(&header, 0, sizeof(header));
+    header.id = FS_FROZEN_ID;
+    header.revision = FS_FROZEN_REVISION;
+    header.keys = w->keys;
+    header.pairs = w->pairs;
+    header.data_length = w->offset;
+    header.index_offset = (sizeof(header) + w->offset + 7) & ~7ULL;
+    header.index_length = w->index->len;
+    /* the bitmap is written to in place, so keep it on its own pages */
+    header.bitmap_offset = (header.index_offset + w->index->len *
+                            sizeof(struct frozen_index) + 4095) & ~4095ULL;
+
+    static const char zeros[8] = { 0 };
+    const size_t pad = header.index_offset - sizeof(header) - w->offset;
+    if ((pad && fwrite(zeros, pad, 1, w->out) != 1) ||
+        (w->index->len && fwrite(w->index->data, sizeof(struct frozen_index),
+                                 w->index->len, w->out) != w->index->len) ||
+        fflush(w->out)) {
+        fs_error(LOG_ERR, "write to '%s' failed: %s", w->filename, strerror(errno));
+        ret = 1;
+    }
+    const int fd = fileno(w->out);
+    if (!ret && ftruncate(fd, header.bitmap_offset + (w->pairs + 7) / 8 + 1)) {
+        fs_error(LOG_ERR, "ftruncate('%s'): %s", w->filename, strerror(errno));
+        ret = 1;
+    }
+    if (!ret && pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+        fs_error(LOG_ERR, "failed to write header on '%s': %s", w->filename, strerror(errno));
+        ret = 1;
+    }
+    if (!ret && fs_fsync(fd)) {
+        fs_error(LOG_ERR, "fsync('%s'): %s", w->filename, strerror(errno));
+        ret = 1;
+    }
+    fclose(w->out);
+    g_array_free(w->index, TRUE);
+    g_free(w->filename);
+    free(w->buffer);
+    free(w);
+
+    return ret;
+}
+
+fs_frozen *fs_frozen_open_filename(const char *filename, int flags)
+{
+    const int writable = (flags & O_ACCMODE) != O_RDONLY;
+    int fd = open(filename, FS_O_NOATIME | (writable ? O_RDWR : O_RDONLY));
+    if (fd == -1) {
+        if (errno != ENOENT) {
+            fs_error(LOG_ERR, "cannot open frozen file '%s': %s", filename, strerror(errno));
+        }
+
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size < sizeof(struct frozen_header)) {
+        fs_error(LOG_ERR, "'%s' is too short to be a frozen file", filename);
+        close(fd);
+
+        return NULL;
+    }
+    void *ptr = mmap(NULL, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0),
+                     MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        fs_error(LOG_ERR, "mmap('%s', %lu): %s", filename, (unsigned long)st.st_size, strerror(errno));
+        close(fd);
+
+        return NULL;
+    }
+
+    fs_frozen *fz = calloc(1, sizeof(fs_frozen));
+    fz->fd = fd;
+    fz->flags = flags;
+    fz->filename = g_strdup(filename);
+    fz->length = st.st_size;
+    fz->ptr = ptr;
+    fz->header = ptr;
+    fz->data = fz->ptr + sizeof(struct frozen_header);
+    fz->index = (struct frozen_index *)(fz->ptr + fz->header->index_offset);
+    fz->bitmap = fz->ptr + fz->header->bitmap_offset;
+
+    if (fz->header->id != FS_FROZEN_ID ||
+        fz->header->revision != FS_FROZEN_REVISION) {
+        fs_error(LOG_ERR, "%s does not appear to be a revision %d frozen file",
+                 filename, FS_FROZEN_REVISION);
+        fs_frozen_close(fz);
+
+        return NULL;
+    }
+    if (fz->header->index_offset + fz->header->index_length *
+        sizeof(struct frozen_index) > fz->length ||
+        fz->header->bitmap_offset + (fz->header->pairs + 7) / 8 > fz->length) {
+        fs_error(LOG_ERR, "%s is truncated", filename);
+        fs_frozen_close(fz);
+
+        return NULL;
+    }
+
+    return fz;
+}
+
+static fs_frozen_it *it_new(fs_frozen *fz, uint64_t entry)
+{
+    fs_frozen_it *it = calloc(1, sizeof(fs_frozen_it));
+    it->fz = fz;
+    it->key = entry * FS_FROZEN_STRIDE;
+    it->kp = fz->data + fz->index[entry].offset;
+    it->ordinal = fz->index[entry].ordinal;
+
+    return it;
+}
+
+static int it_next_key(fs_frozen_it *it)
+{
+    /* account for any pairs of the last key that weren't decoded */
+    it->ordinal += it->remaining;
+    it->remaining = 0;
+    if (it->key >= it->fz->header->keys) return 0;
+
+    if (it->key % FS_FROZEN_STRIDE == 0) it->prev_pk = 0;
+    const unsigned char *p = it->kp;
+    it->pk = it->prev_pk + get_varint(&p);
+    it->prev_pk = it->pk;
+    it->length = it->remaining = get_varint(&p);
+    const uint64_t len = get_varint(&p);
+    it->pp = p;
+    it->kp = p + len;
+    it->key++;
+
+    return 1;
+}
+
+/* decode the next pair of the current key into it->row, returns its ordinal */
+static uint64_t it_next_pair(fs_frozen_it *it)
+{
+    const fs_rid dm = get_varint(&it->pp);
+    if (it->remaining == it->length) {
+        it->row[0] = dm;
+        it->row[1] = get_varint(&it->pp);
+    } else if (dm) {
+        it->row[0] += dm;
+        it->row[1] = get_varint(&it->pp);
+    } else {
+        it->row[1] += get_varint(&it->pp);
+    }
+    it->remaining--;
+
+    return it->ordinal++;
+}
+
+static inline int is_deleted(fs_frozen *fz, uint64_t ordinal)
+{
+    return fz->bitmap[ordinal >> 3] & (1 << (ordinal & 7));
+}
+
+static int mark_deleted(fs_frozen *fz, uint64_t ordinal)
+{
+    if (is_deleted(fz, ordinal)) return 0;
+    fz->bitmap[ordinal >> 3] |= (1 << (ordinal & 7));
+    fz->header->deleted++;
+
+    return 1;
+}
+
+fs_frozen_it *fs_frozen_search(fs_frozen *fz, fs_rid pk, fs_rid pair[2])
+{
+    if (!fz || fz->header->index_length == 0) return NULL;
+
+    /* find the last stride starting at or before pk */
+    uint64_t lo = 0, hi = fz->header->index_length;
+    while (hi - lo > 1) {
+        const uint64_t mid = (lo + hi) / 2;
+        if (fz->index[mid].pk <= pk) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    if (fz->index[lo].pk > pk) return NULL;
+
+    fs_frozen_it *it = it_new(fz, lo);
+    while (it_next_key(it)) {
+        if (it->pk == pk) {
+            it->pair[0] = pair ? pair[0] : FS_RID_NULL;
+            it->pair[1] = pair ? pair[1] : FS_RID_NULL;
+
+            return it;
+        }
+        if (it->pk > pk) break;
+    }
+    free(it);
+
+    return NULL;
+}
+
+fs_frozen_it *fs_frozen_traverse(fs_frozen *fz, fs_rid mrid)
+{
+    if (!fz || fz->header->index_length == 0) return NULL;
+
+    fs_frozen_it *it = it_new(fz, 0);
+    it->traverse = 1;
+    it->pair[0] = mrid;
+    it->pair[1] = FS_RID_NULL;
+
+    return it;
+}
+
+static int it_next_match(fs_frozen_it *it, uint64_t *ordinal)
+{
+    for (;;) {
+        while (it->remaining) {
+            const uint64_t ord = it_next_pair(it);
+            if (is_deleted(it->fz, ord)) continue;
+            if ((it->pair[0] == FS_RID_NULL || it->pair[0] == it->row[0]) &&
+                (it->pair[1] == FS_RID_NULL || it->pair[1] == it->row[1])) {
+                if (ordinal) *ordinal = ord;
+
+                return 1;
+            }
+        }
+        if (!it->traverse || !it_next_key(it)) return 0;
+    }
+}
+
+int fs_frozen_it_next(fs_frozen_it *it, fs_rid *pk, fs_rid pair[2])
+{
+    if (!it || !it_next_match(it, NULL)) return 0;
+    if (pk) *pk = it->pk;
+    pair[0] = it->row[0];
+    pair[1] = it->row[1];
+
+    return 1;
+}
+
+int fs_frozen_it_get_length(fs_frozen_it *it)
+{
+    if (!it) return 0;
+    if (it->traverse) return it->fz->header->pairs;
+
+    return it->length;
+}
+
+void fs_frozen_it_free(fs_frozen_it *it)
+{
+    free(it);
+}
+
+static int check_writable(fs_frozen *fz)
+{
+    if ((fz->flags & O_ACCMODE) == O_RDONLY) {
+        fs_error(LOG_ERR, "tried to remove from read-only frozen file '%s'", fz->filename);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+int fs_frozen_remove_pairs(fs_frozen *fz, fs_rid pk, int count, fs_rid pairs[][2])
+{
+    if (!fz || check_writable(fz)) return 0;
+
+    fs_frozen_it *it = fs_frozen_search(fz, pk, NULL);
+    if (!it) return 0;
+
+    /* both lists are sorted, so walk them together */
+    int removed = 0;
+    int i = 0;
+    while (it->remaining && i < count) {
+        const uint64_t ord = it_next_pair(it);
+        while (i < count && (pairs[i][0] < it->row[0] ||
+               (pairs[i][0] == it->row[0] && pairs[i][1] != FS_RID_NULL &&
+                pairs[i][1] < it->row[1]))) {
+            i++;
+        }
+        if (i < count && pairs[i][0] == it->row[0] &&
+            (pairs[i][1] == FS_RID_NULL || pairs[i][1] == it->row[1])) {
+            removed += mark_deleted(fz, ord);
+        }
+    }
+    fs_frozen_it_free(it);
+
+    return removed;
+}
+
+int fs_frozen_remove_all(fs_frozen *fz, fs_rid pair[2])
+{
+    if (!fz || check_writable(fz)) return 0;
+
+    fs_frozen_it *it = fs_frozen_traverse(fz, FS_RID_NULL);
+    if (!it) return 0;
+    it->pair[0] = pair[0];
+    it->pair[1] = pair[1];
+    int removed = 0;
+    uint64_t ord;
+    while (it_next_match(it, &ord)) {
+        removed += mark_deleted(fz, ord);
+    }
+    fs_frozen_it_free(it);
+
+    return removed;
+}
+
+long long fs_frozen_count(fs_frozen *fz)
+{
+    if (!fz) return 0;
+
+    return fz->header->pairs - fz->header->deleted;
+}
+
+int fs_frozen_sync(fs_frozen *fz)
+{
+    if (!fz || (fz->flags & O_ACCMODE) == O_RDONLY) return 0;
+    if (msync(fz->ptr, fz->length, MS_ASYNC)) {
+        fs_error(LOG_ERR, "msync(%s): %s", fz->filename, strerror(errno));
+
+        return 1;
+    }
+
+    return 0;
+}
+
+int fs_frozen_unlink(fs_frozen *fz)
+{
+    if (!fz) {
+        fs_error(LOG_ERR, "tried to unlink NULL frozen file");
+
+        return 1;
+    }
+
+    return unlink(fz->filename);
+}
+
+int fs_frozen_close(fs_frozen *fz)
+{
+    if (!fz) {
+        fs_error(LOG_ERR, "tried to close NULL frozen file");
+
+        return 1;
+    }
+    if (munmap(fz->ptr, fz->length) == -1) {
+        fs_error(LOG_CRIT, "failed to unmap '%s'", fz->filename);
+    }
+    close(fz->fd);
+    g_free(fz->filename);
+    free(fz);
+
+    return 0;
+}
+
+void fs_frozen_print(fs_frozen *fz, FILE *out, int verbosity)
+{
+    const struct frozen_header *h = fz->header;
+
+    fprintf(out, "frozen:  %s\n", fz->filename);
+    fprintf(out, "keys:    %lld\n", (long long)h->keys);
+    fprintf(out, "pairs:   %lld (%lld deleted)\n", (long long)h->pairs, (long long)h->deleted);
+    fprintf(out, "data:    %lld bytes", (long long)h->data_length);
+    if (h->pairs) {
+        fprintf(out, ", %.1f per pair", (double)h->data_length / h->pairs);
+    }
+    fprintf(out, "\nindex:   %lld entries\n", (long long)h->index_length);
+
+    if (verbosity > 0) {
+        fs_frozen_it *it = fs_frozen_traverse(fz, FS_RID_NULL);
+        fs_rid pk, pair[2];
+        while (fs_frozen_it_next(it, &pk, pair)) {
+            fprintf(out, "%016llx %016llx %016llx\n", pk, pair[0], pair[1]);
+        }
+        fs_frozen_it_free(it);
+    }
+}
+
+/* vi:set expandtab sts=4 sw=4: */
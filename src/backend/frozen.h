@@ -0,0 +1,52 @@
+#ifndef FROZEN_H
+#define FROZEN_H
+
+#include "backend.h"
+
+/* A frozen file is an immutable, compressed copy of a ptree: the keys are
+ * stored in order, each followed by its (model, other) pairs sorted and
+ * delta encoded, with a sparse index over the keys. The only mutable part is
+ * a bitmap marking pairs that have since been deleted. New data goes into the
+ * ptree the frozen file sits beside. */
+
+#define FS_FROZEN_SUFFIX ".frozen"
+
+typedef struct _fs_frozen fs_frozen;
+typedef struct _fs_frozen_it fs_frozen_it;
+typedef struct _fs_frozen_writer fs_frozen_writer;
+
+/* returns NULL without logging an error if the file does not exist */
+fs_frozen *fs_frozen_open_filename(const char *filename, int flags);
+
+/* keys must be added in ascending order, pairs[] is sorted in place */
+fs_frozen_writer *fs_frozen_writer_new(const char *filename);
+int fs_frozen_writer_add(fs_frozen_writer *w, fs_rid pk, int count, fs_rid pairs[][2]);
+/* write out the index and header, and close the file. Returns 0 on success */
+int fs_frozen_writer_finish(fs_frozen_writer *w);
+
+/* iterate the pairs for pk, pair[] may contain FS_RID_NULL wildcards */
+fs_frozen_it *fs_frozen_search(fs_frozen *fz, fs_rid pk, fs_rid pair[2]);
+/* iterate every key in order, restricted to model mrid if it's not NULL */
+fs_frozen_it *fs_frozen_traverse(fs_frozen *fz, fs_rid mrid);
+int fs_frozen_it_next(fs_frozen_it *it, fs_rid *pk, fs_rid pair[2]);
+/* upper bound, deleted pairs are included */
+int fs_frozen_it_get_length(fs_frozen_it *it);
+void fs_frozen_it_free(fs_frozen_it *it);
+
+/* mark pairs of pk deleted, pairs[] must be sorted by pair[0] then pair[1],
+ * and pair[1] may be FS_RID_NULL. Returns the number of pairs removed */
+int fs_frozen_remove_pairs(fs_frozen *fz, fs_rid pk, int count, fs_rid pairs[][2]);
+/* mark all pairs matching pair deleted, for any key */
+int fs_frozen_remove_all(fs_frozen *fz, fs_rid pair[2]);
+
+/* number of pairs that have not been deleted */
+long long fs_frozen_count(fs_frozen *fz);
+int fs_frozen_sync(fs_frozen *fz);
+int fs_frozen_unlink(fs_frozen *fz);
+int fs_frozen_close(fs_frozen *fz);
+
+void fs_frozen_print(fs_frozen *fz, FILE *out, int verbosity);
+
+/* vi:set expandtab sts=4 sw=4: */
+
+#endif
@@ -0,0 +1,202 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* round trip random keys and pairs through a frozen file: write it, then
+ * check searches, traversals, model filtering and deletes against what was
+ * written, and that deletes survive reopening the file */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <glib.h>
+
+#include "frozen.h"
+
+#define KEYS 1000
+#define MAX_PAIRS 20
+#define MODEL(n) (0x4000000000000000ULL | (n))
+
+static fs_rid keys[KEYS];
+static int count[KEYS];
+static fs_rid pairs[KEYS][MAX_PAIRS][2];
+
+static int errors = 0;
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        printf("ERROR %s\n", what);
+        errors++;
+    }
+}
+
+static int cmp_pair(const void *a, const void *b)
+{
+    const fs_rid *pa = a, *pb = b;
+
+    if (pa[0] != pb[0]) return pa[0] < pb[0] ? -1 : 1;
+    if (pa[1] != pb[1]) return pa[1] < pb[1] ? -1 : 1;
+
+    return 0;
+}
+
+/* random keys, mostly dense with the odd big jump to exercise the varints */
+static long long make_data(void)
+{
+    long long total = 0;
+    fs_rid k = 5;
+
+    srand(1);
+    for (int i=0; i<KEYS; i++) {
+        k += 1 + (rand() % 3 == 0 ? (fs_rid)rand() << 20 : rand() % 100);
+        keys[i] = k;
+        count[i] = 1 + rand() % MAX_PAIRS;
+        for (int j=0; j<count[i]; j++) {
+            pairs[i][j][0] = MODEL(rand() % 3);
+            pairs[i][j][1] = ((fs_rid)rand() << 32) | rand();
+        }
+        qsort(pairs[i], count[i], sizeof(pairs[i][0]), cmp_pair);
+        total += count[i];
+    }
+
+    return total;
+}
+
+static long long traverse_count(fs_frozen *fz, fs_rid model)
+{
+    fs_frozen_it *it = fs_frozen_traverse(fz, model);
+    fs_rid pk, pair[2];
+    long long n = 0;
+
+    while (it && fs_frozen_it_next(it, &pk, pair)) {
+        if (model != FS_RID_NULL && pair[0] != model) {
+            check(0, "traversal returned a pair from the wrong model");
+        }
+        n++;
+    }
+    fs_frozen_it_free(it);
+
+    return n;
+}
+
+int main(int argc, char *argv[])
+{
+    char *filename = g_strdup_printf("/tmp/test-%d.frozen", (int)getpid());
+    const long long total = make_data();
+
+    fs_frozen_writer *w = fs_frozen_writer_new(filename);
+    check(w != NULL, "failed to create frozen file");
+    if (!w) return 1;
+    for (int i=0; i<KEYS; i++) {
+        check(!fs_frozen_writer_add(w, keys[i], count[i], pairs[i]),
+              "failed to add key");
+    }
+    check(!fs_frozen_writer_finish(w), "failed to finish frozen file");
+
+    fs_frozen *fz = fs_frozen_open_filename(filename, O_RDWR);
+    check(fz != NULL, "failed to open frozen file");
+    if (!fz) return 1;
+
+    /* every key gives back exactly its own pairs, in order */
+    for (int i=0; i<KEYS; i++) {
+        fs_rid any[2] = { FS_RID_NULL, FS_RID_NULL };
+        fs_frozen_it *it = fs_frozen_search(fz, keys[i], any);
+        check(it != NULL, "key not found");
+        if (!it) continue;
+        fs_rid pair[2];
+        int j = 0;
+        while (fs_frozen_it_next(it, NULL, pair)) {
+            if (j < count[i]) {
+                check(pair[0] == pairs[i][j][0] && pair[1] == pairs[i][j][1],
+                      "search returned the wrong pair");
+            }
+            j++;
+        }
+        check(j == count[i], "search returned the wrong number of pairs");
+        fs_frozen_it_free(it);
+
+        /* and a key that was never added isn't found */
+        if (i + 1 == KEYS || keys[i+1] != keys[i] + 1) {
+            it = fs_frozen_search(fz, keys[i] + 1, any);
+            check(it == NULL, "found a key that was never added");
+            fs_frozen_it_free(it);
+        }
+    }
+    check(fs_frozen_search(fz, 1, NULL) == NULL, "found a key below the first");
+    check(traverse_count(fz, FS_RID_NULL) == total,
+          "traversal returned the wrong number of pairs");
+
+    /* model 1 of one key, one pair of another, and model 2 everywhere */
+    long long removed = 0;
+    fs_rid model1[1][2] = { { MODEL(1), FS_RID_NULL } };
+    int expect = 0;
+    for (int j=0; j<count[10]; j++) {
+        if (pairs[10][j][0] == MODEL(1)) expect++;
+    }
+    int got = fs_frozen_remove_pairs(fz, keys[10], 1, model1);
+    check(got == expect, "removed the wrong number of pairs of a model");
+    removed += got;
+
+    fs_rid one[1][2] = { { pairs[20][0][0], pairs[20][0][1] } };
+    got = fs_frozen_remove_pairs(fz, keys[20], 1, one);
+    check(got == 1, "failed to remove one pair");
+    removed += got;
+
+    fs_rid model2[2] = { MODEL(2), FS_RID_NULL };
+    long long expect2 = 0;
+    for (int i=0; i<KEYS; i++) {
+        for (int j=0; j<count[i]; j++) {
+            if (pairs[i][j][0] != MODEL(2)) continue;
+            if (i == 20 && j == 0) continue;
+            expect2++;
+        }
+    }
+    got = fs_frozen_remove_all(fz, model2);
+    check(got == expect2, "removed the wrong number of pairs of model 2");
+    removed += got;
+
+    check(fs_frozen_count(fz) == total - removed,
+          "count is wrong after removing pairs");
+    check(traverse_count(fz, MODEL(2)) == 0, "removed pairs still traversed");
+    check(!fs_frozen_close(fz), "failed to close frozen file");
+
+    /* the deletes are kept in the file */
+    fz = fs_frozen_open_filename(filename, O_RDONLY);
+    check(fz != NULL, "failed to reopen frozen file");
+    if (!fz) return 1;
+    check(fs_frozen_count(fz) == total - removed,
+          "count is wrong after reopening");
+    check(traverse_count(fz, FS_RID_NULL) == total - removed,
+          "traversal is wrong after reopening");
+    traverse_count(fz, MODEL(0));
+    fs_frozen_close(fz);
+
+    unlink(filename);
+    g_free(filename);
+
+    if (errors) {
+        printf("FAIL, %d errors\n", errors);
+
+        return 1;
+    }
+    printf("PASS\n");
+
+    return 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -45,6 +45,12 @@
 #define RES_BUF_SIZE  10240
 #define QUAD_BUF_SIZE 10240
 
+/* the number of model list blocks we're prepared to walk per deleted quad in
+ * order to remove it from the model index exactly, rather than marking the
+ * model as a superset */
+#define MODEL_DELETE_BLOCKS_PER_QUAD 64
+#define MODEL_DELETE_BLOCKS_MIN      16384
+
 #define CACHE_SIZE 32768
 #define CACHE_MASK (CACHE_SIZE - 1)
 #define CACHE_ENTRY(r) (rid_cache[((r)>>10) & CACHE_MASK])
@@ -63,6 +69,9 @@ struct q_buf {
 
 static struct q_buf quad_buffer[QUAD_BUF_SIZE];
 
+/* pairs with the same predicate and key, waiting to be added to a ptree */
+static fs_rid run_pairs[QUAD_BUF_SIZE][2];
+
 int quick_res_check(fs_backend *be, int seg, fs_rid rid, char *lex)
 {
     if (CACHE_ENTRY(rid) == rid) {
@@ -88,7 +97,16 @@ int fs_res_import(fs_backend *be, int seg, long count, fs_resource buffer[])
 	    //}
 	}
 	if (res_pos == RES_BUF_SIZE) {
+	    /* resources are written out under a short lock, even during an
+	     * import */
+	    const int locking = fs_lockable_test(be->res, LOCK_UN);
+	    if (locking && fs_lockable_lock(be->res, LOCK_EX)) {
+		return 1;
+	    }
 	    fs_res_import_commit(be, seg, 0);
+	    if (locking && fs_lockable_lock(be->res, LOCK_UN)) {
+		return 1;
+	    }
 	}
     }
     double now = fs_time();
@@ -121,6 +139,11 @@ int fs_res_import_commit(fs_backend *be, int seg, int account)
     return 0;
 }
 
+int fs_quad_import_would_flush(int count)
+{
+    return quad_pos + count >= QUAD_BUF_SIZE;
+}
+
 int fs_quad_import(fs_backend *be, int seg, int flags, int count, fs_rid buffer[][4])
 {
     if ((flags & (FS_BIND_BY_SUBJECT | FS_BIND_BY_OBJECT)) == 0) {
@@ -160,7 +183,23 @@ int fs_quad_import(fs_backend *be, int seg, int flags, int count, fs_rid buffer[
 			sizeof(fs_rid) * 4, O_CREAT | O_TRUNC | O_RDWR);
 		}
 	    }
+	    /* writes outside an import don't hold the model and predicate
+	     * locks between messages */
+	    const int locking = fs_lockable_test(be->models, LOCK_UN);
+	    if (locking) {
+		if (fs_lockable_lock(be->models, LOCK_EX)) {
+		    return 1;
+		}
+		if (fs_lockable_lock(be->predicates, LOCK_EX)) {
+		    fs_lockable_lock(be->models, LOCK_UN);
+		    return 1;
+		}
+	    }
 	    int ret = fs_quad_import_commit(be, seg, flags, 0);
+	    if (locking) {
+		fs_lockable_lock(be->predicates, LOCK_UN);
+		fs_lockable_lock(be->models, LOCK_UN);
+	    }
 	    if (ret) {
 		fs_error(LOG_CRIT, "quad commit failed");
 
@@ -284,15 +323,37 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
 		qsort(quad_buffer, quad_pos, sizeof(struct q_buf),
 		      qbuf_sort_po);
 	    }
-	    const int force = pass == 1 ? 1 : 0;
+	    int ds0, ds1, pk;
+	    if (pass == 0) {
+		ds0 = 0; ds1 = 3; pk = 1;
+	    } else {
+		ds0 = 0; ds1 = 1; pk = 3;
+	    }
 	    fs_rid last_pred = FS_RID_NULL;
 	    fs_ptree *pt = NULL;
-
-	    for (int i=0; i<quad_pos; i++) {
-		if (quad_buffer[i].skip) continue;
+	    fs_rid run_pk = FS_RID_NULL;
+	    int run = 0;
+
+	    /* the buffer is sorted, so each ptree is locked once, and each
+	     * key's pairs are added as one run */
+	    for (int i=0; i<=quad_pos; i++) {
+		if (i < quad_pos && quad_buffer[i].skip) continue;
+
+		if (run && (i == quad_pos ||
+			    quad_buffer[i].quad[2] != last_pred ||
+			    quad_buffer[i].quad[pk] != run_pk)) {
+		    if (fs_ptree_add_pairs(pt, run_pk, run, run_pairs)) {
+			fs_error(LOG_CRIT, "failed to add %d pairs to ptree", run);
+		    } else if (pass == 0) {
+			be->approx_size += run;
+		    }
+		    run = 0;
+		}
+		if (i == quad_pos) break;
 
 		const fs_rid pred = quad_buffer[i].quad[2];
 		if (last_pred != pred) {
+		    if (pt) fs_lockable_lock(pt, LOCK_UN);
 		    pt = NULL;
 		    pt = fs_backend_get_ptree(be, pred, pass);
 		    if (!pt) {
@@ -302,26 +363,16 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
 			if (pass == 0) pt = r->ptree_s;
 			else pt = r->ptree_o;
 		    }
+                    fs_assert(pt);
+                    fs_lockable_lock(pt, LOCK_EX);
 		    last_pred = pred;
 		}
-                fs_assert(pt);
-		int ds0, ds1, pk;
-		if (pass == 0) {
-		    ds0 = 0; ds1 = 3; pk = 1;
-		} else {
-		    ds0 = 0; ds1 = 1; pk = 3;
-		}
-		fs_rid pair[2] = { quad_buffer[i].quad[ds0], quad_buffer[i].quad[ds1] };
-                fs_lockable_lock(pt, LOCK_EX);
-		int ret = fs_ptree_add(pt, quad_buffer[i].quad[pk], pair, force);
-                fs_lockable_lock(pt, LOCK_UN);
-		if (pass == 0 && ret) {
-		    quad_buffer[i].skip = 1;
-		}
-		if (pass == 0 && !ret) {
-		    (be->approx_size)++;
-		}
+		run_pk = quad_buffer[i].quad[pk];
+		run_pairs[run][0] = quad_buffer[i].quad[ds0];
+		run_pairs[run][1] = quad_buffer[i].quad[ds1];
+		run++;
 	    }
+	    if (pt) fs_lockable_lock(pt, LOCK_UN);
 	}
     }
 
@@ -394,58 +445,176 @@ int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account)
     return 0;
 }
 
-int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
+static int qbuf_sort_keys(const struct q_buf *a, const struct q_buf *b,
+                          const int keys[4])
 {
-    int errors = 0;
-    fs_rid_set *preds = fs_rid_set_new();
-    for (int i=0; i<quads[2]->length; i++) {
-	fs_rid_set_add(preds, quads[2]->data[i]);
-    }
-    fs_rid_set *models = fs_rid_set_new();
-    for (int i=0; i<quads[0]->length; i++) {
-	fs_rid_set_add(models, quads[0]->data[i]);
+    for (int i=0; i<4; i++) {
+	if (a->quad[keys[i]] < b->quad[keys[i]]) {
+	    return -1;
+	}
+	if (a->quad[keys[i]] > b->quad[keys[i]]) {
+	    return 1;
+	}
     }
-    fs_rid pred;
-    fs_rid_set_rewind(preds);
-    while ((pred = fs_rid_set_next(preds)) != FS_RID_NULL) {
-	fs_ptree *sfp = fs_backend_get_ptree(be, pred, 0);
-	fs_ptree *ofp = fs_backend_get_ptree(be, pred, 1);
-	if (!sfp && !ofp) {
-	    /* this predicate doesn't exist in this segment */
-	    continue;
+
+    return 0;
+}
+
+static int qbuf_sort_psmo(const void *va, const void *vb)
+{
+    const int keys[4] = { 2, 1, 0, 3 };
+
+    return qbuf_sort_keys(va, vb, keys);
+}
+
+static int qbuf_sort_poms(const void *va, const void *vb)
+{
+    const int keys[4] = { 2, 3, 0, 1 };
+
+    return qbuf_sort_keys(va, vb, keys);
+}
+
+static int qbuf_sort_mspo(const void *va, const void *vb)
+{
+    const int keys[4] = { 0, 1, 2, 3 };
+
+    return qbuf_sort_keys(va, vb, keys);
+}
+
+/* remove the quads in qb from either the S (pass 0) or O (pass 1) ptrees.
+ * The quads are sorted so that each ptree is locked once, and each leaf is
+ * found and its chain walked once, however many quads share the key */
+static int delete_sorted_quads(fs_backend *be, struct q_buf *qb, int count,
+                               int pass, fs_rid pairs[][2])
+{
+    int errors = 0;
+    const int pk = pass == 0 ? 1 : 3;
+    const int ds = pass == 0 ? 3 : 1;
+
+    qsort(qb, count, sizeof(struct q_buf), pass == 0 ? qbuf_sort_psmo :
+          qbuf_sort_poms);
+
+    int i = 0;
+    while (i < count) {
+	const fs_rid pred = qb[i].quad[2];
+	int pred_end = i;
+	while (pred_end < count && qb[pred_end].quad[2] == pred) {
+	    pred_end++;
 	}
-	if (!sfp) {
-	    fs_error(LOG_CRIT, "failed to get s ptree for pred %016llx", pred);
+	fs_ptree *pt = fs_backend_get_ptree(be, pred, pass);
+	if (!pt) {
+	    if (fs_backend_get_ptree(be, pred, !pass)) {
+		fs_error(LOG_CRIT, "failed to get %c ptree for pred %016llx",
+			 pass == 0 ? 's' : 'o', pred);
+		errors++;
+	    }
+	    /* otherwise this predicate doesn't exist in this segment */
+	    i = pred_end;
 	    continue;
 	}
-	if (!ofp) {
-	    fs_error(LOG_CRIT, "failed to get o ptree for pred %016llx", pred);
+	if (fs_lockable_lock(pt, LOCK_EX)) {
+	    errors++;
+	    i = pred_end;
 	    continue;
 	}
-	fs_lockable_lock(sfp, LOCK_EX);
-	fs_lockable_lock(ofp, LOCK_EX);
-	for (int i=0; i<quads[2]->length; i++) {
-	    if (quads[2]->data[i] == pred) {
-		fs_rid spair[2] = { quads[0]->data[i], quads[3]->data[i] };
-		fs_ptree_remove(sfp, quads[1]->data[i], spair);
-		fs_rid opair[2] = { quads[0]->data[i], quads[1]->data[i] };
-		fs_ptree_remove(ofp, quads[3]->data[i], opair);
+	while (i < pred_end) {
+	    const fs_rid key = qb[i].quad[pk];
+	    int npairs = 0;
+	    for (; i < pred_end && qb[i].quad[pk] == key; i++) {
+		pairs[npairs][0] = qb[i].quad[0];
+		pairs[npairs][1] = qb[i].quad[ds];
+		npairs++;
 	    }
+	    /* a non-zero return just means none of the quads were present */
+	    fs_ptree_remove_pairs(pt, key, npairs, pairs);
+	}
+	if (fs_lockable_lock(pt, LOCK_UN)) {
+	    errors++;
 	}
-	fs_lockable_lock(ofp, LOCK_UN);
-	fs_lockable_lock(sfp, LOCK_UN);
     }
-    fs_rid_set_free(preds);
-    fs_rid model;
-    fs_rid_set_rewind(preds);
-    while ((model = fs_rid_set_next(models)) != FS_RID_NULL) {
+
+    return errors;
+}
+
+/* remove the quads in qb from the model list chains. Where the chain is short
+ * enough to walk the triples are removed exactly and the chain compacted,
+ * otherwise the chain is marked as a superset, to be checked on read */
+static int delete_model_quads(fs_backend *be, struct q_buf *qb, int count,
+                              fs_rid triples[][3])
+{
+    qsort(qb, count, sizeof(struct q_buf), qbuf_sort_mspo);
+
+    /* other processes walk the chains under a shared models lock, so they
+     * mustn't see blocks being repacked or freed */
+    const int locking = fs_lockable_test(be->models, LOCK_UN);
+    if (locking && fs_lockable_lock(be->models, LOCK_EX)) {
+	return 1;
+    }
+
+    int i = 0;
+    while (i < count) {
+	const fs_rid model = qb[i].quad[0];
+	int ntriples = 0;
+	for (; i < count && qb[i].quad[0] == model; i++) {
+	    triples[ntriples][0] = qb[i].quad[1];
+	    triples[ntriples][1] = qb[i].quad[2];
+	    triples[ntriples][2] = qb[i].quad[3];
+	    ntriples++;
+	}
+
         fs_index_node val = 0;
-        fs_mhash_get(be->models, model, &val);
-        if (val > 1) {
+        fs_mhash_get_r(be->models, model, &val);
+        if (val <= 1) {
+	    /* no model list chain, or stored in a tlist */
+	    continue;
+	}
+	int max_blocks = ntriples * MODEL_DELETE_BLOCKS_PER_QUAD;
+	if (max_blocks < MODEL_DELETE_BLOCKS_MIN) {
+	    max_blocks = MODEL_DELETE_BLOCKS_MIN;
+	}
+	int removed = fs_tbchain_remove_triples(be->model_list, val, ntriples,
+						triples, max_blocks);
+	if (removed < 0) {
 	    fs_tbchain_set_bit(be->model_list, val, FS_TBCHAIN_SUPERSET);
+	} else if (removed > 0) {
+	    fs_tbchain_compact_chain(be->model_list, val);
 	}
     }
 
+    if (locking && fs_lockable_lock(be->models, LOCK_UN)) {
+	return 1;
+    }
+
+    return 0;
+}
+
+int fs_delete_quads(fs_backend *be, fs_rid_vector *quads[4])
+{
+    int errors = 0;
+    const int count = quads[0]->length;
+
+    if (count == 0) {
+	return 0;
+    }
+
+    struct q_buf *qb = malloc(count * sizeof(struct q_buf));
+    fs_rid (*pairs)[2] = malloc(count * sizeof(fs_rid) * 2);
+    for (int i=0; i<count; i++) {
+	qb[i].skip = 0;
+	for (int j=0; j<4; j++) {
+	    qb[i].quad[j] = quads[j]->data[i];
+	}
+    }
+
+    errors += delete_sorted_quads(be, qb, count, 0, pairs);
+    errors += delete_sorted_quads(be, qb, count, 1, pairs);
+    free(pairs);
+
+    fs_rid (*triples)[3] = malloc(count * sizeof(fs_rid) * 3);
+    errors += delete_model_quads(be, qb, count, triples);
+    free(triples);
+    free(qb);
+
     return errors;
 }
 
@@ -9,6 +9,9 @@ int fs_res_import_commit(fs_backend *be, int seg, int account);
 
 int fs_quad_import(fs_backend *be, int seg, int flags, int count, fs_rid buffer[][4]);
 
+/* true if adding count quads will write the quad buffer out */
+int fs_quad_import_would_flush(int count);
+
 int fs_quad_import_commit(fs_backend *be, int seg, int flags, int account);
 
 int fs_delete_models(fs_backend *be, int seg, fs_rid_vector *mvec);
@@ -29,6 +29,9 @@
 #include "lock.h"
 #include "common/error.h"
 
+/* the descriptor holding the KB lock, kept open for the life of the process */
+static int kb_lock_fd = -1;
+
 int fs_lock_kb(const char *kb)
 {
     char *fn = g_strdup_printf(FS_MD_FILE, kb);
@@ -50,10 +53,42 @@ int fs_lock_kb(const char *kb)
 
         return 1;
     }
+    kb_lock_fd = fd;
 
     return 0;
+}
+
+int fs_lock_kb_held(void)
+{
+    return kb_lock_fd != -1;
 }           
 
+int fs_lock_import(fs_backend *be, int operation)
+{
+    static int fd = -1;
+
+    if (fd == -1) {
+        char *fn = g_strdup_printf(FS_FILE_LOCK, fs_backend_get_kb(be),
+                                   fs_backend_get_segment(be), "import");
+        fd = open(fn, FS_O_NOATIME | O_RDWR | O_CREAT, 0600);
+        if (fd == -1) {
+            fs_error(LOG_CRIT, "failed to open import lock %s: %s",
+                     fn, strerror(errno));
+            g_free(fn);
+
+            return 1;
+        }
+        g_free(fn);
+    }
+    if (flock(fd, operation) == -1) {
+        fs_error(LOG_ERR, "failed to get import lock: %s", strerror(errno));
+
+        return 1;
+    }
+
+    return 0;
+}
+
 int fs_flock_logged(int fd, int op, const char *file, int line)
 {
     char opstr[8] = { 0, 0, 0, 0, 0 };
@@ -5,4 +5,11 @@
 
 int fs_lock_kb(const char *kb);
 
+/* true if this process holds the KB lock taken by fs_lock_kb() */
+int fs_lock_kb_held(void);
+
+/* serialises imports into the backend's segment, without touching the
+ * locks that queries take */
+int fs_lock_import(fs_backend *be, int operation);
+
 #endif
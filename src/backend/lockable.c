@@ -6,13 +6,75 @@
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <errno.h>
+#include <glib.h>
 #include "lockable.h"
+#include "common/params.h"
 #include "common/error.h"
 
 #ifdef __linux__
 #define st_mtimespec st_mtim
 #endif
 
+/* Change counters shared by every process using a segment, kept in a small
+ * mmaped file in the segment directory. The slot for a file is bumped when
+ * an exclusive lock on it is released, so lockers only have to reread
+ * metadata when it has moved on, rather than fstat()ing on every lock.
+ * Files that share a slot just cause some unnecessary rereads. */
+#define FS_GEN_FILE "generations"
+#define FS_GEN_SLOTS 4096
+
+static GHashTable *gen_maps = NULL;
+
+static volatile uint64_t *fs_lockable_gen_slot(const char *filename)
+{
+    const size_t rlen = strlen(FS_STORE_ROOT "/");
+
+    /* only files inside a segment directory are shared */
+    if (strncmp(filename, FS_STORE_ROOT "/", rlen))
+        return NULL;
+    const char *kb_end = strchr(filename + rlen, '/');
+    if (!kb_end)
+        return NULL;
+    const char *seg_end = strchr(kb_end + 1, '/');
+    if (!seg_end)
+        return NULL;
+
+    if (!gen_maps)
+        gen_maps = g_hash_table_new(g_str_hash, g_str_equal);
+    char *dir = g_strndup(filename, seg_end - filename);
+    uint64_t *slots = g_hash_table_lookup(gen_maps, dir);
+    if (slots) {
+        g_free(dir);
+    } else {
+        const off_t size = FS_GEN_SLOTS * sizeof(uint64_t);
+        char *genfile = g_strdup_printf("%s/" FS_GEN_FILE, dir);
+        struct stat stat;
+        int fd = open(genfile, FS_O_NOATIME | O_RDWR | O_CREAT, FS_FILE_MODE);
+        if (fd == -1 || fstat(fd, &stat) ||
+            (stat.st_size < size && ftruncate(fd, size))) {
+            fs_error(LOG_WARNING, "cannot use %s: %s", genfile, strerror(errno));
+            if (fd != -1) close(fd);
+            g_free(genfile);
+            g_free(dir);
+
+            return NULL;
+        }
+        slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (slots == MAP_FAILED) {
+            fs_error(LOG_WARNING, "mmap(%s): %s", genfile, strerror(errno));
+            g_free(genfile);
+            g_free(dir);
+
+            return NULL;
+        }
+        g_free(genfile);
+        g_hash_table_insert(gen_maps, dir, slots);
+    }
+
+    return slots + (g_str_hash(seg_end + 1) % FS_GEN_SLOTS);
+}
+
 /* flush any cached data to disc after writing out the required metadata */
 static int fs_lockable_sync(fs_lockable_t *hf)
 {
@@ -68,12 +130,17 @@ static int fs_lockable_do_lock(fs_lockable_t *hf, int operation)
     if ( (hf->locktype & LOCK_EX) && (operation & LOCK_UN) ) {
         if (fs_lockable_sync(hf))
             return -1;
-        /* update the mtime before releasing the lock */
-        if (fstat(hf->fd, &stat) < 0) {
-            fs_error(LOG_ERR, "fstat(%s): %s", hf->filename, strerror(errno));
-            return -1;
+        if (hf->gen) {
+            /* tell everyone else the file has changed */
+            hf->generation = __sync_add_and_fetch(hf->gen, 1);
+        } else {
+            /* update the mtime before releasing the lock */
+            if (fstat(hf->fd, &stat) < 0) {
+                fs_error(LOG_ERR, "fstat(%s): %s", hf->filename, strerror(errno));
+                return -1;
+            }
+            memcpy(&hf->mtime, &stat.st_mtimespec, sizeof(struct timespec));
         }
-        memcpy(&hf->mtime, &stat.st_mtimespec, sizeof(struct timespec));
     }
 
     /* release or acquire the lock */
@@ -85,7 +152,14 @@ static int fs_lockable_do_lock(fs_lockable_t *hf, int operation)
     hf->locktype = operation;
 
     /* if we are acquiring the lock, read any metadata if necessary */
-    if ( hf->read_metadata && (operation & (LOCK_EX|LOCK_SH)) ) {
+    if ( hf->read_metadata && hf->gen && (operation & (LOCK_EX|LOCK_SH)) ) {
+        const uint64_t generation = *hf->gen;
+        if (generation != hf->generation) {
+            if ( (hf->read_metadata)(hf) )
+                return -1;
+            hf->generation = generation;
+        }
+    } else if ( hf->read_metadata && (operation & (LOCK_EX|LOCK_SH)) ) {
         if (fstat(hf->fd, &stat) < 0) {
             fs_error(LOG_ERR, "fstat(%s): %s", hf->filename, strerror(errno));
             return -1;
@@ -117,6 +191,8 @@ int fs_lockable_init(fs_lockable_t *hf)
     struct stat stat;
     int file_length;
 
+    hf->gen = fs_lockable_gen_slot(hf->filename);
+
     /* read or create the file header metadata */
     if ( (hf->flags & O_TRUNC) ) {
         /* we have truncated the file, so write a header */
@@ -131,6 +207,8 @@ int fs_lockable_init(fs_lockable_t *hf)
         }
         /* flush data to disc */
         fs_fsync(hf->fd);
+        if (hf->gen)
+            __sync_add_and_fetch(hf->gen, 1);
         /* downgrade the lock */
         if (flock(hf->fd, LOCK_SH)) {
             fs_error(LOG_ERR, "flock(%s): %s", hf->filename, strerror(errno));
@@ -164,6 +242,8 @@ int fs_lockable_init(fs_lockable_t *hf)
                     flock(hf->fd, LOCK_UN); 
                     return -1;
                 }
+                if (hf->gen)
+                    __sync_add_and_fetch(hf->gen, 1);
             }
             /* flush data to disc */
             if (fs_fsync(hf->fd)) {
@@ -181,6 +261,8 @@ int fs_lockable_init(fs_lockable_t *hf)
     }
 
     /* we are now holding a read lock, read in the header */
+    if (hf->gen)
+        hf->generation = *hf->gen;
     if ( hf->read_metadata && (hf->read_metadata)(hf) ) {
         if (flock(hf->fd, LOCK_UN))
             fs_error(LOG_ERR, "flock(%s): %s", hf->filename, strerror(errno));
@@ -2,6 +2,7 @@
 #define LOCKABLE_H
 
 #include <fcntl.h>
+#include <stdint.h>
 #include <sys/stat.h>
 
 typedef struct _fs_lockable_t {
@@ -12,6 +13,8 @@ typedef struct _fs_lockable_t {
     int mmap_size;
     char *filename;
     struct timespec mtime;
+    volatile uint64_t *gen;     /* shared change counter, or NULL */
+    uint64_t generation;        /* value of *gen when metadata was read */
     int (*lock)(struct _fs_lockable_t *, int operation); // internal, do not use directly
     int (*read_metadata)(struct _fs_lockable_t *);
     int (*write_metadata)(struct _fs_lockable_t *);
@@ -452,6 +452,91 @@ fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2], int
     return ret;
 }
 
+static int pair_cmp(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    if (a[0] < b[0]) return -1;
+    if (a[0] > b[0]) return 1;
+    if (a[1] < b[1]) return -1;
+    if (a[1] > b[1]) return 1;
+
+    return 0;
+}
+
+fs_row_id fs_ptable_remove_pairs(fs_ptable *pt, fs_row_id b, int count, fs_rid pairs[][2], int *removed)
+{
+    fs_row_id ret = b;
+
+    if (b == 0) {
+        fs_error(LOG_CRIT, "tried to read row 0");
+
+        return ret;
+    }
+    if (b > pt->header->length) {
+        fs_error(LOG_CRIT, "tried to read off end of ptable (%d > %d)", b, pt->header->length);
+
+        return ret;
+    }
+    if (count == 0) {
+        return ret;
+    }
+
+    row *prevr = NULL;
+    while (b != 0) {
+        row *r = &(pt->data[b]);
+        fs_row_id nextb = r->cont;
+        if (bsearch(r->data, pairs, count, sizeof(fs_rid) * 2, pair_cmp)) {
+            if (prevr) {
+                prevr->cont = nextb;
+            } else {
+                ret = nextb;
+            }
+            fs_ptable_free_row(pt, b);
+            (*removed)++;
+        } else {
+            prevr = r;
+        }
+        b = nextb;
+    }
+
+    return ret;
+}
+
+fs_row_id fs_ptable_copy_chain(fs_ptable *src, fs_row_id b, fs_ptable *dest)
+{
+    fs_row_id head = 0;
+    fs_row_id prev = 0;
+
+    while (b != 0) {
+        if (b > src->header->length) {
+            fs_error(LOG_CRIT, "tried to read off end of ptable (%d > %d)", b, src->header->length);
+
+            break;
+        }
+        fs_row_id newr = fs_ptable_new_row(dest);
+        if (!newr) {
+            fs_error(LOG_CRIT, "failed to get new row while copying chain");
+
+            break;
+        }
+        /* dest may have been remapped, so don't hold pointers across calls
+         * to fs_ptable_new_row() */
+        dest->data[newr].data[0] = src->data[b].data[0];
+        dest->data[newr].data[1] = src->data[b].data[1];
+        if (prev) {
+            dest->data[prev].cont = newr;
+        } else {
+            head = newr;
+        }
+        prev = newr;
+        b = src->data[b].cont;
+    }
+
+    return head;
+}
+
 fs_row_id fs_ptable_get_next(fs_ptable *pt, fs_row_id r)
 {
     if (r > pt->header->length) {
@@ -40,10 +40,19 @@ int fs_ptable_pair_exists(fs_ptable *pt, fs_row_id b, fs_rid pair[2]);
 fs_row_id fs_ptable_remove_pair(fs_ptable *pt, fs_row_id b, fs_rid pair[2],
 				int *removed);
 
+/* remove all rows matching any of the count pairs[], which must be sorted by
+ * pair[0] then pair[1], walking the chain only once */
+fs_row_id fs_ptable_remove_pairs(fs_ptable *pt, fs_row_id b, int count,
+				 fs_rid pairs[][2], int *removed);
+
 /* move a row onto the free list - caller is responsible for cleaning up the
  * links */
 int fs_ptable_free_row(fs_ptable *pt, fs_row_id b);
 
+/* copy chain b from src onto the end of dest, returns the ID of the new chain
+ * in dest. If dest has no free rows the copy will be physically contiguous */
+fs_row_id fs_ptable_copy_chain(fs_ptable *src, fs_row_id b, fs_ptable *dest);
+
 /* return the length of a chain in rows, stop counting at max, unless max is 0 */
 unsigned int fs_ptable_chain_length(fs_ptable *pt, fs_row_id b, unsigned int max);
 
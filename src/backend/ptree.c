@@ -29,6 +29,7 @@
 
 #include "backend.h"
 #include "ptree.h"
+#include "frozen.h"
 #include "chain.h"
 #include "lockable.h"
 #include "common/params.h"
@@ -93,6 +94,7 @@ struct _fs_ptree {
     node *nodes;
     leaf *leaves;
     fs_ptable *table;
+    fs_frozen *frozen;      // read-only data frozen out of the tree, or NULL
 };
 #define pt_fd l.fd
 #define pt_flags l.flags
@@ -118,6 +120,7 @@ struct _fs_ptree_it {
     fs_rid pair[2];
     int traverse;
     tree_pos *stack;
+    fs_frozen_it *frozen;
 };
 
 fs_ptree *fs_ptree_open(fs_backend *be, fs_rid pred, char pk, int flags, fs_ptable *chain)
@@ -219,6 +222,13 @@ static int init_file(fs_lockable_t *l)
     return 0;
 }
 
+/* deleted pairs are marked in the frozen file, so that has to be flushed
+ * along with the tree */
+static int sync_frozen(fs_lockable_t *l)
+{
+    return fs_frozen_sync(((fs_ptree *)l)->frozen);
+}
+
 fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *chain)
 {
     if (sizeof(struct ptree_header) != 512) {
@@ -266,6 +276,16 @@ fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *cha
         free(pt);
         return NULL;
     }
+
+    /* any frozen data is part of the tree, unless it's being rebuilt */
+    char *fzname = g_strconcat(filename, FS_FROZEN_SUFFIX, NULL);
+    if (flags & O_TRUNC) {
+        unlink(fzname);
+    } else {
+        pt->frozen = fs_frozen_open_filename(fzname, flags);
+        if (pt->frozen) pt->pt_write_metadata = sync_frozen;
+    }
+    g_free(fzname);
     
     return pt;
 }
@@ -505,6 +525,17 @@ again:;
     return 0;
 }
 
+static void add_to_leaf(fs_ptree *pt, nodeid lid, fs_rid pair[2])
+{
+    leaf *lref = LEAF_REF(pt, lid);
+    fs_row_id new_block = fs_ptable_add_pair(pt->table, lref->block, pair);
+    if (new_block) {
+        lref->length++;
+        pt->header->count++;
+        if (new_block != lref->block) lref->block = new_block;
+    }
+}
+
 int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
 {
     if (!pt) {
@@ -515,12 +546,22 @@ int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force)
 
     nodeid lid = get_or_create_leaf(pt, pk);
     if (!pair) return 1;
-    leaf *lref = LEAF_REF(pt, lid);
-    fs_row_id new_block = fs_ptable_add_pair(pt->table, lref->block, pair);
-    if (new_block) {
-        lref->length++;
-        pt->header->count++;
-        if (new_block != lref->block) lref->block = new_block;
+    add_to_leaf(pt, lid, pair);
+
+    return 0;
+}
+
+int fs_ptree_add_pairs(fs_ptree *pt, fs_rid pk, int count, fs_rid pairs[][2])
+{
+    if (!pt) {
+        fs_error(LOG_ERR, "tried to add to NULL ptree");
+        return 1;
+    }
+    fs_assert(fs_lockable_test(pt, LOCK_EX));
+
+    nodeid lid = get_or_create_leaf(pt, pk);
+    for (int i=0; i<count; i++) {
+        add_to_leaf(pt, lid, pairs[i]);
     }
 
     return 0;
@@ -652,6 +693,7 @@ int fs_ptree_remove_all(fs_ptree *pt, fs_rid pair[2])
     int removed = 0;
     remove_all_recurse(pt, pair, FS_PTREE_ROOT_NODE, &removed);
     pt->header->count -= removed;
+    removed += fs_frozen_remove_all(pt->frozen, pair);
 
     if (removed) {
         return 0;
@@ -668,6 +710,12 @@ int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
     }
     fs_assert(fs_lockable_test(pt, LOCK_EX));
 
+    int frozen_removed = 0;
+    if (pt->frozen) {
+        fs_rid pairs[1][2] = { { pair[0], pair[1] } };
+        frozen_removed = fs_frozen_remove_pairs(pt->frozen, pk, 1, pairs);
+    }
+
     nodeid lid = get_leaf(pt, pk);
     if (!lid) {
         /* the leaf doesn't exist, so it doesn't need to be deleted */
@@ -711,7 +759,47 @@ int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
         return 0;
     }
 
-    return 1;
+    return frozen_removed ? 0 : 1;
+}
+
+int fs_ptree_remove_pairs(fs_ptree *pt, fs_rid pk, int count, fs_rid pairs[][2])
+{
+    if (!pt) {
+        fs_error(LOG_ERR, "tried to remove from to NULL ptree");
+        return 1;
+    }
+    fs_assert(fs_lockable_test(pt, LOCK_EX));
+
+    const int frozen_removed = fs_frozen_remove_pairs(pt->frozen, pk, count, pairs);
+
+    nodeid lid = get_leaf(pt, pk);
+    if (!lid) {
+        /* the leaf doesn't exist, so nothing needs to be deleted */
+
+        return 0;
+    }
+    leaf *lref = LEAF_REF(pt, lid);
+    if (!lref->block) {
+        fs_error(LOG_ERR, "block for leaf %x not found", lid);
+        return 1;
+    }
+
+    int removed = 0;
+    fs_row_id newblock = fs_ptable_remove_pairs(pt->table, lref->block, count, pairs, &removed);
+    if (lref->block != newblock) {
+        lref->block = newblock;
+    }
+    if (removed) {
+        lref->length -= removed;
+        pt->header->count -= removed;
+        if (lref->length == 0) {
+            collapse_by_pk(pt, pk);
+        }
+
+        return 0;
+    }
+
+    return frozen_removed ? 0 : 1;
 }
 
 fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
@@ -723,14 +811,19 @@ fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2])
     fs_assert(fs_lockable_test(pt, (LOCK_SH|LOCK_EX)));
 
     nodeid lid = get_leaf(pt, pk);
-    if (!lid) {
+    fs_frozen_it *fit = fs_frozen_search(pt->frozen, pk, pair);
+    if (!lid && !fit) {
         return NULL;
     }
     fs_ptree_it *it = calloc(1, sizeof(fs_ptree_it));
     it->pt = pt;
-    it->leaf = LEAF_REF(pt, lid);
-    it->length = it->leaf->length;
-    it->block = it->leaf->block;
+    if (lid) {
+        it->leaf = LEAF_REF(pt, lid);
+        it->length = it->leaf->length;
+        it->block = it->leaf->block;
+    }
+    it->frozen = fit;
+    it->length += fs_frozen_it_get_length(fit);
     it->pair[0] = pair[0];
     it->pair[1] = pair[1];
 
@@ -755,6 +848,13 @@ int fs_ptree_it_next(fs_ptree_it *it, fs_rid pair[2])
 
     (it->step)++;
 
+    /* frozen pairs first, then the ones added since */
+    if (it->frozen) {
+        if (fs_frozen_it_next(it->frozen, NULL, pair)) return 1;
+        fs_frozen_it_free(it->frozen);
+        it->frozen = NULL;
+    }
+
     while (it->block) {
         int matched = 0;
         fs_rid row[2];
@@ -793,6 +893,7 @@ fs_ptree_it *fs_ptree_traverse(fs_ptree *pt, fs_rid mrid)
     it->stack->node = FS_PTREE_ROOT_NODE;
     it->stack->branch = 0;
     it->stack->next = NULL;
+    it->frozen = fs_frozen_traverse(pt->frozen, mrid);
 
     return it;
 }
@@ -801,6 +902,19 @@ int fs_ptree_traverse_next(fs_ptree_it *it, fs_rid quad[4])
 {
     fs_assert(fs_lockable_test(it->pt, (LOCK_SH|LOCK_EX)));
 
+    if (it->frozen) {
+        fs_rid pair[2];
+        if (fs_frozen_it_next(it->frozen, &quad[1], pair)) {
+            quad[0] = pair[0];
+            /* don't fill out the predicate */
+            quad[3] = pair[1];
+
+            return 1;
+        }
+        fs_frozen_it_free(it->frozen);
+        it->frozen = NULL;
+    }
+
     top:;
     while (it->block) {
         int matched = 0;
@@ -851,13 +965,135 @@ int fs_ptree_traverse_next(fs_ptree_it *it, fs_rid quad[4])
 
 void fs_ptree_it_free(fs_ptree_it *it)
 {
-    if (it) free(it);
+    if (it) {
+        if (it->frozen) fs_frozen_it_free(it->frozen);
+        free(it);
+    }
+}
+
+static void rewrite_table_recurse(fs_ptree *pt, nodeid n, fs_ptable *dest)
+{
+    node *no = node_ref(pt, n);
+    for (int b=0; b<FS_PTREE_BRANCHES; b++) {
+        if (no->branch[b] == FS_PTREE_NULL_NODE) {
+            /* dead end, do nothing */
+        } else if (IS_LEAF(no->branch[b])) {
+            leaf *lref = LEAF_REF(pt, no->branch[b]);
+            if (lref->block) {
+                lref->block = fs_ptable_copy_chain(pt->table, lref->block, dest);
+            }
+        } else {
+            rewrite_table_recurse(pt, no->branch[b], dest);
+        }
+    }
+}
+
+int fs_ptree_rewrite_table(fs_ptree *pt, fs_ptable *dest)
+{
+    if (!pt) {
+        fs_error(LOG_ERR, "tried to rewrite NULL ptree");
+        return 1;
+    }
+    fs_assert(fs_lockable_test(pt, LOCK_EX));
+
+    rewrite_table_recurse(pt, FS_PTREE_ROOT_NODE, dest);
+    pt->table = dest;
+
+    return 0;
+}
+
+struct freeze_key {
+    fs_rid pk;
+    fs_row_id block;
+};
+
+static void freeze_collect_recurse(fs_ptree *pt, nodeid n, GArray *keys)
+{
+    node *no = node_ref(pt, n);
+    for (int b=0; b<FS_PTREE_BRANCHES; b++) {
+        if (no->branch[b] == FS_PTREE_NULL_NODE) {
+            /* dead end, do nothing */
+        } else if (IS_LEAF(no->branch[b])) {
+            leaf *lref = LEAF_REF(pt, no->branch[b]);
+            if (lref->block) {
+                struct freeze_key key = { lref->pk, lref->block };
+                g_array_append_val(keys, key);
+            }
+        } else {
+            freeze_collect_recurse(pt, no->branch[b], keys);
+        }
+    }
+}
+
+static gint freeze_key_cmp(gconstpointer va, gconstpointer vb)
+{
+    const struct freeze_key *a = va;
+    const struct freeze_key *b = vb;
+
+    if (a->pk < b->pk) return -1;
+    if (a->pk > b->pk) return 1;
+
+    return 0;
+}
+
+int fs_ptree_freeze(fs_ptree *pt, const char *filename)
+{
+    if (!pt) {
+        fs_error(LOG_ERR, "tried to freeze NULL ptree");
+        return 1;
+    }
+    fs_assert(fs_lockable_test(pt, (LOCK_SH|LOCK_EX)));
+
+    /* the tree isn't ordered by key, so sort the leaves first */
+    GArray *keys = g_array_new(FALSE, FALSE, sizeof(struct freeze_key));
+    freeze_collect_recurse(pt, FS_PTREE_ROOT_NODE, keys);
+    g_array_sort(keys, freeze_key_cmp);
+
+    fs_frozen_writer *w = fs_frozen_writer_new(filename);
+    if (!w) {
+        g_array_free(keys, TRUE);
+        return 1;
+    }
+
+    /* merge with the pairs that are already frozen, which come out in key
+     * order */
+    fs_frozen_it *fit = fs_frozen_traverse(pt->frozen, FS_RID_NULL);
+    fs_rid fpk, fpair[2];
+    int fmore = fs_frozen_it_next(fit, &fpk, fpair);
+    GArray *pairs = g_array_new(FALSE, FALSE, sizeof(fs_rid) * 2);
+    int errs = 0;
+    guint k = 0;
+    while (!errs && (k < keys->len || fmore)) {
+        const struct freeze_key *key = &g_array_index(keys, struct freeze_key, k);
+        const fs_rid pk = (k < keys->len && (!fmore || key->pk <= fpk)) ?
+                          key->pk : fpk;
+        g_array_set_size(pairs, 0);
+        while (fmore && fpk == pk) {
+            g_array_append_vals(pairs, fpair, 1);
+            fmore = fs_frozen_it_next(fit, &fpk, fpair);
+        }
+        if (k < keys->len && key->pk == pk) {
+            for (fs_row_id b = key->block; b; b = fs_ptable_get_next(pt->table, b)) {
+                fs_rid row[2];
+                fs_ptable_get_row(pt->table, b, row);
+                g_array_append_vals(pairs, row, 1);
+            }
+            k++;
+        }
+        errs += fs_frozen_writer_add(w, pk, pairs->len, (fs_rid (*)[2])pairs->data);
+    }
+    fs_frozen_it_free(fit);
+    g_array_free(pairs, TRUE);
+    g_array_free(keys, TRUE);
+    errs += fs_frozen_writer_finish(w);
+
+    return errs;
 }
 
 int fs_ptree_count(fs_ptree *pt)
 {
     fs_assert(fs_lockable_test(pt, (LOCK_SH|LOCK_EX)));
-    return pt->header->count;
+    return pt->header->count + fs_frozen_count(pt->frozen);
 }
 
 int fs_ptree_unlink(fs_ptree *pt)
@@ -870,6 +1106,9 @@ int fs_ptree_unlink(fs_ptree *pt)
         fs_error(LOG_ERR, "tried to unlink closed ptree");
         return 1;
     }
+    if (pt->frozen && fs_frozen_unlink(pt->frozen)) {
+        return 1;
+    }
 
     return unlink(pt->pt_filename);
 }
@@ -887,6 +1126,7 @@ int fs_ptree_close(fs_ptree *pt)
     if (munmap(pt->ptr, pt->file_length) == -1) {
         fs_error(LOG_CRIT, "failed to unmap '%s'", pt->pt_filename);
     }
+    if (pt->frozen) fs_frozen_close(pt->frozen);
     flock(pt->pt_fd, LOCK_UN);
     close(pt->pt_fd);
     g_free(pt->pt_filename);
@@ -978,6 +1218,10 @@ void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity)
     fprintf(out, "leaves: %d/%d\n", pt->header->leaf_count, pt->header->leaf_alloc);
     fprintf(out, "rows:    %lld\n", (long long)pt->header->count);
     fprintf(out, "\n");
+    if (pt->frozen) {
+        fs_frozen_print(pt->frozen, out, verbosity);
+        fprintf(out, "\n");
+    }
 
     char buffer[256];
     /* tree walk doesn't count the root, or null nodes and leaves */
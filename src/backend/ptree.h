@@ -14,8 +14,13 @@ fs_ptree *fs_ptree_open(fs_backend *be, fs_rid pred, char pk, int flags, fs_ptab
 fs_ptree *fs_ptree_open_filename(const char *filename, int flags, fs_ptable *chain);
 
 int fs_ptree_add(fs_ptree *pt, fs_rid pk, fs_rid pair[2], int force);
+/* add count pairs to the leaf for pk, finding the leaf only once */
+int fs_ptree_add_pairs(fs_ptree *pt, fs_rid pk, int count, fs_rid pairs[][2]);
 int fs_ptree_remove(fs_ptree *pt, fs_rid pk, fs_rid pair[2]);
 int fs_ptree_remove_all(fs_ptree *pt, fs_rid pair[2]);
+/* remove count pairs from the leaf for pk in a single pass, pairs[] must be
+ * sorted */
+int fs_ptree_remove_pairs(fs_ptree *pt, fs_rid pk, int count, fs_rid pairs[][2]);
 
 fs_ptree_it *fs_ptree_search(fs_ptree *pt, fs_rid pk, fs_rid pair[2]);
 int fs_ptree_it_get_length(fs_ptree_it *it);
@@ -25,6 +30,14 @@ fs_ptree_it *fs_ptree_traverse(fs_ptree *pt, fs_rid mrid);
 int fs_ptree_traverse_next(fs_ptree_it *it, fs_rid quad[4]);
 void fs_ptree_it_free(fs_ptree_it *it);
 
+/* copy every leaf's chain into dest, in key order, and switch the tree over to
+ * using dest as its table */
+int fs_ptree_rewrite_table(fs_ptree *pt, fs_ptable *dest);
+
+/* write every pair in the tree, including any frozen already, to a new frozen
+ * file. The tree itself is left unchanged */
+int fs_ptree_freeze(fs_ptree *pt, const char *filename);
+
 void fs_ptree_print(fs_ptree *pt, FILE *out, int verbosity);
 
 /* unlink backend storage file */
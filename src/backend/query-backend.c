@@ -82,6 +82,16 @@ static int graph_ok(const fs_rid ref[4], int flags)
     return 1;
 }
 
+static int filter_ok(const fs_rid ref[4], int slot, const fs_rid_bloom *filter)
+{
+    /* semi-join filter from the frontend, false positives are removed there */
+    if (filter && !fs_rid_bloom_contains(filter, ref[slot])) {
+	return 0;
+    }
+
+    return 1;
+}
+
 static int bind_same(const fs_rid ref[4], int flags)
 {
     int match = 1;
@@ -155,11 +165,187 @@ static void bind_results(const fs_rid quad[4], int tobind, fs_rid_vector **ret)
     }
 }
 
+/* search pt for the given subject and object, either may be FS_RID_NULL
+ * except the one the tree is keyed on, m is matched as a set */
+static int probe_pair(fs_ptree *pt, int by_object, unsigned int tobind,
+                      fs_rid_vector *mv, fs_rid pred, fs_rid s, fs_rid o,
+                      int filter_slot, const fs_rid_bloom *filter,
+                      fs_rid_vector **ret, int count, int limit)
+{
+    const int ml = mv->length ? mv->length : 1;
+
+    for (int m=0; m<ml && count<limit; m++) {
+        fs_rid pair[2] = { mv->length ? mv->data[m] : FS_RID_NULL,
+                           by_object ? s : o };
+        fs_ptree_it *it = fs_ptree_search(pt, by_object ? o : s, pair);
+        while (it && fs_ptree_it_next(it, pair) && count<limit) {
+            const fs_rid quad[4] = { pair[0], by_object ? pair[1] : s, pred,
+                                     by_object ? o : pair[1] };
+            if (!bind_same(quad, tobind)) continue;
+            if (!graph_ok(quad, tobind)) continue;
+            if (!filter_ok(quad, filter_slot, filter)) continue;
+            count++;
+            bind_results(quad, tobind, ret);
+        }
+        fs_ptree_it_free(it);
+    }
+
+    return count;
+}
+
+static int pair_cmp(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    if (a[0] != b[0]) return a[0] < b[0] ? -1 : 1;
+    if (a[1] != b[1]) return a[1] < b[1] ? -1 : 1;
+
+    return 0;
+}
+
+/* FS_BIND_PAIR_SO and FS_BIND_PAIR_SP: sv[i] is matched only with ov[i] or
+ * pv[i], the other slots are sets as usual */
+static fs_rid_vector **bind_pairs(fs_backend *be, fs_segment segment,
+                                  unsigned int tobind,
+                                  fs_rid_vector *mv, fs_rid_vector *sv,
+                                  fs_rid_vector *pv, fs_rid_vector *ov,
+                                  int filter_slot, const fs_rid_bloom *filter,
+                                  int limit)
+{
+    const int by_object = tobind & FS_BIND_BY_OBJECT ? 1 : 0;
+    const int so = (tobind & FS_BIND_PAIR_MASK) == FS_BIND_PAIR_SO;
+    fs_rid_vector *paired = so ? ov : pv;
+
+    if ((tobind & FS_BIND_PAIR_MASK) == FS_BIND_PAIR_MASK) {
+	fs_error(LOG_ERR, "tried to bind with both pair flags set");
+
+	return NULL;
+    }
+    if (sv->length != paired->length) {
+	fs_error(LOG_ERR, "tried to bind pairs with length(s) != length(%c)",
+                 so ? 'o' : 'p');
+
+	return NULL;
+    }
+    if (by_object && !so && ov->length == 0) {
+	fs_error(LOG_ERR, "tried to bind (s, p) pairs by object with no objects");
+
+	return NULL;
+    }
+    double then = fs_time();
+
+    limit = (limit == -1) ? INT_MAX : limit;
+
+    int cols = 0;
+    for (int i=0; i<4; i++) {
+	if (tobind & slot_bits[i]) {
+	    cols++;
+	}
+    }
+    fs_rid_vector **ret = calloc(cols ? cols : 1, sizeof(fs_rid_vector *));
+    if (cols == 0) limit = 1;
+    for (int i=0; i<cols; i++) {
+	ret[i] = fs_rid_vector_new(0);
+    }
+
+    /* (s, o) pairs, or (p, s) so that runs of the same predicate can share
+     * a ptree, sorted and without duplicates */
+    int n = sv->length;
+    fs_rid (*pairs)[2] = malloc((n ? n : 1) * sizeof(fs_rid[2]));
+    for (int i=0; i<n; i++) {
+	pairs[i][0] = so ? sv->data[i] : pv->data[i];
+	pairs[i][1] = so ? ov->data[i] : sv->data[i];
+    }
+    qsort(pairs, n, sizeof(fs_rid[2]), pair_cmp);
+    int out = 0;
+    for (int i=0; i<n; i++) {
+	if (out && !pair_cmp(pairs[out-1], pairs[i])) continue;
+	pairs[out][0] = pairs[i][0];
+	pairs[out][1] = pairs[i][1];
+	out++;
+    }
+    n = out;
+
+    int count = 0;
+    if (so) {
+	const int pl = pv->length ? pv->length : be->ptree_length;
+	for (int p=0; p<pl && count<limit; p++) {
+	    fs_ptree *pt;
+	    fs_rid pred;
+	    if (pv->length) {
+		pred = pv->data[p];
+		pt = fs_backend_get_ptree(be, pred, by_object);
+	    } else {
+		fs_backend_ptree_limited_open(be, p);
+		pred = be->ptrees_priv[p].pred;
+		pt = by_object ? be->ptrees_priv[p].ptree_o :
+				 be->ptrees_priv[p].ptree_s;
+	    }
+	    if (!pt) continue;
+	    if (fs_lockable_lock(pt, LOCK_SH)) break;
+	    for (int i=0; i<n && count<limit; i++) {
+		count = probe_pair(pt, by_object, tobind, mv, pred, pairs[i][0],
+				   pairs[i][1], filter_slot, filter, ret, count,
+				   limit);
+	    }
+	    fs_lockable_lock(pt, LOCK_UN);
+	}
+    } else {
+	const int ol = ov->length ? ov->length : 1;
+	for (int i=0; i<n && count<limit; ) {
+	    const fs_rid pred = pairs[i][0];
+	    int end = i;
+	    while (end < n && pairs[end][0] == pred) end++;
+	    fs_ptree *pt = fs_backend_get_ptree(be, pred, by_object);
+	    if (pt && fs_lockable_lock(pt, LOCK_SH) == 0) {
+		for (int j=i; j<end && count<limit; j++) {
+		    for (int o=0; o<ol && count<limit; o++) {
+			count = probe_pair(pt, by_object, tobind, mv, pred,
+				pairs[j][1],
+				ov->length ? ov->data[o] : FS_RID_NULL,
+				filter_slot, filter, ret, count, limit);
+		    }
+		}
+		fs_lockable_lock(pt, LOCK_UN);
+	    }
+	    i = end;
+	}
+    }
+    free(pairs);
+
+    be->out_time[segment].bind_count++;
+    be->out_time[segment].bind += fs_time() - then;
+
+    if (count == 0 && cols == 0) {
+	free(ret);
+
+	return NULL;
+    }
+
+    return ret;
+}
+
 fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 			     fs_rid_vector *mv, fs_rid_vector *sv,
 			     fs_rid_vector *pv, fs_rid_vector *ov,
                              int offset, int limit)
 {
+    return fs_bind_filter(be, segment, tobind, mv, sv, pv, ov, -1, NULL,
+                          offset, limit);
+}
+
+fs_rid_vector **fs_bind_filter(fs_backend *be, fs_segment segment,
+			     unsigned int tobind,
+			     fs_rid_vector *mv, fs_rid_vector *sv,
+			     fs_rid_vector *pv, fs_rid_vector *ov,
+			     int filter_slot, const fs_rid_bloom *filter,
+                             int offset, int limit)
+{
+    if (filter && (filter_slot < 0 || filter_slot > 3)) {
+	fs_error(LOG_ERR, "bad filter slot %d", filter_slot);
+	filter = NULL;
+    }
     if (!(tobind & (FS_BIND_BY_SUBJECT | FS_BIND_BY_OBJECT))) {
 	fs_error(LOG_ERR, "tried to bind without s/o spec");
 
@@ -170,6 +356,11 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 
 	return NULL;
     }
+    if (tobind & FS_BIND_PAIR_MASK) {
+	/* must be done before the vectors are sorted */
+	return bind_pairs(be, segment, tobind, mv, sv, pv, ov, filter_slot,
+                          filter, limit);
+    }
     double then = fs_time();
 
     limit = (limit == -1) ? INT_MAX : limit;
@@ -207,7 +398,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
     /* if the query looks like (?m _ _ _) we can consult the model hash */
     if (cols == 1 && tobind & FS_BIND_MODEL && tobind &&
         tobind & FS_BIND_DISTINCT &&
-        mvl == 0 && svl == 0 && pvl == 0 && ovl == 0) {
+        mvl == 0 && svl == 0 && pvl == 0 && ovl == 0 && !filter) {
 	ret[0] = fs_mhash_get_keys(be->models);
 
 	be->out_time[segment].bind_count++;
@@ -218,7 +409,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 
     /* if the query looks like (_ _ ?p _) we can consult the predicate list */
     if (cols == 1 && tobind & FS_BIND_PREDICATE && tobind & FS_BIND_DISTINCT &&
-        mvl == 0 && svl == 0 && pvl == 0 && ovl == 0) {
+        mvl == 0 && svl == 0 && pvl == 0 && ovl == 0 && !filter) {
 	int length = limit < be->ptree_length ? limit : be->ptree_length;
 	ret[0] = fs_rid_vector_new(length);
 	int outpos = 0;
@@ -259,11 +450,13 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 	    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
 		if (!bind_same(quad, tobind)) continue;
 		if (!graph_ok(quad, tobind)) continue;
+		if (!filter_ok(quad, filter_slot, filter)) continue;
 		count++;
 		fs_rid_set_add(set, quad[3]);
 	    }
 	    fs_ptree_it_free(it);
 	    fs_rid_vector_append_set(ret[0], set);
+	    fs_rid_set_free(set);
             if (fs_lockable_lock(pt, LOCK_UN)) // free return values!
                 return NULL;
 	}
@@ -299,6 +492,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 				    { model, triple[0], triple[1], triple[2] };
 		    if (!bind_same(quad, tobind)) continue;
 		    if (!graph_ok(quad, tobind)) continue;
+		    if (!filter_ok(quad, filter_slot, filter)) continue;
 		    bind_results(quad, tobind, ret);
 		    count++;
 		}
@@ -313,6 +507,7 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 				    { model, triple[0], triple[1], triple[2] };
 		    if (!bind_same(quad, tobind)) continue;
 		    if (!graph_ok(quad, tobind)) continue;
+		    if (!filter_ok(quad, filter_slot, filter)) continue;
 		    bind_results(quad, tobind, ret);
 		    count++;
 		}
@@ -353,6 +548,7 @@ fs_error(LOG_INFO, "bind() branch");
 		    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
 			if (!bind_same(quad, tobind)) continue;
 			if (!graph_ok(quad, tobind)) continue;
+			if (!filter_ok(quad, filter_slot, filter)) continue;
 			count++;
 			bind_results(quad, tobind, ret);
 		    }
@@ -382,6 +578,7 @@ fs_error(LOG_INFO, "bind() branch");
 		    while (it && fs_ptree_traverse_next(it, quad) && count<limit) {
 			if (!bind_same(quad, tobind)) continue;
 			if (!graph_ok(quad, tobind)) continue;
+			if (!filter_ok(quad, filter_slot, filter)) continue;
 			count++;
 			bind_results(quad, tobind, ret);
 		    }
@@ -417,6 +614,7 @@ fs_error(LOG_INFO, "bind() branch");
 				    { pair[0], pk, pv->data[p], pair[1] };
 				if (!bind_same(quad, tobind)) continue;
 				if (!graph_ok(quad, tobind)) continue;
+				if (!filter_ok(quad, filter_slot, filter)) continue;
 				count++;
 				bind_results(quad, tobind, ret);
 			    }
@@ -452,6 +650,7 @@ fs_error(LOG_INFO, "bind() branch");
 				};
 				if (!bind_same(quad, tobind)) continue;
 				if (!graph_ok(quad, tobind)) continue;
+				if (!filter_ok(quad, filter_slot, filter)) continue;
 				count++;
 				bind_results(quad, tobind, ret);
 			    }
@@ -489,6 +688,7 @@ fs_error(LOG_INFO, "bind() branch");
 				    { pair[0], pk, be->ptrees_priv[p].pred, pair[1] };
 				if (!bind_same(quad, tobind)) continue;
 				if (!graph_ok(quad, tobind)) continue;
+				if (!filter_ok(quad, filter_slot, filter)) continue;
 				count++;
 				bind_results(quad, tobind, ret);
 			    }
@@ -524,6 +724,7 @@ fs_error(LOG_INFO, "bind() branch");
 				    { pair[0], pair[1], be->ptrees_priv[p].pred, pk };
 				if (!bind_same(quad, tobind)) continue;
 				if (!graph_ok(quad, tobind)) continue;
+				if (!filter_ok(quad, filter_slot, filter)) continue;
 				count++;
 				bind_results(quad, tobind, ret);
 			    }
@@ -635,10 +836,23 @@ fs_rid_vector **fs_reverse_bind(fs_backend *be, fs_segment segment,
 	inter[s] = fs_rid_vector_new(0);
     }
     for (int i=0; i<iters; i++) {
+	/* mv and sv keep the order the last pass found them in, so probe
+	 * sorted copies rather than scanning them for every pair */
+	fs_rid_vector *ms = NULL, *ss = NULL;
+	if (mv) {
+	    ms = fs_rid_vector_copy(mv);
+	    fs_rid_vector_sort(ms);
+	    fs_rid_vector_uniq(ms, 0);
+	}
+	if (sv) {
+	    ss = fs_rid_vector_copy(sv);
+	    fs_rid_vector_sort(ss);
+	    fs_rid_vector_uniq(ss, 0);
+	}
 	while (res[i] && fs_ptree_it_next(res[i], lpair)) {
 	    int match = 1;
-	    if (mv && !fs_rid_vector_contains(mv, lpair[0])) match = 0;
-	    if (match && sv && !fs_rid_vector_contains(sv, lpair[1])) match = 0;
+	    if (ms && !fs_rid_vector_contains_sorted(ms, lpair[0])) match = 0;
+	    if (match && ss && !fs_rid_vector_contains_sorted(ss, lpair[1])) match = 0;
 	    if (match) {
 		if (tobind & FS_BIND_MODEL) {
 		    fs_rid_vector_append(inter[0], lpair[1]);
@@ -649,6 +863,8 @@ fs_rid_vector **fs_reverse_bind(fs_backend *be, fs_segment segment,
 	    }
 	}
         fs_ptree_it_free(res[i]);
+	fs_rid_vector_free(ms);
+	fs_rid_vector_free(ss);
 	if (tobind & FS_BIND_MODEL) {
 	    if (mv) {
 		fs_rid_vector_free(mv);
@@ -22,6 +22,15 @@ fs_rid_vector **fs_bind(fs_backend *be, fs_segment segment, unsigned int tobind,
 			     fs_rid_vector *pv, fs_rid_vector *ov,
                              int offset, int limit);
 
+/* as fs_bind(), but only rows whose value in filter_slot (0-3 for m, s, p, o)
+ * passes filter are returned, the filter may be NULL */
+fs_rid_vector **fs_bind_filter(fs_backend *be, fs_segment segment,
+			     unsigned int tobind,
+			     fs_rid_vector *mv, fs_rid_vector *sv,
+			     fs_rid_vector *pv, fs_rid_vector *ov,
+			     int filter_slot, const fs_rid_bloom *filter,
+                             int offset, int limit);
+
 /* WARNING: check code, this function does not behave like fs_bind() even
  * though it has the same signature */
 fs_rid_vector **fs_reverse_bind(fs_backend *be, fs_segment segment,
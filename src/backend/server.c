@@ -47,6 +47,54 @@
 //static const char feature_string[] = PAD "no-o-index freq" PAD;
 static const char feature_string[] = PAD "no-o-index" PAD;
 
+/* importing is set between start_import and stop_import, import_holding
+ * once such an import has taken the index locks. An import takes them the
+ * first time it writes quads or deletes anything, and holds them until
+ * stop_import has committed, so queries see the segment either before or
+ * after the import, never part way through */
+static int importing = 0;
+static int import_holding = 0;
+
+static int import_hold_locks(fs_backend *be)
+{
+  if (fs_lockable_lock(be->models, LOCK_EX))
+      return 1;
+  if (fs_lockable_lock(be->res, LOCK_EX)) {
+      fs_lockable_lock(be->models, LOCK_UN);
+      return 1;
+  }
+  if (fs_lockable_lock(be->predicates, LOCK_EX)) {
+      fs_lockable_lock(be->res, LOCK_UN);
+      fs_lockable_lock(be->models, LOCK_UN);
+      return 1;
+  }
+  import_holding = 1;
+
+  return 0;
+}
+
+/* called before a message that writes to the indexes. Inside an import the
+ * index locks are taken and held until stop_import. Outside one, such as
+ * for SPARQL updates, the write takes the import lock, so it can't
+ * interleave with an import in another process */
+static int write_begin(fs_backend *be)
+{
+  if (importing) {
+      if (import_holding) return 0;
+
+      return import_hold_locks(be);
+  }
+
+  return fs_lock_import(be, LOCK_EX);
+}
+
+static int write_end(fs_backend *be)
+{
+  if (importing) return 0;
+
+  return fs_lock_import(be, LOCK_UN);
+}
+
 static unsigned char *handle_insert_resource(fs_backend *be, fs_segment segment,
                                                unsigned int length,
                                                unsigned char *content)
@@ -80,21 +128,16 @@ static unsigned char *handle_insert_resource(fs_backend *be, fs_segment segment,
     length -= offset;
   }
 
-  /* handle_insert_resource can be called after starting an import, thus
-   * with a LOCK_EX or on its own which means we have to do it here */
-  int res_lock = 0;
-  if (fs_lockable_test(be->res, LOCK_UN)) {
-      res_lock = 1;
-      if (fs_lockable_lock(be->res, LOCK_EX))
-          return fsp_error_new(segment, "could not lock resources");
+  /* resources are buffered, fs_res_import takes the lock if it has to
+   * write them out. Resources no quad refers to yet aren't visible to
+   * queries, so an import doesn't need the index locks for them */
+  if (!importing && fs_lock_import(be, LOCK_EX)) {
+    free(resources);
+    return NULL;
   }
-
   fs_res_import(be, segment, count, resources);
   free(resources);
-
-  if (res_lock)
-      if (fs_lockable_lock(be->res, LOCK_UN))
-          return fsp_error_new(segment, "could not unlock resources");
+  if (!importing) fs_lock_import(be, LOCK_UN);
 
   return NULL; /* no reply - semi-async */
 }
@@ -113,13 +156,18 @@ static unsigned char * handle_commit_resource (fs_backend *be, fs_segment segmen
     return fsp_error_new(segment, "extraneous content");
   }
 
+  if (!importing && fs_lock_import(be, LOCK_EX))
+      return fsp_error_new(segment, "could not lock import");
+
   /* handle_insert_resource can be called after starting an import, thus
    * with a LOCK_EX or on its own which means we have to do it here */
   int res_lock = 0;
   if (fs_lockable_test(be->res, LOCK_UN)) {
       res_lock = 1;
-      if (fs_lockable_lock(be->res, LOCK_EX))
+      if (fs_lockable_lock(be->res, LOCK_EX)) {
+          if (!importing) fs_lock_import(be, LOCK_UN);
           return fsp_error_new(segment, "could not lock resources");
+      }
   }
 
   fs_res_import_commit(be, segment, 1);
@@ -127,6 +175,7 @@ static unsigned char * handle_commit_resource (fs_backend *be, fs_segment segmen
   if (res_lock)
       if (fs_lockable_lock(be->res, LOCK_UN))
           return fsp_error_new(segment, "could not unlock resources");
+  if (!importing) fs_lock_import(be, LOCK_UN);
 
   return message_new(FS_DONE_OK, segment, 0);
 }
@@ -151,7 +200,13 @@ static unsigned char * handle_insert_quad (fs_backend *be, fs_segment segment,
   fs_rid (*buffer)[4] = (fs_rid (*)[4]) (content + 8);
 
   memcpy(&flags, content, sizeof (flags));
+
+  /* only lock if the buffer is going to be written out */
+  const int writing = fs_quad_import_would_flush(count);
+  if (writing && write_begin(be))
+    return fsp_error_new(segment, "could not lock storage");
   int ret = fs_quad_import(be, segment, flags, count, buffer);
+  if (writing) write_end(be);
   if (ret) {
     fs_error(LOG_ERR, "insert_quad(%d) failed", segment);
     return fsp_error_new(segment, "quad insert failed");
@@ -178,15 +233,21 @@ static unsigned char * handle_commit_quad (fs_backend *be, fs_segment segment,
 
   memcpy(&flags, content, sizeof (flags));
 
-  /* handle_new_models can be called after starting an import, thus
-   * with a LOCK_EX or on its own which means we have to do it here */
+  if (write_begin(be))
+      return fsp_error_new(segment, "could not lock storage");
+
+  /* inside an import the locks are held already, otherwise we have to take
+   * them here */
   int locking = 0;
   if (fs_lockable_test(be->models, LOCK_UN)) {
       locking = 1;
-      if (fs_lockable_lock(be->models, LOCK_EX))
+      if (fs_lockable_lock(be->models, LOCK_EX)) {
+          write_end(be);
           return fsp_error_new(segment, "could not lock models");
+      }
       if (fs_lockable_lock(be->predicates, LOCK_EX)) {
           fs_lockable_lock(be->models, LOCK_UN);
+          write_end(be);
           return fsp_error_new(segment, "could not lock predicates");
       }
   }
@@ -196,11 +257,15 @@ static unsigned char * handle_commit_quad (fs_backend *be, fs_segment segment,
   if (locking) {
       if (fs_lockable_lock(be->predicates, LOCK_UN)) {
           fs_lockable_lock(be->models, LOCK_UN);
+          write_end(be);
           return fsp_error_new(segment, "error releasing predicate lock");
       }
-      if (fs_lockable_lock(be->models, LOCK_UN))
+      if (fs_lockable_lock(be->models, LOCK_UN)) {
+          write_end(be);
           return fsp_error_new(segment, "error releasing model lock");
+      }
   }
+  write_end(be);
 
   if (ret) {
     fs_error(LOG_ERR, "commit_quad(%d) failed", segment);
@@ -281,15 +346,21 @@ static unsigned char * handle_delete_models (fs_backend *be, fs_segment segment,
   models.size = models.length  = length / sizeof(fs_rid);
   models.data = (fs_rid *) content;
 
-  /* handle_delete_models can be called after starting an import, thus
-   * with a LOCK_EX or on its own which means we have to do it here */
+  if (write_begin(be))
+      return fsp_error_new(segment, "could not lock storage");
+
+  /* inside an import the locks are held already, otherwise we have to take
+   * them here */
   int model_lock = 0;
   if (fs_lockable_test(be->models, LOCK_UN)) {
       model_lock = 1;
-      if (fs_lockable_lock(be->models, LOCK_EX))
+      if (fs_lockable_lock(be->models, LOCK_EX)) {
+          write_end(be);
           return fsp_error_new(segment, "could not lock models");
+      }
       if (fs_lockable_lock(be->predicates, LOCK_EX)) {
           fs_lockable_lock(be->models, LOCK_UN);
+          write_end(be);
           return fsp_error_new(segment, "count not lock predicates");
       }
   }
@@ -298,9 +369,12 @@ static unsigned char * handle_delete_models (fs_backend *be, fs_segment segment,
 
   if (model_lock) {
       if (fs_lockable_lock(be->predicates, LOCK_UN) ||
-          fs_lockable_lock(be->models, LOCK_UN))
+          fs_lockable_lock(be->models, LOCK_UN)) {
+         write_end(be);
          return fsp_error_new(segment, "could not unlock storage");
+      }
   }
+  write_end(be);
 
   return message_new(FS_DONE_OK, segment, 0);
 }
@@ -321,15 +395,21 @@ static unsigned char * handle_new_models (fs_backend *be, fs_segment segment,
 
   fs_rid *models = (fs_rid *) content;
 
-  /* handle_new_models can be called after starting an import, thus
-   * with a LOCK_EX or on its own which means we have to do it here */
+  if (write_begin(be))
+      return fsp_error_new(segment, "could not lock storage");
+
+  /* inside an import the locks are held already, otherwise we have to take
+   * them here */
   int locking = 0;
   if (fs_lockable_test(be->models, LOCK_UN)) {
       locking = 1;
-      if (fs_lockable_lock(be->models, LOCK_EX))
+      if (fs_lockable_lock(be->models, LOCK_EX)) {
+          write_end(be);
           return fsp_error_new(segment, "could not lock models");
+      }
       if (fs_lockable_lock(be->predicates, LOCK_EX)) {
           fs_lockable_lock(be->models, LOCK_UN);
+          write_end(be);
           return fsp_error_new(segment, "could not lock predicates");
       }
   }
@@ -346,11 +426,15 @@ static unsigned char * handle_new_models (fs_backend *be, fs_segment segment,
   if (locking) {
       if (fs_lockable_lock(be->predicates, LOCK_UN)) {
           fs_lockable_lock(be->models, LOCK_UN);
+          write_end(be);
           return fsp_error_new(segment, "error releasing predicate lock");
       }
-      if (fs_lockable_lock(be->models, LOCK_UN))
+      if (fs_lockable_lock(be->models, LOCK_UN)) {
+          write_end(be);
           return fsp_error_new(segment, "error releasing model lock");
+      }
   }
+  write_end(be);
 
   if (invalid_count > 0) {
     return fsp_error_new(segment, "one or more model RIDs is not a URI");
@@ -378,17 +462,12 @@ static unsigned char * handle_start_import (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "low disk space");
   }
 
-  if (fs_lockable_lock(be->models, LOCK_EX))
-      return fsp_error_new(segment, "could not lock models");
-  if (fs_lockable_lock(be->res, LOCK_EX)) {
-      fs_lockable_lock(be->models, LOCK_UN);
-      return fsp_error_new(segment, "could not lock resources");
-  }
-  if (fs_lockable_lock(be->predicates, LOCK_EX)) {
-      fs_lockable_lock(be->res, LOCK_UN);
-      fs_lockable_lock(be->models, LOCK_UN);
-      return fsp_error_new(segment, "could not lock predicates");
-  }
+  /* the index locks are only taken from the point the import first writes
+   * quads or deletes anything, so queries can carry on while it's parsed
+   * and buffered */
+  if (fs_lock_import(be, LOCK_EX))
+      return fsp_error_new(segment, "could not lock import");
+  importing = 1;
 
   fs_start_import(be, segment);
 
@@ -409,8 +488,19 @@ static unsigned char * handle_stop_import (fs_backend *be, fs_segment segment,
     return fsp_error_new(segment, "extraneous content");
   }
 
+  if (!importing) {
+      fs_error(LOG_ERR, "stop_import(%d) without start_import", segment);
+      return fsp_error_new(segment, "no import running");
+  }
+  if (!import_holding && import_hold_locks(be))
+      return fsp_error_new(segment, "could not lock storage");
+  import_holding = 0;
+
   int ret = fs_stop_import(be, segment);
 
+  importing = 0;
+  fs_lock_import(be, LOCK_UN);
+
   if (fs_lockable_lock(be->predicates, LOCK_UN)) {
       fs_lockable_lock(be->res, LOCK_UN);
       fs_lockable_lock(be->models, LOCK_UN);
@@ -469,8 +559,11 @@ static unsigned char * handle_delete_quads (fs_backend *be, fs_segment segment,
   objects.data = (fs_rid *) content;
 
   fs_rid_vector *args[4] = { &models, &subjects, &predicates, &objects };
+  if (write_begin(be))
+    return fsp_error_new(segment, "could not lock storage");
   fs_delete_quads(be, args);
   /* FIXME, should check return value */
+  write_end(be);
 
   return message_new(FS_DONE_OK, 0, 0);
 }
@@ -678,8 +771,9 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
   }
 
   fs_rid_vector models, subjects, predicates, objects;
-  unsigned int flags, value;
-  int offset, limit;
+  fs_rid_bloom bloom, *filter = NULL;
+  unsigned int flags, value, filter_length;
+  int offset, limit, filter_slot = -1;
 
   memcpy(&flags, content, sizeof (flags));
   memcpy(&offset, content + 4, sizeof (offset));
@@ -693,9 +787,15 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
   predicates.size = predicates.length = value / 8;
   memcpy(&value, content + 24, sizeof (objects.length));
   objects.size = objects.length = value / 8;
+  /* older clients leave this zero */
+  memcpy(&filter_length, content + 28, sizeof (filter_length));
   content += 32;
 
-  if (length < (models.size + subjects.size + predicates.size + objects.size) * 8 + 32) {
+  /* done in 64 bits, and without adding filter_length, so that large
+   * lengths can't wrap round */
+  unsigned long long vec_bytes = ((unsigned long long) models.size +
+      subjects.size + predicates.size + objects.size) * 8;
+  if (vec_bytes > length - 32 || filter_length > length - 32 - vec_bytes) {
     fs_error(LOG_ERR, "bind_limit(%d) too short", segment);
     return fsp_error_new(segment, "too short");
   }
@@ -710,14 +810,34 @@ static unsigned char * handle_bind_limit (fs_backend *be, fs_segment segment,
   content += predicates.length * 8;
 
   objects.data = (fs_rid *) content;
+  content += objects.length * 8;
+
+  if (filter_length >= 16) {
+    unsigned int header[4];
+
+    memcpy(header, content, sizeof(header));
+    filter_slot = header[0];
+    bloom.log2_bits = header[1];
+    bloom.hashes = header[2];
+    bloom.bits = content + sizeof(header);
+    if (header[0] > 3 ||
+        bloom.log2_bits < 3 || bloom.log2_bits > 31 ||
+        bloom.hashes < 1 || bloom.hashes > 32 ||
+        16 + fs_rid_bloom_bytes(&bloom) > filter_length) {
+      fs_error(LOG_ERR, "bind_limit(%d) bad filter", segment);
+      return fsp_error_new(segment, "bad filter");
+    }
+    filter = &bloom;
+  }
 
   fs_rid_vector **bindings;
 
   if (fs_lockable_lock(be->predicates, LOCK_SH)) {
     return fsp_error_new(segment, "could not lock predicates");
   }
-  bindings = fs_bind(be, segment, flags,
-                     &models, &subjects, &predicates, &objects, offset, limit);
+  bindings = fs_bind_filter(be, segment, flags,
+                     &models, &subjects, &predicates, &objects,
+                     filter_slot, filter, offset, limit);
 
   int k, cols = 0;
   for (k = 0; k < 4; ++k) {
@@ -427,6 +427,149 @@ fs_index_node fs_tbchain_add_triple(fs_tbchain *bc, fs_index_node b, fs_rid trip
     return b;
 }
 
+static int triple_cmp(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    for (int i=0; i<3; i++) {
+        if (a[i] < b[i]) return -1;
+        if (a[i] > b[i]) return 1;
+    }
+
+    return 0;
+}
+
+int fs_tbchain_remove_triples(fs_tbchain *bc, fs_index_node b, int count, fs_rid triples[][3], int max_blocks)
+{
+    if (b == 0 || b == 1) {
+        fs_error(LOG_CRIT, "tried to remove from block %u\n", b);
+
+        return -1;
+    }
+    if (b > bc->header->length) {
+        fs_error(LOG_CRIT, "tried to remove past end of chain\n");
+
+        return -1;
+    }
+
+    int removed = 0;
+    int blocks = 0;
+    for (fs_index_node n = b; n; n = bc->data[n].cont) {
+        if (++blocks > max_blocks) {
+            if (removed) {
+                fs_tbchain_set_bit(bc, b, FS_TBCHAIN_SPARSE);
+            }
+
+            return -1;
+        }
+        fs_tblock *bp = &bc->data[n];
+        for (int i=0; i<bp->length; i++) {
+            if (bp->data[i][0] == FS_RID_GONE) continue;
+            if (bsearch(bp->data[i], triples, count, sizeof(fs_rid) * 3,
+                        triple_cmp)) {
+                bp->data[i][0] = FS_RID_GONE;
+                removed++;
+            }
+        }
+    }
+    if (removed) {
+        fs_tbchain_set_bit(bc, b, FS_TBCHAIN_SPARSE);
+    }
+
+    return removed;
+}
+
+int fs_tbchain_compact_chain(fs_tbchain *bc, fs_index_node b)
+{
+    if (b == 0 || b == 1) {
+        fs_error(LOG_CRIT, "tried to compact chain at block %u\n", b);
+
+        return 1;
+    }
+    if (b > bc->header->length) {
+        fs_error(LOG_CRIT, "tried to compact past end of chain\n");
+
+        return 1;
+    }
+    if (!(bc->data[b].flags & FS_TBCHAIN_SPARSE)) {
+        return 0;
+    }
+
+    /* the write position never overtakes the read position, so the live
+     * triples can be packed towards the head of the chain in place */
+    fs_index_node wn = b;
+    int wpos = 0;
+    for (fs_index_node rn = b; rn; rn = bc->data[rn].cont) {
+        fs_tblock *rp = &bc->data[rn];
+        for (int i=0; i<rp->length; i++) {
+            if (rp->data[i][0] == FS_RID_GONE) continue;
+            if (wpos == FS_TBLOCK_LEN) {
+                bc->data[wn].length = FS_TBLOCK_LEN;
+                wn = bc->data[wn].cont;
+                wpos = 0;
+            }
+            if (wn != rn || wpos != i) {
+                memcpy(bc->data[wn].data[wpos], rp->data[i],
+                       sizeof(fs_rid) * 3);
+            }
+            wpos++;
+        }
+    }
+    bc->data[wn].length = wpos;
+
+    fs_index_node next = bc->data[wn].cont;
+    bc->data[wn].cont = 0;
+    while (next) {
+        fs_index_node cont = bc->data[next].cont;
+        fs_tbchain_free_block(bc, next);
+        next = cont;
+    }
+    fs_tbchain_clear_bit(bc, b, FS_TBCHAIN_SPARSE);
+
+    return 0;
+}
+
+fs_index_node fs_tbchain_copy_chain(fs_tbchain *src, fs_index_node b, fs_tbchain *dest)
+{
+    if (b == 0 || b == 1) {
+        fs_error(LOG_CRIT, "tried to copy chain at block %u\n", b);
+
+        return 0;
+    }
+    if (b > src->header->length) {
+        fs_error(LOG_CRIT, "tried to copy past end of chain\n");
+
+        return 0;
+    }
+
+    const uint8_t flags = src->data[b].flags & ~FS_TBCHAIN_SPARSE;
+    fs_index_node head = fs_tbchain_new_chain(dest);
+    fs_index_node cur = head;
+    for (fs_index_node n = b; n; n = src->data[n].cont) {
+        for (int i=0; i<src->data[n].length; i++) {
+            if (src->data[n].data[i][0] == FS_RID_GONE) continue;
+            if (dest->data[cur].length == FS_TBLOCK_LEN) {
+                fs_index_node next = fs_tbchain_new_block(dest);
+                if (!next) {
+                    fs_error(LOG_CRIT, "failed to get block while copying chain");
+
+                    return head;
+                }
+                dest->data[cur].cont = next;
+                cur = next;
+            }
+            const int len = dest->data[cur].length;
+            memcpy(dest->data[cur].data[len], src->data[n].data[i],
+                   sizeof(fs_rid) * 3);
+            dest->data[cur].length++;
+        }
+    }
+    dest->data[head].flags = flags;
+
+    return head;
+}
+
 static int fs_tbchain_free_block(fs_tbchain *bc, fs_index_node b)
 {
     if (b == 0 || b == 1) {
@@ -31,6 +31,19 @@ fs_index_node fs_tbchain_length(fs_tbchain *bc, fs_index_node b);
 /* addpend a triple to the chain, creating blocks is neccesary */
 fs_index_node fs_tbchain_add_triple(fs_tbchain *bc, fs_index_node b, fs_rid triple[3]) __attribute__ ((warn_unused_result));
 
+/* mark any triples in the chain that match one of the count triples[], which
+ * must be sorted, as removed. Gives up after walking max_blocks blocks.
+ * Returns the number of triples removed, or -1 if the chain was not walked
+ * to the end, in which case some matching triples may remain */
+int fs_tbchain_remove_triples(fs_tbchain *bc, fs_index_node b, int count, fs_rid triples[][3], int max_blocks);
+/* pack the remaining triples of a sparse chain into as few blocks as
+ * possible and free the rest, the head block of the chain does not change */
+int fs_tbchain_compact_chain(fs_tbchain *bc, fs_index_node b);
+
+/* copy the remaining triples of chain b in src into a new chain in dest,
+ * returns the new chain */
+fs_index_node fs_tbchain_copy_chain(fs_tbchain *src, fs_index_node b, fs_tbchain *dest);
+
 /* functions to set/clear a bit on a chain, indicating that not all
  * the triples included still exist in the graph */
 int fs_tbchain_set_bit(fs_tbchain *bc, fs_index_node b, fs_tbchain_bit bit);
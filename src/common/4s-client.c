@@ -722,7 +722,7 @@ int fsp_bind_limit (fsp_link *link,
   } else {
     int count = length / (8 * cols);
     if (count == limit) {
-      (link->hit_limits)++;
+      fsp_hit_limits_add(link, 1);
     }
 
     *result = calloc(cols, sizeof(fs_rid_vector *));
@@ -825,7 +825,7 @@ int fsp_reverse_bind_all (fsp_link *link,
     } else {
       int count = length / (8 * cols);
       if (count == limit) {
-        (link->hit_limits)++;
+        fsp_hit_limits_add(link, 1);
       }
       for (k = 0; k < cols; ++k) {
         fs_rid_vector *v = fs_rid_vector_new(count);
@@ -864,15 +864,36 @@ int fsp_bind_limit_all (fsp_link *link,
                         fs_rid_vector ***result,
                         int offset,
                         int limit)
+{
+  return fsp_bind_limit_all_filter(link, flags, mrids, srids, prids, orids,
+                                   -1, NULL, result, offset, limit);
+}
+
+int fsp_bind_limit_all_filter (fsp_link *link,
+                        int flags,
+                        fs_rid_vector *mrids,
+                        fs_rid_vector *srids,
+                        fs_rid_vector *prids,
+                        fs_rid_vector *orids,
+                        int filter_slot,
+                        const fs_rid_bloom *filter,
+                        fs_rid_vector ***result,
+                        int offset,
+                        int limit)
 {
   fs_segment segment;
   unsigned char *out, *content;
-  unsigned int length, value;
+  unsigned int length, value, filter_length = 0;
   int sock[link->segments], ret = 0;
 
+  if (filter) {
+    filter_length = 16 + fs_rid_bloom_bytes(filter);
+  }
+
   /* fill out */
   length = 32 +
-         (mrids->length + srids->length + prids->length + orids->length ) * 8;
+         (mrids->length + srids->length + prids->length + orids->length ) * 8 +
+         filter_length;
 
   out = message_new(FS_BIND_LIMIT, 0, length);
   content = out + FS_HEADER;
@@ -888,6 +909,7 @@ int fsp_bind_limit_all (fsp_link *link,
   memcpy(content + 20, &value, sizeof(value));
   value = orids->length * 8;
   memcpy(content + 24, &value, sizeof(value));
+  memcpy(content + 28, &filter_length, sizeof(filter_length));
   content += 32;
 
   memcpy(content, mrids->data, mrids->length * 8);
@@ -899,6 +921,15 @@ int fsp_bind_limit_all (fsp_link *link,
   memcpy(content, orids->data, orids->length * 8);
   content += orids->length * 8;
 
+  if (filter) {
+    /* slot, log2 of bits, hashes, reserved, then the bits */
+    unsigned int header[4] = { filter_slot, filter->log2_bits, filter->hashes, 0 };
+    memcpy(content, header, sizeof(header));
+    content += sizeof(header);
+    memcpy(content, filter->bits, fs_rid_bloom_bytes(filter));
+    content += fs_rid_bloom_bytes(filter);
+  }
+
   for (segment = 0; segment < link->segments; ++segment) {
     unsigned int * const s = (unsigned int *) (out + 8);
     *s = segment;
@@ -941,7 +972,7 @@ int fsp_bind_limit_all (fsp_link *link,
     } else {
       int count = length / (8 * cols);
       if (count == limit) {
-        (link->hit_limits)++;
+        fsp_hit_limits_add(link, 1);
       }
       for (k = 0; k < cols; ++k) {
         fs_rid_vector *v = fs_rid_vector_new(count);
@@ -1394,6 +1425,21 @@ int fsp_get_query_times (fsp_link *link, fs_segment segment,
 }
 
 
+/* copy the entries of v whose matching entry in key is in segment */
+static unsigned char *copy_segment_rids (unsigned char *content,
+                                         fs_rid_vector *key, fs_rid_vector *v,
+                                         fs_segment segment, int segments)
+{
+  for (int k = 0; k < key->length; ++k) {
+    if (FS_RID_SEGMENT(key->data[k], segments) == segment) {
+      memcpy(content, v->data + k, 8);
+      content += 8;
+    }
+  }
+
+  return content;
+}
+
 int fsp_bind_limit_many (fsp_link *link,
                          int flags,
                          fs_rid_vector *mrids,
@@ -1413,7 +1459,12 @@ int fsp_bind_limit_many (fsp_link *link,
   switch (bind_direction) {
   case FS_BIND_BY_SUBJECT:
     {
-      unsigned int shared = mrids->length + prids->length + orids->length;
+      /* a paired vector has to be split along with the subjects */
+      fs_rid_vector *paired = NULL;
+      if (flags & FS_BIND_PAIR_SO) paired = orids;
+      else if (flags & FS_BIND_PAIR_SP) paired = prids;
+      unsigned int shared = mrids->length + prids->length + orids->length -
+                            (paired ? paired->length : 0);
       unsigned int subjects[link->segments];
 
       if (srids->length == 0) {
@@ -1427,7 +1478,8 @@ int fsp_bind_limit_many (fsp_link *link,
       }
 
       for (segment = 0; segment < link->segments; ++segment) {
-        unsigned int value, length = 32 + (subjects[segment] + shared) * 8;
+        unsigned int value, length = 32 +
+                        (subjects[segment] * (paired ? 2 : 1) + shared) * 8;
         unsigned char *content, *out;
 
         if (subjects[segment] == 0) {
@@ -1444,26 +1496,29 @@ int fsp_bind_limit_many (fsp_link *link,
         memcpy(content + 12, &value, sizeof(value));
         value = subjects[segment] * 8;
         memcpy(content + 16, &value, sizeof(value));
-        value = prids->length * 8;
+        value = (paired == prids ? subjects[segment] : prids->length) * 8;
         memcpy(content + 20, &value, sizeof(value));
-        value = orids->length * 8;
+        value = (paired == orids ? subjects[segment] : orids->length) * 8;
         memcpy(content + 24, &value, sizeof(value));
         content += 32;
 
         memcpy(content, mrids->data, mrids->length * 8);
         content += mrids->length * 8;
 
-        for (int k = 0; k < srids->length; ++k) {
-          if (FS_RID_SEGMENT(srids->data[k], link->segments) == segment) {
-            memcpy(content, srids->data + k, 8);
-            content += 8;
-          }
-        }
+        content = copy_segment_rids(content, srids, srids, segment, link->segments);
 
-        memcpy(content, prids->data, prids->length * 8);
-        content += prids->length * 8;
-        memcpy(content, orids->data, orids->length * 8);
-        content += orids->length * 8;
+        if (paired == prids) {
+          content = copy_segment_rids(content, srids, prids, segment, link->segments);
+        } else {
+          memcpy(content, prids->data, prids->length * 8);
+          content += prids->length * 8;
+        }
+        if (paired == orids) {
+          content = copy_segment_rids(content, srids, orids, segment, link->segments);
+        } else {
+          memcpy(content, orids->data, orids->length * 8);
+          content += orids->length * 8;
+        }
 
         sock[segment] = fsp_write(link, out, length);
         free(out);
@@ -1473,7 +1528,10 @@ int fsp_bind_limit_many (fsp_link *link,
     }
   case FS_BIND_BY_OBJECT:
     {
-      unsigned int shared = mrids->length + srids->length + prids->length;
+      /* (s, o) pairs have to be split along with the objects */
+      const int paired = flags & FS_BIND_PAIR_SO;
+      unsigned int shared = mrids->length + prids->length +
+                            (paired ? 0 : srids->length);
       unsigned int objects[link->segments];
 
       if (orids->length == 0) {
@@ -1487,7 +1545,8 @@ int fsp_bind_limit_many (fsp_link *link,
       }
 
       for (segment = 0; segment < link->segments; ++segment) {
-        unsigned int value, length = 32 + (objects[segment] + shared) * 8;
+        unsigned int value, length = 32 +
+                        (objects[segment] * (paired ? 2 : 1) + shared) * 8;
         unsigned char *content, *out;
 
         if (objects[segment] == 0) {
@@ -1502,7 +1561,7 @@ int fsp_bind_limit_many (fsp_link *link,
         memcpy(content + 8, &limit, sizeof(limit));
         value = mrids->length * 8;
         memcpy(content + 12, &value, sizeof(value));
-        value = srids->length * 8;
+        value = (paired ? objects[segment] : srids->length) * 8;
         memcpy(content + 16, &value, sizeof(value));
         value = prids->length * 8;
         memcpy(content + 20, &value, sizeof(value));
@@ -1512,17 +1571,16 @@ int fsp_bind_limit_many (fsp_link *link,
 
         memcpy(content, mrids->data, mrids->length * 8);
         content += mrids->length * 8;
-        memcpy(content, srids->data, srids->length * 8);
-        content += srids->length * 8;
+        if (paired) {
+          content = copy_segment_rids(content, orids, srids, segment, link->segments);
+        } else {
+          memcpy(content, srids->data, srids->length * 8);
+          content += srids->length * 8;
+        }
         memcpy(content, prids->data, prids->length * 8);
         content += prids->length * 8;
 
-        for (int k = 0; k < orids->length; ++k) {
-          if (FS_RID_SEGMENT(orids->data[k], link->segments) == segment) {
-            memcpy(content, orids->data + k, 8);
-            content += 8;
-          }
-        }
+        content = copy_segment_rids(content, orids, orids, segment, link->segments);
 
         sock[segment] = fsp_write(link, out, length);
         free(out);
@@ -1577,7 +1635,7 @@ int fsp_bind_limit_many (fsp_link *link,
     } else {
       int count = length / (8 * cols);
       if (count == limit) {
-        (link->hit_limits)++;
+        fsp_hit_limits_add(link, 1);
       }
 
       for (k = 0; k < cols; ++k) {
@@ -202,11 +202,31 @@ const char *fsp_kb_name(fsp_link *link)
   return link->kb_name;
 }
 
+/* limit hits are also counted per thread, as threads share the link */
+static GStaticPrivate thread_hits = G_STATIC_PRIVATE_INIT;
+
+static void thread_hits_add(int delta)
+{
+  int *hits = g_static_private_get(&thread_hits);
+  if (!hits) {
+    hits = calloc(1, sizeof(int));
+    g_static_private_set(&thread_hits, hits, free);
+  }
+  *hits += delta;
+}
+
 int fsp_hit_limits(fsp_link *link)
 {
   return link->hit_limits;
 }
 
+int fsp_hit_limits_thread(void)
+{
+  int *hits = g_static_private_get(&thread_hits);
+
+  return hits ? *hits : 0;
+}
+
 void fsp_hit_limits_reset(fsp_link *link)
 {
   link->hit_limits = 0;
@@ -215,6 +235,7 @@ void fsp_hit_limits_reset(fsp_link *link)
 void fsp_hit_limits_add(fsp_link *link, int delta)
 {
   (link->hit_limits) += delta;
+  thread_hits_add(delta);
 }
 
 fsp_hash_enum fsp_hash_type(fsp_link *link)
@@ -163,6 +163,20 @@ int fsp_bind_limit_all (fsp_link *link,
                   fs_rid_vector ***result,
                   int offset,
                   int limit);
+/* as fsp_bind_limit_all, but backends only return rows where the value in
+ * filter_slot (0-3 for m, s, p, o) passes the filter. Backends that predate
+ * filters ignore it, so the caller must still check the rows it gets back */
+int fsp_bind_limit_all_filter (fsp_link *link,
+                  int flags,
+                  fs_rid_vector *mrids,
+                  fs_rid_vector *srids,
+                  fs_rid_vector *prids,
+                  fs_rid_vector *orids,
+                  int filter_slot,
+                  const fs_rid_bloom *filter,
+                  fs_rid_vector ***result,
+                  int offset,
+                  int limit);
 
 #define fsp_bind(link, segment, flags, mrids, srids, prids, orids, result) \
 	fsp_bind_limit(link, segment, flags, mrids, srids, prids, orids, result, -1, -1)
@@ -273,6 +287,8 @@ void fsp_serve (const char *kb_name, fsp_backend *implementation, int daemon, fl
 const char *fsp_kb_name(fsp_link *link);
 
 int fsp_hit_limits(fsp_link *link);
+/* the limit hits counted by the calling thread, on any link */
+int fsp_hit_limits_thread(void);
 void fsp_hit_limits_reset(fsp_link *link);
 void fsp_hit_limits_add(fsp_link *link, int delta);
 
@@ -26,18 +26,17 @@
 #include "datatypes.h"
 #include "common/hash.h"
 
+/* initial number of slots, always a power of two */
 #define FS_RID_SET_ENTRIES 1024
-#define FS_RID_ENTRY_HASH(r) ((r >> 12) & (FS_RID_SET_ENTRIES-1))
-
-struct rid_entry {
-    fs_rid            val;
-    struct rid_entry *next;
-};
+#define FS_RID_SET_HASH(r) ((unsigned int)(((r) ^ ((r) >> 29)) * 0x9E3779B97F4A7C15ULL >> 32))
 
+/* open addressed with linear probing, FS_RID_NULL marks an empty slot as it
+ * can never be a member */
 struct _fs_rid_set {
-    struct rid_entry entry[FS_RID_SET_ENTRIES];
-    int scan_hash;
-    struct rid_entry *scan_entry;
+    fs_rid *slot;
+    unsigned int size;
+    unsigned int count;
+    unsigned int scan;
 };
 
 #ifdef DEBUG_RV_ALLOC
@@ -142,11 +141,13 @@ void fs_rid_vector_append_set(fs_rid_vector *v, fs_rid_set *s)
 {
     if (!s) return;
 
-    for (int hash=0; hash < FS_RID_SET_ENTRIES; hash++) {
-	for (struct rid_entry *e=&(s->entry[hash]); e; e=e->next) {
-	    if (e->val != FS_RID_NULL) {
-		fs_rid_vector_append(v, e->val);
-	    }
+    if (v->size - v->length < (int)s->count) {
+	v->size = v->length + s->count;
+	v->data = realloc(v->data, sizeof(fs_rid) * v->size);
+    }
+    for (unsigned int i=0; i<s->size; i++) {
+	if (s->slot[i] != FS_RID_NULL) {
+	    v->data[v->length++] = s->slot[i];
 	}
     }
 }
@@ -276,34 +277,124 @@ void fs_rid_vector_uniq(fs_rid_vector *v, int remove_null)
     v->length = outrow;
 }
 
-static int inter_sub(int count, int pos, const fs_rid_vector *rv[], fs_rid val)
+/* true if v is in the order fs_rid_vector_sort() leaves it in */
+static int rid_sorted(const fs_rid_vector *v)
 {
-    int found = 0;
+    for (int i=1; i<v->length; i++) {
+	if ((int64_t)v->data[i-1] > (int64_t)v->data[i]) return 0;
+    }
 
-    if (pos >= count) return 1;
+    return 1;
+}
+
+/* returns the first position >= from where data[pos] >= val, galloping
+ * forwards so that a run of near misses costs log(distance) */
+static int rid_gallop(const fs_rid *data, int length, int from, int64_t val)
+{
+    int step = 1;
+    int lo = from, hi = from;
 
-    for (int i=0; i<rv[pos]->length; i++) {
-	if (rv[pos]->data[i] == val) {
-	    found = 1;
-	    break;
+    while (hi < length && (int64_t)data[hi] < val) {
+	lo = hi + 1;
+	hi += step;
+	step *= 2;
+    }
+    if (hi > length) hi = length;
+    while (lo < hi) {
+	int mid = lo + (hi - lo) / 2;
+	if ((int64_t)data[mid] < val) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid;
 	}
     }
 
-    if (!found) return 0;
-
-    return inter_sub(count, pos+1, rv, val);
+    return lo;
 }
 
+/* the inputs to fs_rid_vector_intersect() after the first, and how each is
+ * searched */
+struct inter_input {
+    const fs_rid_vector *v;
+    int sorted;
+    int pos;			/* last match, if rv[0] is sorted */
+    fs_rid_set *set;		/* for long unsorted vectors */
+    int has_null;		/* the set can't hold FS_RID_NULL */
+};
+
+/* up to this many inputs are kept on the stack */
+#define INTER_STACK 8
+
+/* returns the values of rv[0], in order, that appear in all of rv[1..count-1].
+ * Sorted inputs are merged by galloping through each of the others, long
+ * unsorted ones are loaded into an fs_rid_set and probed */
 fs_rid_vector *fs_rid_vector_intersect(int count, const fs_rid_vector *rv[])
 {
     fs_rid_vector *ret = fs_rid_vector_new(0);
 
+    if (count < 1 || rv[0]->length == 0) return ret;
+    for (int j=1; j<count; j++) {
+	if (rv[j]->length == 0) return ret;
+    }
+
+    const int first_sorted = rid_sorted(rv[0]);
+    struct inter_input stack[INTER_STACK];
+    struct inter_input *in = count <= INTER_STACK ? stack :
+                             malloc(count * sizeof(struct inter_input));
+    for (int j=1; j<count; j++) {
+	in[j].v = rv[j];
+	in[j].pos = 0;
+	in[j].sorted = rid_sorted(rv[j]);
+	in[j].set = NULL;
+	in[j].has_null = 0;
+	/* a short unsorted vector isn't worth the table */
+	if (!in[j].sorted && rv[j]->length > 16) {
+	    in[j].set = fs_rid_set_new();
+	    fs_rid_set_add_vector(in[j].set, (fs_rid_vector *)rv[j]);
+	    for (int k=0; k<rv[j]->length; k++) {
+		if (rv[j]->data[k] == FS_RID_NULL) {
+		    in[j].has_null = 1;
+		    break;
+		}
+	    }
+	}
+    }
+
     for (int i=0; i<rv[0]->length; i++) {
-	if (inter_sub(count, 1, rv, rv[0]->data[i])) {
-	    fs_rid_vector_append(ret, rv[0]->data[i]);
+	const fs_rid val = rv[0]->data[i];
+	int found = 1;
+	for (int j=1; j<count && found; j++) {
+	    const fs_rid_vector *v = in[j].v;
+	    if (in[j].sorted) {
+		/* if rv[0] is sorted too we never need to look behind the
+		 * last match */
+		int p = rid_gallop(v->data, v->length,
+				   first_sorted ? in[j].pos : 0, (int64_t)val);
+		if (first_sorted) in[j].pos = p;
+		found = p < v->length && v->data[p] == val;
+	    } else if (in[j].set) {
+		found = val == FS_RID_NULL ? in[j].has_null :
+			fs_rid_set_contains(in[j].set, val);
+	    } else {
+		found = 0;
+		for (int k=0; k<v->length; k++) {
+		    if (v->data[k] == val) {
+			found = 1;
+			break;
+		    }
+		}
+	    }
+	}
+	if (found) {
+	    fs_rid_vector_append(ret, val);
 	}
     }
 
+    for (int j=1; j<count; j++) {
+	if (in[j].set) fs_rid_set_free(in[j].set);
+    }
+    if (in != stack) free(in);
+
     return ret;
 }
 
@@ -328,6 +419,16 @@ int fs_rid_vector_contains(fs_rid_vector *v, fs_rid r)
     return 0;
 }
 
+int fs_rid_vector_contains_sorted(fs_rid_vector *v, fs_rid r)
+{
+    if (!v) return 0;
+    if (!v->data) return 0;
+
+    int p = rid_gallop(v->data, v->length, 0, (int64_t)r);
+
+    return p < v->length && v->data[p] == r;
+}
+
 char *fs_rid_vector_to_string(fs_rid_vector *v)
 {
     char *ret = calloc(24, v->length);
@@ -437,121 +538,195 @@ void fs_rid_str_vector_free(fs_rid_str_vector *t)
 fs_rid_set *fs_rid_set_new()
 {
     fs_rid_set *s = calloc(1, sizeof(fs_rid_set));
-    for (int i=0; i<FS_RID_SET_ENTRIES; i++) {
-	s->entry[i].val = FS_RID_NULL;
+    s->size = FS_RID_SET_ENTRIES;
+    s->slot = malloc(s->size * sizeof(fs_rid));
+    for (unsigned int i=0; i<s->size; i++) {
+	s->slot[i] = FS_RID_NULL;
     }
 
     return s;
 }
 
+/* place val without checking the load, it must not already be present */
+static void rid_set_place(fs_rid *slot, unsigned int size, fs_rid val)
+{
+    unsigned int h = FS_RID_SET_HASH(val) & (size-1);
+    while (slot[h] != FS_RID_NULL) {
+	h = (h + 1) & (size-1);
+    }
+    slot[h] = val;
+}
+
+/* make room for at least count members at no more than half full */
+static void rid_set_reserve(fs_rid_set *s, unsigned int count)
+{
+    unsigned int size = s->size;
+    while (size < count * 2) size *= 2;
+    if (size == s->size) return;
+
+    fs_rid *slot = malloc(size * sizeof(fs_rid));
+    for (unsigned int i=0; i<size; i++) {
+	slot[i] = FS_RID_NULL;
+    }
+    for (unsigned int i=0; i<s->size; i++) {
+	if (s->slot[i] != FS_RID_NULL) {
+	    rid_set_place(slot, size, s->slot[i]);
+	}
+    }
+    free(s->slot);
+    s->slot = slot;
+    s->size = size;
+}
+
 void fs_rid_set_add(fs_rid_set *s, fs_rid val)
 {
     if (val == FS_RID_NULL) return;
 
-    struct rid_entry *e = &s->entry[FS_RID_ENTRY_HASH(val)];
-    if (e->val == val) return;
-    if (e->val == FS_RID_NULL) {
-	e->val = val;
-
-	return;
+    unsigned int h = FS_RID_SET_HASH(val) & (s->size-1);
+    while (s->slot[h] != FS_RID_NULL) {
+	if (s->slot[h] == val) return;
+	h = (h + 1) & (s->size-1);
     }
-    while (e->next) {
-	if (e->val == val) return;
-	e = e->next;
+    if ((s->count + 1) * 2 > s->size) {
+	rid_set_reserve(s, s->count + 1);
+	rid_set_place(s->slot, s->size, val);
+    } else {
+	s->slot[h] = val;
     }
+    s->count++;
+}
 
-    struct rid_entry *ne = calloc(1, sizeof(struct rid_entry));
-    ne->val = val;
-    e->next = ne;
+void fs_rid_set_add_vector(fs_rid_set *s, fs_rid_vector *v)
+{
+    if (!v) return;
+
+    /* sizing for the whole vector up front means at most one rehash */
+    rid_set_reserve(s, s->count + v->length);
+    for (int i=0; i<v->length; i++) {
+	fs_rid_set_add(s, v->data[i]);
+    }
 }
 
 int fs_rid_set_contains(fs_rid_set *s, fs_rid val)
 {
     if (val == FS_RID_NULL) return 0;
 
-    struct rid_entry *e = &s->entry[FS_RID_ENTRY_HASH(val)];
-
-    if (e->val == FS_RID_NULL) return 0;
-    if (e->val == val) return 1;
-
-    while (e->val != FS_RID_NULL && e->next) {
-	if (e->val == val) return 1;
-	e = e->next;
+    unsigned int h = FS_RID_SET_HASH(val) & (s->size-1);
+    while (s->slot[h] != FS_RID_NULL) {
+	if (s->slot[h] == val) return 1;
+	h = (h + 1) & (s->size-1);
     }
 
-    return 0; 
+    return 0;
+}
+
+int fs_rid_set_length(fs_rid_set *s)
+{
+    return s ? s->count : 0;
 }
 
 int fs_rid_set_rewind(fs_rid_set *s)
 {
     if (!s) return 1;
 
-    for (int i=0; i<FS_RID_SET_ENTRIES; i++) {
-        if (s->entry[i].val != FS_RID_NULL) {
-            s->scan_hash = i;
-            s->scan_entry = &s->entry[i];
-
-            return 0;
-        }
-    }
-
-    s->scan_hash = FS_RID_SET_ENTRIES;
-    s->scan_entry = NULL;
+    s->scan = 0;
 
     return 0;
 }
 
 fs_rid fs_rid_set_next(fs_rid_set *s)
 {
-    while (s->scan_hash < FS_RID_SET_ENTRIES) {
-	if (s->scan_entry) {
-	    if (s->scan_entry->val != FS_RID_NULL) {
-		fs_rid rid = s->scan_entry->val;
-		s->scan_entry = s->scan_entry->next;
-
-		return rid;
-	    }
+    while (s->scan < s->size) {
+	fs_rid rid = s->slot[s->scan++];
+	if (rid != FS_RID_NULL) {
+	    return rid;
 	}
-	(s->scan_hash)++;
-	s->scan_entry = &s->entry[s->scan_hash];
     }
 
     return FS_RID_NULL;
 }
 
+fs_rid_vector *fs_rid_set_to_vector(fs_rid_set *s)
+{
+    fs_rid_vector *v = fs_rid_vector_new(0);
+    fs_rid_vector_append_set(v, s);
+
+    return v;
+}
+
 void fs_rid_set_print(fs_rid_set *s)
 {
-    printf("rid_set at %p\n", s);
-    for (int i=0; i<FS_RID_SET_ENTRIES; i++) {
-	if (s->entry[i].val != FS_RID_NULL) {
-	    printf("  %llx\n", s->entry[i].val);
-	}
-	if (s->entry[i].next) {
-	    struct rid_entry *e = s->entry[i].next;
-	    while (e) {
-		printf("  %llx\n", e->val);
-		e = e->next;
-	    }
+    printf("rid_set at %p, %u/%u\n", s, s->count, s->size);
+    for (unsigned int i=0; i<s->size; i++) {
+	if (s->slot[i] != FS_RID_NULL) {
+	    printf("  %llx\n", s->slot[i]);
 	}
     }
 }
 
 void fs_rid_set_free(fs_rid_set *s)
 {
-    for (int i=0; i<FS_RID_SET_ENTRIES; i++) {
-	if (s->entry[i].next) {
-	    struct rid_entry *e = s->entry[i].next;
-	    while (e) {
-		struct rid_entry *next = e->next;
-		free(e);
-		e = next;
-	    }
-	}
-    }
+    if (!s) return;
 
+    free(s->slot);
     free(s);
 }
 
+/* bits per value, and bits set per value, gives a false positive rate a little
+ * under 1% at worst, rounding the size up to a power of two only improves it */
+#define FS_RID_BLOOM_BITS 10
+#define FS_RID_BLOOM_HASHES 7
+#define FS_RID_BLOOM_MIN_LOG2 10
+#define FS_RID_BLOOM_MAX_LOG2 30
+
+fs_rid_bloom *fs_rid_bloom_new(fs_rid_vector *v)
+{
+    fs_rid_bloom *b = calloc(1, sizeof(fs_rid_bloom));
+    long long want = (long long)fs_rid_vector_length(v) * FS_RID_BLOOM_BITS;
+
+    b->log2_bits = FS_RID_BLOOM_MIN_LOG2;
+    while (b->log2_bits < FS_RID_BLOOM_MAX_LOG2 && (1LL << b->log2_bits) < want) {
+        b->log2_bits++;
+    }
+    b->hashes = FS_RID_BLOOM_HASHES;
+    b->bits = calloc(fs_rid_bloom_bytes(b), 1);
+
+    for (int i=0; i<fs_rid_vector_length(v); i++) {
+        const fs_rid r = v->data[i];
+        uint64_t h1 = r * 0x9E3779B97F4A7C15ULL;
+        const uint64_t h2 = ((r ^ (r >> 31)) * 0xBF58476D1CE4E5B9ULL) | 1;
+        for (int k=0; k<b->hashes; k++) {
+            const uint64_t bit = h1 >> (64 - b->log2_bits);
+            b->bits[bit >> 3] |= 1 << (bit & 7);
+            h1 += h2;
+        }
+    }
+
+    return b;
+}
+
+int fs_rid_bloom_contains(const fs_rid_bloom *b, fs_rid r)
+{
+    uint64_t h1 = r * 0x9E3779B97F4A7C15ULL;
+    const uint64_t h2 = ((r ^ (r >> 31)) * 0xBF58476D1CE4E5B9ULL) | 1;
+
+    for (int k=0; k<b->hashes; k++) {
+        const uint64_t bit = h1 >> (64 - b->log2_bits);
+        if (!(b->bits[bit >> 3] & (1 << (bit & 7)))) return 0;
+        h1 += h2;
+    }
+
+    return 1;
+}
+
+void fs_rid_bloom_free(fs_rid_bloom *b)
+{
+    if (!b) return;
+
+    free(b->bits);
+    free(b);
+}
+
 double fs_time()
 {
     struct timeval now;
@@ -36,6 +36,12 @@
 #define FS_BIND_SAME_ABAB        0xd000
 #define FS_BIND_SAME_ABBA        0xe000
 
+/* the subject vector is a list of (s, o) or (s, p) pairs with the object or
+ * predicate vector, matched row by row rather than as a cartesian product */
+#define FS_BIND_PAIR_SO        0x100000
+#define FS_BIND_PAIR_SP        0x200000
+#define FS_BIND_PAIR_MASK      0x300000
+
 #define FS_QUERY_RESTRICTED    0x800000
 
 #define FS_BIND_BY_SUBJECT    0x1000000
@@ -83,6 +89,14 @@ typedef struct _fs_resource {
 
 typedef struct _fs_rid_set fs_rid_set;
 
+/* a Bloom filter over rids, used to send an approximate set of values where
+ * the exact one would be too big */
+typedef struct _fs_rid_bloom {
+    int log2_bits;          /* the filter is 2^log2_bits bits long */
+    int hashes;             /* number of bits set per value */
+    unsigned char *bits;
+} fs_rid_bloom;
+
 typedef struct _fs_import_timing {
     double add_s;
     double add_o;
@@ -144,6 +158,8 @@ void fs_rid_vector_array_sort(fs_rid_vector **v, int count, int left, int right)
 void fs_rid_vector_sort(fs_rid_vector *v);
 void fs_rid_vector_uniq(fs_rid_vector *v, int remove_null);
 int fs_rid_vector_contains(fs_rid_vector *v, fs_rid r);
+/* v must have been through fs_rid_vector_sort() */
+int fs_rid_vector_contains_sorted(fs_rid_vector *v, fs_rid r);
 char *fs_rid_vector_to_string(fs_rid_vector *v);
 fs_rid_vector *fs_rid_vector_intersect(int count, const fs_rid_vector *rv[]);
 void fs_rid_vector_truncate(fs_rid_vector *rv, int32_t length);
@@ -162,11 +178,20 @@ void fs_rid_str_vector_free(fs_rid_str_vector *t);
 
 fs_rid_set *fs_rid_set_new(void);
 void fs_rid_set_add(fs_rid_set *s, fs_rid val);
+void fs_rid_set_add_vector(fs_rid_set *s, fs_rid_vector *v);
 int fs_rid_set_contains(fs_rid_set *s, fs_rid vsl);
+int fs_rid_set_length(fs_rid_set *s);
 int fs_rid_set_rewind(fs_rid_set *s);
 fs_rid fs_rid_set_next(fs_rid_set *s);
+/* members in no particular order */
+fs_rid_vector *fs_rid_set_to_vector(fs_rid_set *s);
 void fs_rid_set_print(fs_rid_set *s);
 void fs_rid_set_free(fs_rid_set *s);
+
+fs_rid_bloom *fs_rid_bloom_new(fs_rid_vector *v);
+int fs_rid_bloom_contains(const fs_rid_bloom *b, fs_rid r);
+#define fs_rid_bloom_bytes(b) (1 << ((b)->log2_bits - 3))
+void fs_rid_bloom_free(fs_rid_bloom *b);
  
 double fs_time(void); 
 
@@ -33,6 +33,12 @@
 
 #define FS_FANOUT_LIMIT 998
 
+/* binds driven by more values than this are sent in chunks of this size */
+#define FS_BIND_CHUNK_SIZE 32768
+
+/* bytes of binding table a single query may build before it's stopped */
+#define FS_QUERY_MEMORY_BUDGET (1024LL * 1024 * 1024)
+
 #ifndef O_NOATIME
 #define FS_O_NOATIME 0
 #else
@@ -62,6 +68,7 @@
 #define FS_PTREE      FS_STORE_ROOT "/%s/%04x/p%c-%016llx.ptree"
 #define FS_PTABLE     FS_STORE_ROOT "/%s/%04x/%s.ptable"
 #define FS_TBCHAIN    FS_STORE_ROOT "/%s/%04x/%s.tbchain"
+#define FS_PUBLISH    FS_STORE_ROOT "/%s/%04x/publish.log"
 
 #define FS_LEGAL_KB_CHARS "abcdefghijklmnopqrstuvwxyz" \
                            "ABCDEFGHIJKLMNOPQRSTUVWXYZ" \
@@ -0,0 +1,168 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+/* check fs_rid_vector_intersect against a plain nested loop, over sorted,
+ * unsorted, short and long inputs with repeats and NULLs, and fs_rid_set
+ * against a sorted vector as it grows */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "datatypes.h"
+
+#define ROUNDS 2000
+
+static int errors = 0;
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        printf("ERROR %s\n", what);
+        errors++;
+    }
+}
+
+/* values from a small range, so inputs overlap, with the odd NULL */
+static fs_rid_vector *random_vector(int length, int range)
+{
+    fs_rid_vector *v = fs_rid_vector_new(length);
+
+    for (int i=0; i<length; i++) {
+        if (rand() % 50 == 0) {
+            v->data[i] = FS_RID_NULL;
+        } else {
+            /* spread over both halves, so signed order matters */
+            v->data[i] = ((fs_rid)(rand() % range) << 48) ^ 0x8000000000000123ULL;
+        }
+    }
+    if (rand() % 2) fs_rid_vector_sort(v);
+
+    return v;
+}
+
+static fs_rid_vector *naive_intersect(int count, fs_rid_vector *rv[])
+{
+    fs_rid_vector *ret = fs_rid_vector_new(0);
+
+    for (int i=0; i<rv[0]->length; i++) {
+        int found = 1;
+        for (int j=1; j<count && found; j++) {
+            found = fs_rid_vector_contains(rv[j], rv[0]->data[i]);
+        }
+        if (found) fs_rid_vector_append(ret, rv[0]->data[i]);
+    }
+
+    return ret;
+}
+
+static int same_vector(fs_rid_vector *a, fs_rid_vector *b)
+{
+    if (a->length != b->length) return 0;
+    for (int i=0; i<a->length; i++) {
+        if (a->data[i] != b->data[i]) return 0;
+    }
+
+    return 1;
+}
+
+/* add in bursts, one at a time and by vector, through several doublings */
+static void check_set(int length, int range)
+{
+    fs_rid_set *s = fs_rid_set_new();
+    fs_rid_vector *want = fs_rid_vector_new(0);
+
+    while (want->length < length) {
+        fs_rid_vector *v = random_vector(rand() % 100, range);
+        if (rand() % 2) {
+            fs_rid_set_add_vector(s, v);
+        } else {
+            for (int i=0; i<v->length; i++) {
+                fs_rid_set_add(s, v->data[i]);
+            }
+        }
+        fs_rid_vector_append_vector(want, v);
+        fs_rid_vector_free(v);
+    }
+    fs_rid_vector_sort(want);
+    fs_rid_vector_uniq(want, 1);
+
+    check(fs_rid_set_length(s) == want->length, "set has the wrong length");
+    for (int i=0; i<want->length; i++) {
+        check(fs_rid_set_contains(s, want->data[i]), "set lost a member");
+        check(!fs_rid_set_contains(s, want->data[i] + 1) ||
+              fs_rid_vector_contains_sorted(want, want->data[i] + 1),
+              "set has a member that was never added");
+    }
+    check(!fs_rid_set_contains(s, FS_RID_NULL), "set contains NULL");
+
+    fs_rid_vector *got = fs_rid_vector_new(0);
+    fs_rid r;
+    fs_rid_set_rewind(s);
+    while ((r = fs_rid_set_next(s)) != FS_RID_NULL) {
+        fs_rid_vector_append(got, r);
+    }
+    fs_rid_vector_sort(got);
+    check(same_vector(got, want), "set iteration is wrong");
+    fs_rid_vector_free(got);
+
+    got = fs_rid_set_to_vector(s);
+    fs_rid_vector_sort(got);
+    check(same_vector(got, want), "set to vector is wrong");
+    fs_rid_vector_free(got);
+
+    fs_rid_vector_free(want);
+    fs_rid_set_free(s);
+}
+
+int main(int argc, char *argv[])
+{
+    srand(1);
+    for (int r=0; r<ROUNDS; r++) {
+        /* past the number of inputs that fit on the stack now and then */
+        const int count = 1 + rand() % (r % 10 ? 4 : 12);
+        const int range = 1 + rand() % 200;
+        fs_rid_vector *rv[12];
+
+        for (int j=0; j<count; j++) {
+            const int length = rand() % 4 ? rand() % 20 : rand() % 500;
+            rv[j] = random_vector(length, range);
+        }
+        fs_rid_vector *got = fs_rid_vector_intersect(count, (const fs_rid_vector **)rv);
+        fs_rid_vector *want = naive_intersect(count, rv);
+        check(same_vector(got, want), "intersection differs from the nested loop");
+        fs_rid_vector_free(got);
+        fs_rid_vector_free(want);
+        for (int j=0; j<count; j++) {
+            fs_rid_vector_free(rv[j]);
+        }
+    }
+
+    for (int r=0; r<100; r++) {
+        check_set(rand() % 20000, 1 + rand() % 50000);
+    }
+
+    if (errors) {
+        printf("FAIL, %d errors\n", errors);
+
+        return 1;
+    }
+    printf("PASS\n");
+
+    return 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
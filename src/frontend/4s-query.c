@@ -136,10 +136,11 @@ int main(int argc, char *argv[])
       fprintf(stderr, " query is a SPARQL%s query, remember to use"
                       " shell quoting if necessary\n", langs);
       fprintf(stderr, " -f              Output format one of, sparql, text, json, or testcase\n");
+      fprintf(stderr, "                 or for CONSTRUCT and DESCRIBE, ntriples, nquads or turtle\n");
       fprintf(stderr, " -O, --opt-level Set optimisation level, range 0-3\n");
       fprintf(stderr, " -I, --insert    Interpret CONSTRUCT statements as inserts\n");
       fprintf(stderr, " -r, --restricted  Enable query complexity restriction\n");
-      fprintf(stderr, " -s, --soft-limit  Override default soft limit on search breadth\n");
+      fprintf(stderr, " -s, --soft-limit  Override default soft limit on search breadth, -1 for none\n");
       fprintf(stderr, " -d, --default-graph  Enable SPARQL default graph support\n");
       fprintf(stderr, " -b, --base      Set base URI for query\n");
       return 1;
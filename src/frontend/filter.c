@@ -92,8 +92,7 @@ static fs_value cast_datetime(fs_query *q, fs_value a)
 {
     if (a.lex) {
         fs_value ret = fs_value_datetime_from_string(a.lex);
-        ret.lex = g_strdup(a.lex);
-        fs_query_add_freeable(q, ret.lex);
+        ret.lex = fs_query_strdup(q, a.lex);
 
 	return ret;
     }
@@ -113,8 +112,7 @@ static fs_value cast_lexical(fs_query *q, fs_value a)
 	return a;
     }	
     if (a.valid & fs_valid_bit(FS_V_FP)) {
-	a.lex = g_strdup_printf("%f", a.fp);
-        fs_query_add_freeable(q, a.lex);
+	a.lex = fs_query_strdup_printf(q, "%f", a.fp);
 
 	return a;
     }
@@ -126,8 +124,7 @@ static fs_value cast_lexical(fs_query *q, fs_value a)
     }
     if (a.valid & fs_valid_bit(FS_V_IN)) {
 	if (a.attr == fs_c.xsd_integer) {
-	    a.lex = g_strdup_printf("%lld", (long long)a.in);
-            fs_query_add_freeable(q, a.lex);
+	    a.lex = fs_query_strdup_printf(q, "%lld", (long long)a.in);
 
 	    return a;
 	}
@@ -136,10 +133,9 @@ static fs_value cast_lexical(fs_query *q, fs_value a)
 	    struct tm t;
 	    time_t clock = a.in;
 	    gmtime_r(&clock, &t);
-	    a.lex = g_strdup_printf("%04d-%02d-%02dT%02d:%02d:%02d", 
+	    a.lex = fs_query_strdup_printf(q, "%04d-%02d-%02dT%02d:%02d:%02d", 
 		    t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
 		    t.tm_hour, t.tm_min, t.tm_sec);
-            fs_query_add_freeable(q, a.lex);
 
 	    return a;
 	}
@@ -45,7 +45,7 @@
 
 #define MEMBER_PREFIX "http://www.w3.org/1999/02/22-rdf-syntax-ns#_"
 
-typedef struct {
+typedef struct _fs_parse_stuff {
     fsp_link *link;
     int verbosity;
     int dryrun;
@@ -61,8 +61,12 @@ typedef struct {
     char *quad_fn;
     int segments;
     int has_o_index;
+    int replace;
+    fs_rid replace_model;
     raptor_uri muri;
     raptor_parser *parser;
+    int stream;
+    GHashTable *bnids;
 } fs_parse_stuff;
 
 static long res_pos[FS_MAX_SEGMENTS];
@@ -77,6 +81,7 @@ static void store_stmt(void *user_data,
 		       const raptor_statement * statement);
 
 static int process_quads(fs_parse_stuff *data);
+static int process_quads_replace(fs_parse_stuff *data);
 
 #define CACHE_SIZE 32768
 #define CACHE_MASK (CACHE_SIZE-1)
@@ -128,136 +133,181 @@ static int inited = 0;
 
 static fs_parse_stuff parse_data;
 
-void rdf_parser_warning(void *user_data, raptor_locator* locator, const char *message)
+/* streams share the resource buffers, which are set up by the first one
+ * started and released when the last one finishes */
+static int open_streams = 0;
+
+static void rdf_parser_warning(void *user_data, raptor_locator* locator, const char *message)
 {
-    parse_data.count_warn++;
+    fs_parse_stuff *data = (fs_parse_stuff *) user_data;
+
+    data->count_warn++;
     fs_error(LOG_ERR, "raptor parser warning: %s line %d", message,
              raptor_locator_line(locator));
 }
 
-void rdf_parser_error(void *user_data, raptor_locator* locator, const char *message)
+static void rdf_parser_error(void *user_data, raptor_locator* locator, const char *message)
 {
-    parse_data.count_err++;
+    fs_parse_stuff *data = (fs_parse_stuff *) user_data;
+
+    data->count_err++;
     fs_error(LOG_ERR, "raptor parser error: %s line %d", message,
              raptor_locator_line(locator));
 }
 
-void fatal_rdf_parser_error(void *user_data, raptor_locator* locator, const char *message)
+static void fatal_rdf_parser_error(void *user_data, raptor_locator* locator, const char *message)
 {
-    parse_data.count_err++;
+    fs_parse_stuff *data = (fs_parse_stuff *) user_data;
+
+    data->count_err++;
     fs_error(LOG_ERR, "fatal raptor parser error: %s line %d", message,
              raptor_locator_line(locator));
 }
 
-void graph_handler(void *user_data, raptor_uri *graph)
+static void graph_handler(void *user_data, raptor_uri *graph)
 {
-    g_free(parse_data.model);
+    fs_parse_stuff *data = (fs_parse_stuff *) user_data;
+
+    g_free(data->model);
     if (graph == NULL) {
-        parse_data.model = g_strdup((char *) raptor_uri_as_string(parse_data.muri));
+        data->model = g_strdup((char *) raptor_uri_as_string(data->muri));
     } else {
-        parse_data.model = g_strdup((char *) raptor_uri_as_string(graph));
+        data->model = g_strdup((char *) raptor_uri_as_string(graph));
     }
 
-    parse_data.model_hash = fs_hash_uri(parse_data.model);
-    buffer_res(parse_data.link, parse_data.segments, parse_data.model_hash, parse_data.model, FS_RID_NULL, parse_data.dryrun);
+    data->model_hash = fs_hash_uri(data->model);
+    buffer_res(data->link, data->segments, data->model_hash, data->model, FS_RID_NULL, data->dryrun);
 }
 
 /* ..._start and ..._finish share an int * count parameter
- * the same variable should be passed by reference both times */
-int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count)
+ * the same variable should be passed by reference both times.
+ * Several streams can be open at once. Nothing is sent to the backends
+ * but resources until ..._finish, which imports the stream's quads and
+ * commits them in one go */
+fs_import_stream *fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count)
 {
-    if (inited == 0) {
-        memset(&parse_data, 0, sizeof(parse_data));
-        inited = 1;
-    }
+    fs_parse_stuff *data = calloc(1, sizeof(fs_parse_stuff));
 
-    parse_data.link = link;
-    parse_data.segments = fsp_link_segments(link);
-    parse_data.ext_count = count;
+    data->link = link;
+    data->segments = fsp_link_segments(link);
+    data->ext_count = count;
+    data->stream = 1;
 
-    for (int i=0; i<parse_data.segments; i++) {
-        for (int j=0; j<RES_BUF_SIZE; j++) {
-            lex_tmp[i][j] = malloc(RES_BUF_SIZE);
-        }
-    }
+    data->quad_fn = g_strdup(FS_TMP_PATH "/importXXXXXX");
+    data->quad_fd = mkstemp(data->quad_fn);
+    if (data->quad_fd < 0) {
+        fs_error(LOG_ERR, "Cannot create tmp file “%s”", data->quad_fn);
+        g_free(data->quad_fn);
+        free(data);
 
-    memset(nodecache, 0, sizeof(nodecache));
+        return NULL;
+    }
 
-    parse_data.quad_fn = g_strdup(FS_TMP_PATH "/importXXXXXX");
-    parse_data.quad_fd = mkstemp(parse_data.quad_fn);
-    if (parse_data.quad_fd < 0) {
-        fs_error(LOG_ERR, "Cannot create tmp file “%s”", parse_data.quad_fn);
-        return 1;
+    if (open_streams++ == 0) {
+        for (int i=0; i<data->segments; i++) {
+            for (int j=0; j<RES_BUF_SIZE; j++) {
+                lex_tmp[i][j] = malloc(RES_BUF_SIZE);
+            }
+        }
+        memset(nodecache, 0, sizeof(nodecache));
     }
 
-    parse_data.muri = raptor_new_uri((unsigned char *) model_uri);
+    data->muri = raptor_new_uri((unsigned char *) model_uri);
 
-    parse_data.model = g_strdup(model_uri);
-    parse_data.model_hash = fs_hash_uri(model_uri);
-    parse_data.count_trip = 0;
-    parse_data.count_warn = 0;
-    parse_data.count_err = 0;
-    parse_data.last_count = 0;
-    parse_data.has_o_index = has_o_index;
+    data->model = g_strdup(model_uri);
+    data->model_hash = fs_hash_uri(model_uri);
+    data->has_o_index = has_o_index;
+
+    /* blank nodes are unique per file */
+    data->bnids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 
     /* store the model uri */
-    buffer_res(link, parse_data.segments, parse_data.model_hash, parse_data.model, FS_RID_NULL, parse_data.dryrun);
+    buffer_res(link, data->segments, data->model_hash, data->model, FS_RID_NULL, data->dryrun);
 
-    parse_data.parser = raptor_new_parser_for_content(NULL, mimetype, NULL, 0, (unsigned char *) parse_data.model);
+    data->parser = raptor_new_parser_for_content(NULL, mimetype, NULL, 0, (unsigned char *) data->model);
 
-    if (!parse_data.parser) {
-        return 1;
+    if (!data->parser) {
+        fs_error(LOG_ERR, "no parser for “%s”", mimetype);
+        data->count_err++;
+
+        return data;
     }
 
     /* use us as a vector for an indirect attack? no thanks */
-    raptor_set_feature(parse_data.parser, RAPTOR_FEATURE_NO_NET, 0);
+    raptor_set_feature(data->parser, RAPTOR_FEATURE_NO_NET, 0);
 
-    raptor_set_warning_handler(parse_data.parser, link, rdf_parser_warning);
-    raptor_set_error_handler(parse_data.parser, link, rdf_parser_error);
-    raptor_set_fatal_error_handler(parse_data.parser, link, fatal_rdf_parser_error);
+    raptor_set_warning_handler(data->parser, data, rdf_parser_warning);
+    raptor_set_error_handler(data->parser, data, rdf_parser_error);
+    raptor_set_fatal_error_handler(data->parser, data, fatal_rdf_parser_error);
 
-    raptor_set_statement_handler(parse_data.parser, &parse_data, store_stmt);
-    raptor_set_graph_handler(parse_data.parser, &parse_data, graph_handler);
+    raptor_set_statement_handler(data->parser, data, store_stmt);
+    raptor_set_graph_handler(data->parser, data, graph_handler);
 
-    raptor_start_parse(parse_data.parser, parse_data.muri);
+    raptor_start_parse(data->parser, data->muri);
 
-    fs_hash_freshen(); /* blank nodes are unique per file */
+    return data;
+}
 
-    return 0;
+/* as fs_import_stream_start, but the existing contents of model_uri are
+ * left in place, and ..._finish only sends the difference between them
+ * and the parsed triples */
+fs_import_stream *fs_import_stream_replace_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count)
+{
+    fs_parse_stuff *data = fs_import_stream_start(link, model_uri, mimetype, has_o_index, count);
+    if (data) {
+        data->replace = 1;
+        data->replace_model = fs_hash_uri(model_uri);
+    }
+
+    return data;
 }
 
-int fs_import_stream_data(fsp_link *link, unsigned char *data, size_t count)
+int fs_import_stream_data(fsp_link *link, fs_import_stream *data, unsigned char *buf, size_t count)
 {
-    return raptor_parse_chunk(parse_data.parser, data, count, 0);
+    if (!data->parser) {
+        return 1;
+    }
+
+    return raptor_parse_chunk(data->parser, buf, count, 0);
 }
 
-int fs_import_stream_finish(fsp_link *link, int *count, int *errors)
+int fs_import_stream_finish(fsp_link *link, fs_import_stream *data, int *count, int *errors)
 {
-    raptor_parse_chunk(parse_data.parser, NULL, 0, 1); /* finish */
-    raptor_free_parser(parse_data.parser);
-    raptor_free_uri(parse_data.muri);
-    g_free(parse_data.model);
+    int ret = 0;
+
+    if (data->parser) {
+        raptor_parse_chunk(data->parser, NULL, 0, 1); /* finish */
+        raptor_free_parser(data->parser);
+    }
+    raptor_free_uri(data->muri);
+    g_free(data->model);
+    g_hash_table_destroy(data->bnids);
 
     const int segments = fsp_link_segments(link);
 
-    *count += process_quads(&parse_data);
+    if (data->replace) {
+        *count += process_quads_replace(data);
+    } else {
+        *count += process_quads(data);
+    }
 
-    close(parse_data.quad_fd);
-    unlink(parse_data.quad_fn);
-    free(parse_data.quad_fn);
-    parse_data.quad_fd = 0xdeadbeef;
-    parse_data.quad_fn = NULL;
+    close(data->quad_fd);
+    unlink(data->quad_fn);
+    g_free(data->quad_fn);
+    *errors = data->count_err;
+    free(data);
 
-    /* make sure buffers are flushed */
-    for (int seg = 0; seg < segments; seg++) {
+    /* make sure buffers are flushed, this includes resources from any
+     * other open streams, which is harmless */
+    for (int seg = 0; seg < segments && !ret; seg++) {
         if (res_pos[seg] > 0 && fsp_res_import(link, seg, res_pos[seg], res_buffer[seg])) {
 	    fs_error(LOG_ERR, "resource import failed");
-            return 1;
+            ret = 1;
         }
     }
-    if (fsp_res_import_commit_all(link)) {
+    if (!ret && fsp_res_import_commit_all(link)) {
         fs_error(LOG_ERR, "resource commit failed");
-        return 2;
+        ret = 2;
     }
     for (int seg = 0; seg < segments; seg++) {
         for (int i=0; i<res_pos[seg]; i++) {
@@ -267,21 +317,21 @@ int fs_import_stream_finish(fsp_link *link, int *count, int *errors)
         }
         res_pos[seg] = 0;
     }
-    if (fsp_quad_import_commit_all(link, FS_BIND_BY_SUBJECT)) {
+    if (!ret && fsp_quad_import_commit_all(link, FS_BIND_BY_SUBJECT)) {
         fs_error(LOG_ERR, "quad commit failed");
-        return 3;
+        ret = 3;
     }
 
-    for (int i=0; i<segments; i++) {
-        for (int j=0; j<RES_BUF_SIZE; j++) {
-            free(lex_tmp[i][j]);
-            lex_tmp[i][j] = NULL;
+    if (--open_streams == 0) {
+        for (int i=0; i<segments; i++) {
+            for (int j=0; j<RES_BUF_SIZE; j++) {
+                free(lex_tmp[i][j]);
+                lex_tmp[i][j] = NULL;
+            }
         }
     }
 
-    *errors = parse_data.count_err;
-
-    return 0;
+    return ret;
 }
 
 
@@ -325,6 +375,7 @@ int fs_import(fsp_link *link, const char *model_uri, char *resource_uri,
     parse_data.last_count = 0;
     parse_data.dryrun = dryrun;
     parse_data.has_o_index = has_o_index;
+    parse_data.replace = 0;
 
     /* store the model uri */
     buffer_res(link, segments, parse_data.model_hash, parse_data.model, FS_RID_NULL, dryrun);
@@ -480,13 +531,324 @@ static int process_quads(fs_parse_stuff *data)
     return total;
 }
 
+/* (s, p, o) ordering for process_quads_replace() */
+static int triple_cmp(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    for (int i=0; i<3; i++) {
+        if (a[i] < b[i]) return -1;
+        if (a[i] > b[i]) return 1;
+    }
+
+    return 0;
+}
+
+static int triples_uniq(fs_rid (*t)[3], int count)
+{
+    int out = 0;
+
+    for (int i=0; i<count; i++) {
+        if (out > 0 && !triple_cmp(t[out-1], t[i])) continue;
+        if (out != i) memcpy(t[out], t[i], sizeof(t[0]));
+        out++;
+    }
+
+    return out;
+}
+
+/* the most triples from either side of a replace that are held in memory at
+ * once. Bigger models are diffed in several passes, each over the triples
+ * whose subjects fall in one chunk */
+#define REPLACE_CHUNK (1 << 20)
+#define REPLACE_PAGE  10000
+#define REPLACE_BIND  (FS_BIND_SUBJECT | FS_BIND_PREDICATE | FS_BIND_OBJECT | FS_BIND_BY_SUBJECT)
+
+/* chunks are picked by hash bits above the ones used for the segment */
+#define REPLACE_CHUNK_OF(s, chunks) (int) (((s) >> 24) % (chunks))
+
+struct triples {
+    fs_rid (*t)[3];
+    int count;
+    int size;
+};
+
+static void triples_add(struct triples *tr, const fs_rid t[3])
+{
+    if (tr->count == tr->size) {
+        tr->size = tr->size ? tr->size * 2 : 1024;
+        tr->t = realloc(tr->t, tr->size * sizeof(tr->t[0]));
+    }
+    memcpy(tr->t[tr->count++], t, sizeof(tr->t[0]));
+}
+
+struct replace {
+    fs_parse_stuff *data;
+    fs_rid model;
+    fs_rid (*ins)[4];
+    int icount;
+    fs_rid_vector *del[4];
+    int added;
+    int removed;
+};
+
+static int replace_flush_inserts(struct replace *r)
+{
+    fs_parse_stuff *data = r->data;
+
+    for (fs_segment seg = 0; seg < data->segments; seg++) {
+        int scnt = 0;
+        for (int i=0; i<r->icount; i++) {
+            if (FS_RID_SEGMENT(r->ins[i][1], data->segments) == seg) {
+                memcpy(quad_buf_s[scnt++], r->ins[i], sizeof(quad_buf_s[0]));
+            }
+        }
+        if (scnt > 0 && !(data->dryrun & FS_DRYRUN_QUADS) &&
+            fsp_quad_import(data->link, seg, FS_BIND_BY_SUBJECT, scnt, quad_buf_s)) {
+            fs_error(LOG_ERR, "quad import failed");
+
+            return 1;
+        }
+    }
+    r->icount = 0;
+
+    return 0;
+}
+
+static int replace_insert(struct replace *r, const fs_rid quad[4])
+{
+    memcpy(r->ins[r->icount++], quad, sizeof(r->ins[0]));
+    if (r->icount == QUAD_BUF_SIZE) {
+        return replace_flush_inserts(r);
+    }
+
+    return 0;
+}
+
+static int replace_flush_deletes(struct replace *r)
+{
+    int ret = 0;
+
+    if (fs_rid_vector_length(r->del[0]) > 0 && !(r->data->dryrun & FS_DRYRUN_DELETE) &&
+        fsp_delete_quads_all(r->data->link, r->del)) {
+        fs_error(LOG_ERR, "quad delete failed");
+        ret = 1;
+    }
+    for (int s=0; s<4; s++) {
+        fs_rid_vector_truncate(r->del[s], 0);
+    }
+
+    return ret;
+}
+
+static int replace_delete(struct replace *r, const fs_rid t[3])
+{
+    fs_rid_vector_append(r->del[0], r->model);
+    for (int s=0; s<3; s++) {
+        fs_rid_vector_append(r->del[s+1], t[s]);
+    }
+    if (fs_rid_vector_length(r->del[0]) > 999) {
+        return replace_flush_deletes(r);
+    }
+
+    return 0;
+}
+
+/* read the parsed quads back from the buffer file. Triples in the replaced
+ * model that fall in chunk are added to out. If out is NULL the quads are
+ * counted instead, and those in other graphs are imported as they are */
+static int replace_scan_new(struct replace *r, int chunk, int chunks,
+                            struct triples *out, long *count)
+{
+    const int tfd = r->data->quad_fd;
+
+    if (lseek(tfd, 0, SEEK_SET) == -1) {
+        fs_error(LOG_ERR, "error seeking in triple buffer file (fd %d): %s", tfd, strerror(errno));
+
+        return 1;
+    }
+    ssize_t got;
+    do {
+        got = read(tfd, quad_buf, sizeof(quad_buf));
+        if (got < 0) {
+            fs_error(LOG_ERR, "error reading triple buffer file (fd %d): %s", tfd, strerror(errno));
+
+            return 1;
+        }
+        const int n = got / (sizeof(fs_rid) * 4);
+        for (int i=0; i<n; i++) {
+            if (!out) {
+                (*count)++;
+                if (quad_buf[i][0] != r->model && replace_insert(r, quad_buf[i])) {
+                    return 1;
+                }
+            } else if (quad_buf[i][0] == r->model &&
+                       REPLACE_CHUNK_OF(quad_buf[i][1], chunks) == chunk) {
+                triples_add(out, quad_buf[i] + 1);
+            }
+        }
+    } while (got == sizeof(quad_buf));
+
+    return 0;
+}
+
+/* as replace_scan_new(), for the triples the backends hold for the model */
+static int replace_scan_old(struct replace *r, int chunk, int chunks,
+                            struct triples *out, long *count)
+{
+    fs_rid_vector none = { .length = 0, .size = 0, .data = 0 };
+    fs_rid_vector one = { .length = 1, .size = 1, .data = &r->model };
+    fs_rid_vector **res = NULL;
+
+    int ret = fsp_bind_first_all(r->data->link, REPLACE_BIND, &one, &none,
+                                 &none, &none, &res, REPLACE_PAGE);
+    while (ret == 0 && res) {
+        const int length = res[0] ? res[0]->length : 0;
+        for (int i=0; i<length; i++) {
+            if (!out) {
+                (*count)++;
+            } else if (REPLACE_CHUNK_OF(res[0]->data[i], chunks) == chunk) {
+                fs_rid t[3] = { res[0]->data[i], res[1]->data[i], res[2]->data[i] };
+                triples_add(out, t);
+            }
+        }
+        for (int c=0; c<3; c++) {
+            fs_rid_vector_free(res[c]);
+        }
+        free(res);
+        res = NULL;
+        if (length == 0) break;
+        ret = fsp_bind_next_all(r->data->link, REPLACE_BIND, &res, REPLACE_PAGE);
+    }
+    fsp_bind_done_all(r->data->link);
+    if (ret) {
+        fs_error(LOG_ERR, "bind of model %016llx failed", r->model);
+    }
+
+    return ret;
+}
+
+/* merge one chunk of sorted triples, new only => insert, old only => delete */
+static int replace_merge(struct replace *r, struct triples *nt, struct triples *ot)
+{
+    qsort(nt->t, nt->count, sizeof(nt->t[0]), triple_cmp);
+    nt->count = triples_uniq(nt->t, nt->count);
+    qsort(ot->t, ot->count, sizeof(ot->t[0]), triple_cmp);
+    ot->count = triples_uniq(ot->t, ot->count);
+
+    int n = 0, o = 0;
+    while (n < nt->count || o < ot->count) {
+        int cmp;
+        if (n == nt->count) cmp = 1;
+        else if (o == ot->count) cmp = -1;
+        else cmp = triple_cmp(nt->t[n], ot->t[o]);
+
+        if (cmp == 0) {
+            n++;
+            o++;
+        } else if (cmp < 0) {
+            fs_rid quad[4] = { r->model, nt->t[n][0], nt->t[n][1], nt->t[n][2] };
+            if (replace_insert(r, quad)) return 1;
+            n++;
+            r->added++;
+        } else {
+            if (replace_delete(r, ot->t[o])) return 1;
+            o++;
+            r->removed++;
+        }
+    }
+
+    return 0;
+}
+
+/* used instead of process_quads() when replacing a model: the parsed triples
+ * for the model are sorted and merged against the ones already stored, and
+ * only the differences are sent to the backends. At most REPLACE_CHUNK
+ * triples from each side are held at once. A model with nothing stored
+ * skips the diff. Quads in other graphs (eg. from TriG) are imported as
+ * normal. Triples with bNodes never match, as bNodes get fresh RIDs on
+ * each import */
+static int process_quads_replace(fs_parse_stuff *data)
+{
+    const fs_rid model = data->replace_model;
+    int tfd = data->quad_fd;
+    int ret = 0;
+
+    if (data->count_err) {
+        fs_error(LOG_ERR, "parser errors, leaving model %016llx unchanged", model);
+        ftruncate(tfd, 0);
+        lseek(tfd, 0, SEEK_SET);
+
+        return 0;
+    }
+
+    struct replace r = { .data = data, .model = model };
+    long ncount = 0, ocount = 0;
+
+    if (replace_scan_old(&r, 0, 1, NULL, &ocount)) {
+        return -1;
+    }
+    if (ocount == 0) {
+        fs_rid_vector *mvec = fs_rid_vector_new(0);
+        fs_rid_vector_append(mvec, model);
+        ret = fsp_new_model_all(data->link, mvec);
+        fs_rid_vector_free(mvec);
+        if (ret) {
+            fs_error(LOG_ERR, "fsp_new_model_all failed");
+
+            return -1;
+        }
+        fs_error(LOG_INFO, "model %016llx is new, importing without a diff", model);
+
+        return process_quads(data);
+    }
+
+    r.ins = malloc(QUAD_BUF_SIZE * sizeof(r.ins[0]));
+    for (int s=0; s<4; s++) {
+        r.del[s] = fs_rid_vector_new(0);
+    }
+
+    /* counting the new triples imports the ones in other graphs */
+    ret = replace_scan_new(&r, 0, 1, NULL, &ncount);
+    const long most = ncount > ocount ? ncount : ocount;
+    const int chunks = most / REPLACE_CHUNK + 1;
+
+    struct triples nt = { NULL, 0, 0 }, ot = { NULL, 0, 0 };
+    for (int chunk = 0; chunk < chunks && ret == 0; chunk++) {
+        nt.count = 0;
+        ot.count = 0;
+        ret = replace_scan_new(&r, chunk, chunks, &nt, NULL);
+        if (ret == 0) ret = replace_scan_old(&r, chunk, chunks, &ot, NULL);
+        if (ret == 0) ret = replace_merge(&r, &nt, &ot);
+    }
+    if (ret == 0) ret = replace_flush_inserts(&r);
+    if (ret == 0) ret = replace_flush_deletes(&r);
+
+    free(nt.t);
+    free(ot.t);
+    free(r.ins);
+    for (int s=0; s<4; s++) {
+        fs_rid_vector_free(r.del[s]);
+    }
+    ftruncate(tfd, 0);
+    lseek(tfd, 0, SEEK_SET);
+
+    if (ret) {
+        return -1;
+    }
+    fs_error(LOG_INFO, "replaced model %016llx in %d passes, %d quads added, "
+             "%d removed", model, chunks, r.added, r.removed);
+
+    return ncount;
+}
+
 /* inside this code block bNode RIDs are unswizzled */
 
 static fs_rid bnodenext = 1, bnodemax = 0;
 
-static fs_rid fs_bnode_id(fsp_link *link, const char *bnode)
+static fs_rid fs_bnode_id(fsp_link *link, GHashTable *bnids, const char *bnode)
 {
-    GHashTable *bnids = fs_hash_bnids();
     fs_rid bn = (fs_rid) (unsigned long) g_hash_table_lookup(bnids, bnode);
     if (!bn) {
         if (bnodenext > bnodemax) {
@@ -536,7 +898,7 @@ static void store_stmt(void *user_data, const raptor_statement * statement)
     m = data->model_hash;
 
     if (statement->subject_type == RAPTOR_IDENTIFIER_TYPE_ANONYMOUS) {
-        s = fs_bnode_id(data->link, statement->subject);
+        s = fs_bnode_id(data->link, data->bnids ? data->bnids : fs_hash_bnids(), statement->subject);
         subj = (char *) statement->subject;
     } else {
 	s = fs_hash_uri(subj);
@@ -572,7 +934,7 @@ static void store_stmt(void *user_data, const raptor_statement * statement)
 	}
 	o = fs_hash_literal(obj, attr);
     } else if (statement->object_type == RAPTOR_IDENTIFIER_TYPE_ANONYMOUS) {
-	o = fs_bnode_id(data->link, statement->object);
+	o = fs_bnode_id(data->link, data->bnids ? data->bnids : fs_hash_bnids(), statement->object);
 	obj = (char *) statement->object;
     } else {
 	obj = (char *) raptor_uri_as_string((raptor_uri *) statement->
@@ -599,6 +961,10 @@ retry_write:
     }
 
     data->count_trip++;
+    if (data->stream) {
+        /* streams are only sent to the backends when they finish */
+        return;
+    }
     total_triples_parsed++;
     if (data->verbosity && total_triples_parsed % 10000 == 0) {
 	printf("Pass 1, processed %d triples\r", total_triples_parsed);
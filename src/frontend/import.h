@@ -13,8 +13,12 @@ int fs_import(fsp_link *link, const char *model_uri, char *resource_uri,
 
 int fs_import_commit(fsp_link *link, int verbosity, int dryrun, int has_o_index, FILE *msg, int *count);
 
-int fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count);
-int fs_import_stream_data(fsp_link *link, unsigned char *data, size_t count);
-int fs_import_stream_finish(fsp_link *link, int *count, int *errors);
+typedef struct _fs_parse_stuff fs_import_stream;
+
+/* returns NULL on failure. The stream is freed by ..._finish */
+fs_import_stream *fs_import_stream_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count);
+fs_import_stream *fs_import_stream_replace_start(fsp_link *link, const char *model_uri, const char *mimetype, int has_o_index, int *count);
+int fs_import_stream_data(fsp_link *link, fs_import_stream *stream, unsigned char *data, size_t count);
+int fs_import_stream_finish(fsp_link *link, fs_import_stream *stream, int *count, int *errors);
 
 #endif
@@ -191,12 +191,10 @@ static char *var_name(rasqal_literal *l)
     return NULL;
 }
 
-int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start)
+/* the original heuristic ordering, used for large patterns, and at low
+ * optimisation levels */
+static void order_greedy(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start)
 {
-    if (length - start < 2 || q->opt_level < 1) {
-	return 1;
-    }
-
     rasqal_triple **pbuf = malloc(length * sizeof(rasqal_triple *));
     memcpy(pbuf, patt, sizeof(rasqal_triple *) * length);
     memset(patt, 0, length * sizeof(rasqal_triple *));
@@ -290,6 +288,200 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
     if (append_pos != length) {
 	fs_error(LOG_CRIT, "Optimser mismatch error");
     }
+}
+
+/* exhaustive ordering is used for patterns of up to this many triples */
+#define FS_OPT_DP_MAX 12
+
+/* cost model weights, in units of one rid shipped over the wire */
+#define FS_OPT_COST_TRIP 1000.0
+#define FS_OPT_COST_JOIN 1.0
+
+/* guesses at the rows per input value for binds driven by values that are
+ * only known once earlier patterns have run, after the defaults in
+ * calc_freq(). Binds by object go to every segment, so are a bit pricier */
+#define FS_OPT_FAN_SP 2.0
+#define FS_OPT_FAN_S 20.0
+#define FS_OPT_FAN_OP 20.0
+#define FS_OPT_FAN_O 100.0
+#define FS_OPT_SCAN_P 1e6
+#define FS_OPT_SCAN 1e8
+#define FS_OPT_MAX_ROWS 1e15
+
+struct opt_patt {
+    rasqal_triple *t;
+    int var[4];         /* index of each slot's unbound variable, or -1 */
+    double now[4];      /* number of values for slots known now, else 0 */
+    guint64 vars;       /* mask of the unbound variables */
+    int joined;         /* shares a variable with the current bindings */
+    double freq;        /* fs_bind_freq() against the current bindings */
+};
+
+/* estimate the rows that come back from binding p once the variables in
+ * bound are known, and the size of the binding table after joining them to
+ * the existing rows. Returns the cost of doing so */
+static double opt_step(struct opt_patt *p, guint64 bound, double rows, double *rows_out)
+{
+    int known[4];
+    int later = 0;
+    for (int s=0; s<4; s++) {
+        known[s] = p->now[s] > 0.0 || (p->var[s] != -1 && bound & (1ULL << p->var[s]));
+        if (p->now[s] == 0.0 && known[s]) later = 1;
+    }
+    const int connected = p->joined || (p->vars & bound);
+
+    /* the bind is driven by the subject if it can be, as in
+     * fs_handle_query_triple() */
+    int drive = -1;
+    if (known[1] && (!known[3] || p->now[1] == 0.0 || p->now[1] <= p->now[3])) {
+        drive = 1;
+    } else if (known[3]) {
+        drive = 3;
+    }
+
+    double fan, bind_rows, drive_vals;
+    if (drive == -1) {
+        fan = known[2] ? FS_OPT_SCAN_P : FS_OPT_SCAN;
+        drive_vals = 0.0;
+        bind_rows = fan;
+        *rows_out = connected ? (rows > bind_rows ? rows : bind_rows) : rows * bind_rows;
+    } else {
+        drive_vals = p->now[drive] > 0.0 ? p->now[drive] : rows;
+        if (known[1] && known[3]) {
+            fan = 1.0;
+        } else if (!later) {
+            fan = p->freq / drive_vals;
+            if (fan < 1.0) fan = 1.0;
+        } else if (drive == 1) {
+            fan = known[2] ? FS_OPT_FAN_SP : FS_OPT_FAN_S;
+        } else {
+            fan = known[2] ? FS_OPT_FAN_OP : FS_OPT_FAN_O;
+        }
+        bind_rows = drive_vals * fan;
+        *rows_out = connected ? rows * fan : rows * bind_rows;
+    }
+    if (*rows_out > FS_OPT_MAX_ROWS) *rows_out = FS_OPT_MAX_ROWS;
+    if (bind_rows > FS_OPT_MAX_ROWS) bind_rows = FS_OPT_MAX_ROWS;
+
+    int cols = 0;
+    for (int s=0; s<4; s++) {
+        if (p->var[s] != -1) cols++;
+    }
+
+    return FS_OPT_COST_TRIP + drive_vals + bind_rows * (cols ? cols : 1) +
+           FS_OPT_COST_JOIN * (rows + *rows_out);
+}
+
+/* find the cheapest order for patt[start..length) by dynamic programming
+ * over the subsets of patterns already bound. Returns non-zero if the
+ * pattern is not suitable */
+static int order_dp(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start)
+{
+    const int n = length - start;
+    fs_binding *b = q->bb[block];
+    char *names[64];
+    int nnames = 0;
+    struct opt_patt p[FS_OPT_DP_MAX];
+
+    if (n > FS_OPT_DP_MAX) return 1;
+
+    for (int i=0; i<n; i++) {
+        rasqal_triple *t = patt[start+i];
+        if (!t) return 1;
+        rasqal_literal *l[4] = { t->origin, t->subject, t->predicate, t->object };
+        p[i].t = t;
+        p[i].vars = 0;
+        p[i].joined = 0;
+        for (int s=0; s<4; s++) {
+            p[i].var[s] = -1;
+            p[i].now[s] = 0.0;
+            if (!l[s]) continue;
+            if (fs_opt_is_const(b, l[s])) {
+                p[i].now[s] = fs_opt_num_vals(b, l[s]);
+                if (p[i].now[s] < 1.0) p[i].now[s] = 1.0;
+                if (var_name(l[s])) p[i].joined = 1;
+                continue;
+            }
+            char *name = var_name(l[s]);
+            if (!name) continue;
+            int v;
+            for (v=0; v<nnames && strcmp(names[v], name); v++);
+            if (v == nnames) {
+                if (nnames == 64) return 1;
+                names[nnames++] = name;
+            }
+            p[i].var[s] = v;
+            p[i].vars |= 1ULL << v;
+        }
+        p[i].freq = fs_bind_freq(qs, q, block, t);
+    }
+
+    const int subsets = 1 << n;
+    double *cost = malloc(subsets * sizeof(double));
+    double *rows = malloc(subsets * sizeof(double));
+    guint64 *bound = malloc(subsets * sizeof(guint64));
+    signed char *last = malloc(subsets);
+    int initial = fs_binding_length(b);
+
+    cost[0] = 0.0;
+    rows[0] = initial > 0 ? initial : 1;
+    bound[0] = 0;
+    for (int set=1; set<subsets; set++) {
+        cost[set] = -1.0;
+    }
+    /* every subset is reached from smaller ones, so ascending order works */
+    for (int set=0; set<subsets; set++) {
+        if (cost[set] < 0.0) continue;
+        for (int i=0; i<n; i++) {
+            if (set & (1 << i)) continue;
+            double rows_out;
+            double c = cost[set] + opt_step(&p[i], bound[set], rows[set], &rows_out);
+            const int next = set | (1 << i);
+            if (cost[next] < 0.0 || c < cost[next]) {
+                cost[next] = c;
+                rows[next] = rows_out;
+                bound[next] = bound[set] | p[i].vars;
+                last[next] = i;
+            }
+        }
+    }
+
+    for (int set=subsets-1, pos=length-1; set; pos--) {
+        const int i = last[set];
+        patt[pos] = p[i].t;
+        set &= ~(1 << i);
+    }
+
+#ifdef DEBUG_OPTIMISER
+    printf("optimiser estimates cost %g, %g rows\n", cost[subsets-1], rows[subsets-1]);
+#endif
+
+    free(cost);
+    free(rows);
+    free(bound);
+    free(last);
+
+    return 0;
+}
+
+int fs_optimise_order_fixed(fs_query *q, int length, int start)
+{
+    return length - start < 2 || q->opt_level < 1;
+}
+
+int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start)
+{
+    if (fs_optimise_order_fixed(q, length, start)) {
+	return 1;
+    }
+
+    /* search for the cheapest order when there are few enough patterns,
+     * otherwise sort them greedily */
+    const int dp = q->opt_level >= 3 && length - start > 2 &&
+                   !order_dp(qs, q, block, patt, length, start);
+    if (!dp) {
+        order_greedy(qs, q, block, patt, length, start);
+    }
 
 #ifdef DEBUG_OPTIMISER
     printf("optimiser choices look like:\n");
@@ -324,7 +516,7 @@ int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqa
         if (count > 1) return count;
     }
 
-    if (length - start > 1) {
+    if (!dp && length - start > 1) {
         int freq_a = fs_bind_freq(qs, q, block, patt[start]);
         int freq_b = fs_bind_freq(qs, q, block, patt[start+1]);
         /* the 2nd is cheaper than the 1st, then swap them */
@@ -11,10 +11,14 @@ int fs_opt_num_vals(fs_binding *b, rasqal_literal *l);
 /* returns true if the expression can be hashed */
 int fs_opt_is_const(fs_binding *b, rasqal_literal *l);
 
-/* sort a vector of triples into a good order to bind them, based on some
- * heuristics */
+/* sort a vector of triples into a good order to bind them, by estimated cost
+ * for small patterns, or based on some heuristics */
 int fs_optimise_triple_pattern(fs_query_state *qs, fs_query *q, int block, rasqal_triple *patt[], int length, int start);
 
+/* returns true if fs_optimise_triple_pattern() will leave the patterns from
+ * start onwards in the order they are in */
+int fs_optimise_order_fixed(fs_query *q, int length, int start);
+
 /* return an estimated number of results from a bind */
 int fs_bind_freq(fs_query_state *qs, fs_query *q, int block, rasqal_triple *t);
 
@@ -0,0 +1,198 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "outbuf.h"
+#include "common/error.h"
+
+/* buffers with a file are written out before they grow past this */
+#define FLUSH_SIZE 65536
+
+/* bytes that need escaping, for each fs_escape_type */
+static const unsigned char needs_escape[FS_ESCAPE_TYPES][256] = {
+    [FS_ESCAPE_XML] = { ['<'] = 1, ['>'] = 1, ['&'] = 1 },
+    [FS_ESCAPE_JSON] = { [0 ... 0x1f] = 1, ['"'] = 1, ['\\'] = 1 },
+    [FS_ESCAPE_TSV] = { ['\t'] = 1, ['\r'] = 1, ['\n'] = 1, ['"'] = 1,
+                        ['\\'] = 1 },
+    [FS_ESCAPE_URI] = { [' '] = 1, ['\t'] = 1, ['\r'] = 1, ['\n'] = 1,
+                        ['<'] = 1, ['>'] = 1 },
+    [FS_ESCAPE_NT_STRING] = { [0 ... 0x1f] = 1, ['"'] = 1, ['\\'] = 1 },
+    [FS_ESCAPE_NT_URI] = { [0 ... 0x20] = 1, ['<'] = 1, ['>'] = 1, ['"'] = 1,
+                           ['{'] = 1, ['}'] = 1, ['|'] = 1, ['^'] = 1,
+                           ['`'] = 1, ['\\'] = 1 },
+};
+
+/* word at a time tests, eight bytes per step. has_less() can give false
+ * positives for bytes over 0x80, which only means the bytes get checked one
+ * at a time */
+#define ONES  0x0101010101010101ULL
+#define HIGHS 0x8080808080808080ULL
+
+static inline uint64_t has_byte(uint64_t v, unsigned char c)
+{
+    const uint64_t x = v ^ (ONES * c);
+
+    return (x - ONES) & ~x & HIGHS;
+}
+
+static inline uint64_t has_less(uint64_t v, unsigned char n)
+{
+    return (v - ONES * n) & ~v & HIGHS;
+}
+
+static inline int word_special(uint64_t v, fs_escape_type type)
+{
+    switch (type) {
+    case FS_ESCAPE_XML:
+        return (has_byte(v, '<') | has_byte(v, '>') | has_byte(v, '&')) != 0;
+    case FS_ESCAPE_JSON:
+    case FS_ESCAPE_NT_STRING:
+        return (has_less(v, 0x20) | has_byte(v, '"') | has_byte(v, '\\')) != 0;
+    case FS_ESCAPE_TSV:
+        return (has_byte(v, '\t') | has_byte(v, '\r') | has_byte(v, '\n') |
+                has_byte(v, '"') | has_byte(v, '\\')) != 0;
+    case FS_ESCAPE_URI:
+        return (has_byte(v, ' ') | has_byte(v, '\t') | has_byte(v, '\r') |
+                has_byte(v, '\n') | has_byte(v, '<') | has_byte(v, '>')) != 0;
+    default:
+        return 1;
+    }
+}
+
+/* number of bytes at the start of str that can be copied as they are */
+static size_t plain_length(const unsigned char *str, size_t len, fs_escape_type type)
+{
+    const unsigned char *table = needs_escape[type];
+    size_t i = 0;
+
+    if (type != FS_ESCAPE_NT_URI) {
+        while (i + 8 <= len) {
+            uint64_t v;
+            memcpy(&v, str + i, 8);
+            if (word_special(v, type)) break;
+            i += 8;
+        }
+    }
+    while (i < len && !table[str[i]]) i++;
+
+    return i;
+}
+
+static void escape_byte(fs_outbuf *b, unsigned char c, fs_escape_type type)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    switch (type) {
+    case FS_ESCAPE_XML:
+        if (c == '<') {
+            fs_outbuf_add(b, "&lt;", 4);
+        } else if (c == '>') {
+            fs_outbuf_add(b, "&gt;", 4);
+        } else {
+            fs_outbuf_add(b, "&amp;", 5);
+        }
+        return;
+
+    case FS_ESCAPE_URI: {
+        char esc[3] = { '%', hex[c >> 4], hex[c & 15] };
+        fs_outbuf_add(b, esc, 3);
+        return;
+    }
+
+    case FS_ESCAPE_JSON:
+    case FS_ESCAPE_TSV:
+    case FS_ESCAPE_NT_STRING:
+        switch (c) {
+        case '\t': fs_outbuf_add(b, "\\t", 2); return;
+        case '\r': fs_outbuf_add(b, "\\r", 2); return;
+        case '\n': fs_outbuf_add(b, "\\n", 2); return;
+        case '"': fs_outbuf_add(b, "\\\"", 2); return;
+        case '\\': fs_outbuf_add(b, "\\\\", 2); return;
+        }
+        break;
+
+    case FS_ESCAPE_NT_URI:
+    case FS_ESCAPE_TYPES:
+        break;
+    }
+
+    char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 15] };
+    fs_outbuf_add(b, esc, 6);
+}
+
+void fs_outbuf_init(fs_outbuf *b, FILE *out)
+{
+    b->out = out;
+    b->data = NULL;
+    b->length = 0;
+    b->size = 0;
+}
+
+void fs_outbuf_flush(fs_outbuf *b)
+{
+    if (!b->out || b->length == 0) return;
+
+    if (fwrite(b->data, 1, b->length, b->out) != b->length) {
+        fs_error(LOG_ERR, "failed to write results");
+    }
+    b->length = 0;
+}
+
+void fs_outbuf_fini(fs_outbuf *b)
+{
+    fs_outbuf_flush(b);
+    free(b->data);
+    b->data = NULL;
+    b->size = 0;
+}
+
+void fs_outbuf_reserve(fs_outbuf *b, size_t len)
+{
+    if (b->length + len <= b->size) return;
+
+    if (b->out && b->length + len > FLUSH_SIZE) {
+        fs_outbuf_flush(b);
+        if (len <= b->size) return;
+    }
+    size_t size = b->size ? b->size : (b->out ? FLUSH_SIZE : 256);
+    while (b->length + len > size) size *= 2;
+    b->data = realloc(b->data, size);
+    b->size = size;
+}
+
+void fs_outbuf_escape(fs_outbuf *b, const char *str, fs_escape_type type)
+{
+    if (!str) return;
+
+    const unsigned char *s = (const unsigned char *)str;
+    size_t len = strlen(str);
+
+    while (len) {
+        size_t plain = plain_length(s, len, type);
+        fs_outbuf_add(b, (const char *)s, plain);
+        if (plain == len) break;
+        escape_byte(b, s[plain], type);
+        s += plain + 1;
+        len -= plain + 1;
+    }
+}
+
+/* vi:set expandtab sts=4 sw=4: */
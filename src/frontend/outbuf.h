@@ -0,0 +1,55 @@
+#ifndef OUTBUF_H
+#define OUTBUF_H
+
+#include <stdio.h>
+#include <string.h>
+
+/* An output buffer for the result serialisers. Values are escaped straight
+ * into the buffer, and it's written to the file in large blocks. A buffer
+ * with no file just grows. */
+
+typedef struct {
+    FILE *out;
+    char *data;
+    size_t length;
+    size_t size;
+} fs_outbuf;
+
+typedef enum {
+    FS_ESCAPE_XML,          /* element content */
+    FS_ESCAPE_JSON,         /* string contents */
+    FS_ESCAPE_TSV,          /* quoted literals in text output */
+    FS_ESCAPE_URI,          /* URIs in text output, %XX */
+    FS_ESCAPE_NT_STRING,    /* N-Triples and Turtle string contents */
+    FS_ESCAPE_NT_URI,       /* N-Triples and Turtle IRIs, \uXXXX */
+    FS_ESCAPE_TYPES
+} fs_escape_type;
+
+void fs_outbuf_init(fs_outbuf *b, FILE *out);
+/* writes the buffer out and frees it */
+void fs_outbuf_fini(fs_outbuf *b);
+void fs_outbuf_flush(fs_outbuf *b);
+void fs_outbuf_reserve(fs_outbuf *b, size_t len);
+
+/* append str, escaped according to type */
+void fs_outbuf_escape(fs_outbuf *b, const char *str, fs_escape_type type);
+
+static inline void fs_outbuf_add(fs_outbuf *b, const char *str, size_t len)
+{
+    fs_outbuf_reserve(b, len);
+    memcpy(b->data + b->length, str, len);
+    b->length += len;
+}
+
+static inline void fs_outbuf_putc(fs_outbuf *b, char c)
+{
+    fs_outbuf_reserve(b, 1);
+    b->data[b->length++] = c;
+}
+
+static inline void fs_outbuf_puts(fs_outbuf *b, const char *str)
+{
+    fs_outbuf_add(b, str, strlen(str));
+}
+
+#endif
@@ -47,6 +47,45 @@ struct _fs_bind_cache {
     fs_rid_vector *res[4];
 };
 
+/* a cachable bind that's on its way to the backends. Threads wanting the
+ * same bind wait for its result rather than sending their own */
+struct _fs_bind_flight {
+    int all;
+    int flags;
+    int offset;
+    int limit;
+    fs_rid key[4];
+    int done;
+    int waiters;    /* threads still to copy res */
+    int slots;
+    int limited;
+    fs_rid_vector **res;
+    struct _fs_bind_flight *next;
+};
+
+static void flight_free(struct _fs_bind_flight *f)
+{
+    if (f->res) {
+        for (int s=0; s<f->slots; s++) {
+            fs_rid_vector_free(f->res[s]);
+        }
+        free(f->res);
+    }
+    free(f);
+}
+
+static fs_rid_vector **copy_result(fs_rid_vector **res, int slots)
+{
+    if (!res) return NULL;
+
+    fs_rid_vector **copy = calloc(slots ? slots : 1, sizeof(fs_rid_vector *));
+    for (int s=0; s<slots; s++) {
+        copy[s] = fs_rid_vector_copy(res[s]);
+    }
+
+    return copy;
+}
+
 /* calls bind as appropriate, plus checks in cache to see if results already
  * present */
 
@@ -81,6 +120,7 @@ int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
     int cachable = 0;
     fs_rid cache_hash = 0;
     fs_rid cache_key[4];
+    struct _fs_bind_flight *flight = NULL;
 
     /* only consult the cache for optimasation levels 0-2 */
     if (q->opt_level < 3) goto skip_cache;
@@ -125,19 +165,55 @@ int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
             return 0;
         }
     }
+
+    /* join an identical bind that's already in flight, or register this one
+     * so others can join it */
+    if (cachable && g_thread_supported()) {
+        if (!qs->flight_cond) qs->flight_cond = g_cond_new();
+        for (flight = qs->bind_flights; flight; flight = flight->next) {
+            if (flight->all == all && flight->flags == flags &&
+                flight->offset == offset && flight->limit == limit &&
+                !memcmp(flight->key, cache_key, sizeof(cache_key))) {
+                break;
+            }
+        }
+        if (flight) {
+            flight->waiters++;
+            while (!flight->done) {
+                g_cond_wait(qs->flight_cond, g_static_mutex_get_mutex(&qs->cache_mutex));
+            }
+            *result = copy_result(flight->res, slots);
+            const int limited = flight->limited;
+            if (--flight->waiters == 0) flight_free(flight);
+            g_static_mutex_unlock(&qs->cache_mutex);
+            fsp_hit_limits_add(q->link, limited);
+
+            return 0;
+        }
+        flight = calloc(1, sizeof(struct _fs_bind_flight));
+        flight->all = all;
+        flight->flags = flags;
+        flight->offset = offset;
+        flight->limit = limit;
+        memcpy(flight->key, cache_key, sizeof(cache_key));
+        flight->slots = slots;
+        flight->next = qs->bind_flights;
+        qs->bind_flights = flight;
+    }
     g_static_mutex_unlock(&qs->cache_mutex);
 
     int ret;
 
     skip_cache:;
 
-    int limited_before = fsp_hit_limits(q->link);
+    /* other threads may be binding on the link too */
+    int limited_before = fsp_hit_limits_thread();
     if (all) {
         ret = fsp_bind_limit_all(q->link, flags, rids[0], rids[1], rids[2], rids[3], result, offset, limit);
     } else {
         ret = fsp_bind_limit_many(q->link, flags, rids[0], rids[1], rids[2], rids[3], result, offset, limit);
     }
-    int limited = fsp_hit_limits(q->link) - limited_before;
+    int limited = fsp_hit_limits_thread() - limited_before;
     if (ret) {
         fs_error(LOG_ERR, "bind failed in '%s', %d segments gave errors",
                  fsp_kb_name(q->link), ret);
@@ -166,6 +242,24 @@ int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
                 qs->bind_cache[cache_hash].res[s] = NULL;
             }
         }
+        if (flight) {
+            /* hand the result to anyone who joined, the last one out frees
+             * the flight */
+            for (struct _fs_bind_flight **f = &qs->bind_flights; *f; f = &(*f)->next) {
+                if (*f == flight) {
+                    *f = flight->next;
+                    break;
+                }
+            }
+            flight->res = copy_result(*result, slots);
+            flight->limited = limited;
+            flight->done = 1;
+            if (flight->waiters == 0) {
+                flight_free(flight);
+            } else {
+                g_cond_broadcast(qs->flight_cond);
+            }
+        }
         g_static_mutex_unlock(&qs->cache_mutex);
     }
 
@@ -203,4 +297,111 @@ int fs_query_cache_flush(fs_query_state *qs, int verbosity)
     return 0;
 }
 
+struct _fs_bind_prefetch {
+    GThread *thread;
+    fs_query_state *qs;
+    fs_query *q;
+    int all;
+    int flags;
+    int offset;
+    int limit;
+    fs_rid_vector *rids[4];
+    fs_rid_vector **result;
+    int limited;        /* limit hits the bind added to the link */
+};
+
+static gpointer prefetch_thread(gpointer data)
+{
+    fs_bind_prefetch *pf = data;
+
+    /* counted on this thread, so other binds on the link don't show up */
+    const int limited_before = fsp_hit_limits_thread();
+    fs_bind_cache_wrapper(pf->qs, pf->q, pf->all, pf->flags, pf->rids,
+                          &pf->result, pf->offset, pf->limit);
+    pf->limited = fsp_hit_limits_thread() - limited_before;
+
+    return NULL;
+}
+
+static void prefetch_free(fs_bind_prefetch *pf)
+{
+    for (int s=0; s<4; s++) {
+        fs_rid_vector_free(pf->rids[s]);
+    }
+    free(pf);
+}
+
+fs_bind_prefetch *fs_bind_prefetch_start(fs_query_state *qs, fs_query *q,
+                int all, int flags, fs_rid_vector *rids[4],
+                int offset, int limit)
+{
+    if (!g_thread_supported()) return NULL;
+
+    fs_bind_prefetch *pf = calloc(1, sizeof(fs_bind_prefetch));
+    pf->qs = qs;
+    pf->q = q;
+    pf->all = all;
+    pf->flags = flags;
+    pf->offset = offset;
+    pf->limit = limit;
+    for (int s=0; s<4; s++) {
+        pf->rids[s] = fs_rid_vector_copy(rids[s]);
+    }
+    pf->thread = g_thread_create(prefetch_thread, pf, TRUE, NULL);
+    if (!pf->thread) {
+        prefetch_free(pf);
+
+        return NULL;
+    }
+
+    return pf;
+}
+
+int fs_bind_prefetch_finish(fs_bind_prefetch *pf, int all, int flags,
+                fs_rid_vector *rids[4], fs_rid_vector ***result,
+                int offset, int limit)
+{
+    if (!pf) return 0;
+
+    /* the arguments are fixed when the prefetch starts, so a mismatch can be
+     * spotted without waiting for it */
+    int match = pf->all == all && pf->flags == flags &&
+                pf->offset == offset && pf->limit == limit;
+    for (int s=0; s<4 && match; s++) {
+        if (pf->rids[s]->length != rids[s]->length ||
+            memcmp(pf->rids[s]->data, rids[s]->data,
+                   rids[s]->length * sizeof(fs_rid))) {
+            match = 0;
+        }
+    }
+    if (!match) return 0;
+
+    g_thread_join(pf->thread);
+    *result = pf->result;
+    prefetch_free(pf);
+
+    return 1;
+}
+
+void fs_bind_prefetch_discard(fs_bind_prefetch *pf)
+{
+    if (!pf) return;
+
+    g_thread_join(pf->thread);
+    /* the results were never used, so neither were any limits it hit */
+    fsp_hit_limits_add(pf->q->link, -pf->limited);
+    if (pf->result) {
+        int slots = 0;
+        if (pf->flags & FS_BIND_MODEL) slots++;
+        if (pf->flags & FS_BIND_SUBJECT) slots++;
+        if (pf->flags & FS_BIND_PREDICATE) slots++;
+        if (pf->flags & FS_BIND_OBJECT) slots++;
+        for (int s=0; s<slots; s++) {
+            fs_rid_vector_free(pf->result[s]);
+        }
+        free(pf->result);
+    }
+    prefetch_free(pf);
+}
+
 /* vi:set expandtab sts=4 sw=4: */
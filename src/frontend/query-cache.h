@@ -11,4 +11,20 @@ int fs_bind_cache_wrapper(fs_query_state *qs, fs_query *q, int all,
 
 int fs_query_cache_flush(fs_query_state *qs, int verbosity);
 
+typedef struct _fs_bind_prefetch fs_bind_prefetch;
+
+/* start a bind in the background, returns NULL if threads are not available */
+fs_bind_prefetch *fs_bind_prefetch_start(fs_query_state *qs, fs_query *q,
+    int all, int flags, fs_rid_vector *rids[4], int offset, int limit);
+
+/* if the prefetch was for exactly this bind then wait for it to complete,
+ * fill *result, free pf and return 1. Otherwise return 0 at once, and leave
+ * pf running to be handed to fs_bind_prefetch_discard() */
+int fs_bind_prefetch_finish(fs_bind_prefetch *pf, int all, int flags,
+    fs_rid_vector *rids[4], fs_rid_vector ***result, int offset, int limit);
+
+/* wait for an unused prefetch, take back the limit hits it counted on the
+ * link and free it */
+void fs_bind_prefetch_discard(fs_bind_prefetch *pf);
+
 #endif
@@ -18,9 +18,55 @@
  *  Copyright (C) 2007 Steve Harris for Garlik
  */
 
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
 #include "query-datatypes.h"
 #include "query-intl.h"
 
+/* size of an arena chunk, requests bigger than a quarter of this get a chunk
+ * of their own */
+#define ARENA_CHUNK_SIZE 16384
+/* number of spare chunks kept between queries */
+#define ARENA_POOL_MAX 64
+
+struct _fs_query_arena {
+    fs_query_arena *next;
+    size_t size;
+    size_t used;
+    /* double aligned, as malloc() would be */
+    double data[];
+};
+
+static GStaticMutex arena_pool_mutex = G_STATIC_MUTEX_INIT;
+static fs_query_arena *arena_pool = NULL;
+static int arena_pool_length = 0;
+
+static fs_query_arena *arena_chunk_new(size_t size)
+{
+    fs_query_arena *a = NULL;
+
+    if (size == ARENA_CHUNK_SIZE) {
+        g_static_mutex_lock(&arena_pool_mutex);
+        if (arena_pool) {
+            a = arena_pool;
+            arena_pool = a->next;
+            arena_pool_length--;
+        }
+        g_static_mutex_unlock(&arena_pool_mutex);
+    }
+    if (!a) {
+        a = malloc(sizeof(fs_query_arena) + size);
+        a->size = size;
+    }
+    a->next = NULL;
+    a->used = 0;
+
+    return a;
+}
+
 void fs_query_add_freeable(fs_query *q, void *ptr)
 {
     if (!q) return;
@@ -28,6 +74,86 @@ void fs_query_add_freeable(fs_query *q, void *ptr)
     q->free_list = g_slist_prepend(q->free_list, ptr);
 }
 
+void *fs_query_alloc(fs_query *q, size_t size)
+{
+    if (!q) return g_malloc(size);
+
+    size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+    fs_query_arena *a = q->arena;
+    if (size > ARENA_CHUNK_SIZE / 4) {
+        /* put it behind the current chunk, so that chunk stays in use */
+        fs_query_arena *big = arena_chunk_new(size);
+        big->used = size;
+        if (a) {
+            big->next = a->next;
+            a->next = big;
+        } else {
+            q->arena = big;
+        }
+
+        return big->data;
+    }
+    if (!a || a->size - a->used < size) {
+        a = arena_chunk_new(ARENA_CHUNK_SIZE);
+        a->next = q->arena;
+        q->arena = a;
+    }
+    void *ptr = (char *)a->data + a->used;
+    a->used += size;
+
+    return ptr;
+}
+
+char *fs_query_strdup(fs_query *q, const char *s)
+{
+    if (!s) return NULL;
+
+    size_t len = strlen(s) + 1;
+    char *ret = fs_query_alloc(q, len);
+    memcpy(ret, s, len);
+
+    return ret;
+}
+
+char *fs_query_strdup_printf(fs_query *q, const char *format, ...)
+{
+    va_list argp;
+    char tmp[128];
+
+    va_start(argp, format);
+    int len = vsnprintf(tmp, sizeof(tmp), format, argp);
+    va_end(argp);
+    char *ret = fs_query_alloc(q, len + 1);
+    if (len < sizeof(tmp)) {
+        memcpy(ret, tmp, len + 1);
+    } else {
+        va_start(argp, format);
+        vsnprintf(ret, len + 1, format, argp);
+        va_end(argp);
+    }
+
+    return ret;
+}
+
+void fs_query_arena_free(fs_query_arena *a)
+{
+    while (a) {
+        fs_query_arena *next = a->next;
+        if (a->size == ARENA_CHUNK_SIZE) {
+            g_static_mutex_lock(&arena_pool_mutex);
+            if (arena_pool_length < ARENA_POOL_MAX) {
+                a->next = arena_pool;
+                arena_pool = a;
+                arena_pool_length++;
+                a = NULL;
+            }
+            g_static_mutex_unlock(&arena_pool_mutex);
+        }
+        free(a);
+        a = next;
+    }
+}
+
 fsp_link *fs_query_link(fs_query *q)
 {
     if (q) {
@@ -5,6 +5,13 @@
 #include "common/4store.h"
 
 void fs_query_add_freeable(fs_query *q, void *ptr);
+
+/* memory that lives until fs_query_free(), it cannot be freed or realloc'd
+ * individually. With a NULL query these fall back to g_malloc() */
+void *fs_query_alloc(fs_query *q, size_t size);
+char *fs_query_strdup(fs_query *q, const char *s);
+char *fs_query_strdup_printf(fs_query *q, const char *format, ...);
+void fs_query_arena_free(fs_query_arena *a);
 fsp_link *fs_query_link(fs_query *q);
 
 #endif
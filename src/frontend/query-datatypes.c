@@ -30,11 +30,60 @@
 #include "common/datatypes.h"
 #include "common/sort.h"
 
+/* guards the query's warnings, and its memory accounting */
+static GStaticMutex warnings_mutex = G_STATIC_MUTEX_INIT;
+
 /* struct to hold information useful for sorting binding tables */
 struct sort_context {
     fs_binding *b;
 };
 
+/* fail the query with a warning, called with warnings_mutex held */
+static void budget_exceeded(fs_query *q)
+{
+    q->over_budget = 1;
+    q->errors++;
+    /* not from the arena, blocks can be merged from several threads */
+    q->warnings = g_slist_prepend(q->warnings,
+        g_strdup_printf("query stopped, it exceeded its memory budget "
+            "of %lld MB", q->mem_budget / (1024 * 1024)));
+}
+
+/* returns true if a table of rows x width, on top of the block tables the
+ * query already holds, would take it over its memory budget, or if the query
+ * has been stopped already */
+static int over_budget(fs_query *q, long long rows, int width)
+{
+    if (!q || q->mem_budget <= 0) return 0;
+
+    const long long bytes = rows * width * (long long)sizeof(fs_rid);
+    g_static_mutex_lock(&warnings_mutex);
+    if (!q->over_budget && q->mem_used + bytes > q->mem_budget) {
+        budget_exceeded(q);
+    }
+    const int over = q->over_budget;
+    g_static_mutex_unlock(&warnings_mutex);
+
+    return over;
+}
+
+int fs_binding_account(fs_query *q, int block, fs_binding *b)
+{
+    const long long bytes = b ? (long long)fs_binding_length(b) *
+                                fs_binding_width(b) * sizeof(fs_rid) : 0;
+
+    g_static_mutex_lock(&warnings_mutex);
+    q->mem_used += bytes - q->block_bytes[block];
+    q->block_bytes[block] = bytes;
+    if (!q->over_budget && q->mem_budget > 0 && q->mem_used > q->mem_budget) {
+        budget_exceeded(q);
+    }
+    const int over = q->over_budget;
+    g_static_mutex_unlock(&warnings_mutex);
+
+    return over;
+}
+
 /* lookup sorted table values given a column number and logcial (sorted) row
  * number, sorted order is represented in the 0th column (_ord) to make sorting
  * more efficient */
@@ -800,13 +849,18 @@ void fs_binding_merge(fs_query *q, int block, fs_binding *from, fs_binding *to)
     fs_binding_print(to, stdout);
 #endif
 
+    const int width_t = fs_binding_width(to);
+    int added = 0;
     int fpos = 0;
     int tpos = 0;
     while (fpos < length_f || tpos < length_t) {
         if (q->flags & FS_QUERY_RESTRICTED &&
             fs_binding_length(to) >= q->soft_limit) {
             char *msg = g_strdup("some results have been dropped to prevent overunning time allocation");
+            /* blocks can be merged from several threads */
+            g_static_mutex_lock(&warnings_mutex);
             q->warnings = g_slist_prepend(q->warnings, msg);
+            g_static_mutex_unlock(&warnings_mutex);
             break;
         }
 	int cmp;
@@ -856,6 +910,9 @@ if (fp < 20) {
     printf("ADD\n");
 }
 #endif
+			    if (over_budget(q, (long long)length_t + ++added, width_t)) {
+				goto merge_done;
+			    }
 			    for (int c=1; to[c].name; c++) {
 				if (!from[c].bound && !to[c].bound) continue;
 				if (from[c].bound && fp < from[c].vals->length) {
@@ -881,6 +938,7 @@ if (fp < 20) {
 	}
     }
 
+    merge_done:
     /* clear the _ord columns */
     from[0].vals->length = 0;
     to[0].vals->length = 0;
@@ -1023,6 +1081,7 @@ fs_binding *fs_binding_join(fs_query *q, fs_binding *a, fs_binding *b, fs_join_t
         }
     }
 
+    const int width_c = fs_binding_width(c);
     int apos = 0;
     int bpos = 0;
     int cmp;
@@ -1063,6 +1122,10 @@ printf("[I] Ar=%d, Br=%d", apos, bpos);
             while (binding_row_compare(q, b, b, bpos, range_b, length_b, length_b) == 0) range_b++;
             int start_a = apos;
             int start_b = bpos;
+            if (over_budget(q, (long long)fs_binding_length(c) +
+                    (long long)(range_a - start_a) * (range_b - start_b), width_c)) {
+                break;
+            }
             for (apos = start_a; apos<range_a; apos++) {
                 for (bpos = start_b; bpos<range_b; bpos++) {
                     for (int col=0; a[col].name; col++) {
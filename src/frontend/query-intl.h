@@ -9,14 +9,25 @@
 #include <rasqal.h>
 #include <glib.h>
 
+typedef struct _fs_query_arena fs_query_arena;
+typedef struct _fs_resolve_prefetch fs_resolve_prefetch;
+
+/* waits for and frees a background resolve started by fs_query_fetch_row() */
+void fs_resolve_prefetch_free(fs_resolve_prefetch *rp);
+
 struct _fs_query_state {
     fsp_link *link;
     fs_bind_cache *bind_cache;
     GHashTable *freq_s, *freq_o;
 
-    /* mutex protecting the bind_cache */
+    /* mutex protecting the bind_cache and bind_flights */
     GStaticMutex cache_mutex;
 
+    /* cachable binds currently being sent by some thread, and the condition
+     * their duplicates wait on */
+    struct _fs_bind_flight *bind_flights;
+    GCond *flight_cond;
+
     /* features supported by the backend */
     int freq_available;
 
@@ -31,6 +42,10 @@ struct _fs_query {
     fsp_link *link;
     fs_binding *bt;			/* main binding table, used in FILTER handling */
     fs_binding *bb[FS_MAX_BLOCKS];	/* per block binding table */
+    fs_bind_prefetch *prefetch[FS_MAX_BLOCKS]; /* speculative bind for the
+                                                * next pattern in a block */
+    GSList *unused_prefetch[FS_MAX_BLOCKS]; /* prefetches that didn't
+                                             * match, reaped after the block */
     int segments;
     int num_vars;			/* number of projected variables */
     int expressions;			/* number of projected expressions */
@@ -45,12 +60,21 @@ struct _fs_query {
     int offset;
     int opt_level;			/* optimisation level in [0,3] */
     int boolean;			/* true if the query succeeded */
+    int block_false[FS_MAX_BLOCKS];	/* true if a pattern in the block
+					   failed, folded into boolean once
+					   the block has been joined */
     int block;
     int unions;
     int row; 				/* current row in results */
     int lastrow;			/* last row that was resolved */
     int rows_output;			/* number of rows returned */
     int errors;				/* number of parse/execution errors */
+    long long mem_budget;		/* bytes the binding tables may use */
+    long long mem_used;			/* bytes in the block tables */
+    long long block_bytes[FS_MAX_BLOCKS]; /* each block's share of mem_used */
+    int over_budget;			/* true once mem_budget was hit */
+    volatile gint binds_truncated;	/* chunked binds stopped by the
+					   soft limit */
     fs_row *resrow;
     fs_p_vector blocks[FS_MAX_BLOCKS];
     fs_join_type join_type[FS_MAX_BLOCKS];
@@ -59,11 +83,13 @@ struct _fs_query {
     raptor_sequence *constraints[FS_MAX_BLOCKS];
     int flags;
     fs_rid_vector **pending;
+    fs_resolve_prefetch *res_prefetch;	/* lookup of the next window of rows */
     rasqal_query *rq;
     raptor_serializer *ser;
     raptor_uri *base;
     GSList *free_list;			/* list of pointers to be freed
 					 * with g_free */
+    fs_query_arena *arena;		/* chunks for fs_query_alloc() */
     GSList *warnings;
     int *ordering;
     double start_time;
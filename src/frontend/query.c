@@ -46,12 +46,15 @@
 //#define DEBUG_BIND
 
 #define DESC_SIZE 1024
+/* maximum number of blocks of one query executed at the same time */
+#define FS_QUERY_BLOCK_THREADS 8
 
 #define DEBUG_SIZE(n, thing) printf("@@ %d * sizeof(%s) = %zd\n", n, #thing, n * sizeof(thing))
 
 static void graph_pattern_walk(fsp_link *link, rasqal_graph_pattern *p, fs_query *q, rasqal_literal *model, int optional, int uni);
-static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t);
+static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t, rasqal_triple *next);
 static int fs_handle_query_triple_multi(fs_query *q, int block, int count, rasqal_triple *t[]);
+static void prefetch_triple(fs_query *q, int block, fs_binding *b, rasqal_triple *cur, rasqal_triple *t);
 static fs_rid const_literal_to_rid(fs_query *q, rasqal_literal *l, fs_rid *attr);
 static void check_variables(fs_query *q, rasqal_expression *e, int dont_select);
 static void filter_optimise_disjunct_equality(fs_query *q,
@@ -148,19 +151,17 @@ static void warning_handler(void *user_data, raptor_locator* locator, const char
 {
     fs_query *q = user_data;
 
-    char *msg = g_strdup_printf("parser warning: %s at line %d", message, raptor_locator_line(locator));
+    char *msg = fs_query_strdup_printf(q, "parser warning: %s at line %d", message, raptor_locator_line(locator));
     q->warnings = g_slist_prepend(q->warnings, msg);
-    fs_query_add_freeable(q, msg);
 }
 
 static void error_handler(void *user_data, raptor_locator* locator, const char *message)
 {
     fs_query *q = user_data;
 
-    char *msg = g_strdup_printf("parser error: %s at line %d", message, raptor_locator_line(locator));
+    char *msg = fs_query_strdup_printf(q, "parser error: %s at line %d", message, raptor_locator_line(locator));
     q->warnings = g_slist_prepend(q->warnings, msg);
     q->errors++;
-    fs_query_add_freeable(q, msg);
 }
 
 guint fs_freq_hash(gconstpointer key)
@@ -280,6 +281,7 @@ int fs_query_fini(fs_query_state *qs)
             rasqal_free_world(qs->rasqal_world);
 #endif /* HAVE_RASQAL_WORLD */
         free(qs->bind_cache);
+        if (qs->flight_cond) g_cond_free(qs->flight_cond);
         g_static_mutex_free(&qs->cache_mutex);
         free(qs);
     }
@@ -317,6 +319,197 @@ printf("Merge B%d to B%d\n", block, parent);
     }
 }
 
+/* run the triple patterns of one block against its own binding table */
+static void execute_block(fs_query *q, int i, int explain)
+{
+#if DEBUG_MERGE
+printf("Processing B%d, parent is B%d\n", i, q->parent_block[i]);
+#endif
+    if (!q->bb[i]) {
+        int tocopy = q->parent_block[i];
+        while (!q->bb[tocopy]) {
+            tocopy = q->parent_block[tocopy];
+            if (tocopy == 0) break;
+        }
+        q->bb[i] = fs_binding_copy(q->bb[tocopy]);
+    }
+    for (int j=0; j<q->blocks[i].length; j++) {
+        int chunk = fs_optimise_triple_pattern(q->qs, q, i,
+           (rasqal_triple **)(q->blocks[i].data), q->blocks[i].length, j);
+        /* execute triple pattern query */
+        if (explain) {
+            printf("execute: ");
+            if (!q->blocks[i].data[j]) {
+                printf("NULL");
+            } else {
+                for (int k=0; k<chunk; k++) {
+                    if (k) printf(" ");
+                    rasqal_triple_print(q->blocks[i].data[j+k], stdout);
+                }
+            }
+            if (q->flags & FS_BIND_DISTINCT) {
+                printf(" DISTINCT");
+            }
+            if (q->flags & FS_BIND_SAME_MASK) {
+                printf(" SAME(?)");
+            }
+            if (q->soft_limit > 0) {
+                printf(" LIMIT %d", q->soft_limit);
+            }
+            printf("\n");
+        }
+        int ret;
+        if (chunk == 1) {
+            /* the next pattern, if the optimiser won't reorder it once
+             * this one is joined */
+            rasqal_triple *next = NULL;
+            if (!explain && j + 1 < q->blocks[i].length &&
+                fs_optimise_order_fixed(q, q->blocks[i].length, j + 1)) {
+                next = q->blocks[i].data[j + 1];
+            }
+            ret = fs_handle_query_triple(q, i, q->blocks[i].data[j], next);
+        } else {
+            rasqal_triple *in[chunk];
+            for (int k=0; k<chunk; k++) {
+                in[k] = q->blocks[i].data[j+k];
+            }
+            ret = fs_handle_query_triple_multi(q, i, chunk, in);
+            j += chunk-1;
+        }
+        if (explain) {
+            printf("%d bindings (%d)\n", fs_binding_length(q->bb[i]), ret);
+        }
+        if (fs_binding_account(q, i, q->bb[i])) {
+            break;
+        }
+        if (q->block < 2 && ret == 0) {
+            q->block_false[i] = 1;
+        }
+        if (ret == 0) {
+            for (int var=0; q->bb[i][var].name; var++) {
+                if (q->bb[0][var].appears == i) {
+                    fs_rid_vector_free(q->bb[i][var].vals);
+                    q->bb[i][var].vals = NULL;
+                    q->bb[i][var].vals = fs_rid_vector_new(fs_binding_length(q->bb[i]));
+                    q->bb[i][var].bound = 1;
+                    for (int r=0; r<q->bb[i][var].vals->length; r++) {
+                        q->bb[i][var].vals->data[r] = FS_RID_NULL;
+                    }
+                }
+            }
+            break;
+        }
+        /* if the query is false it must have failed, boolean is only
+         * written between rounds of blocks, so it's safe to read here */
+        if (q->block_false[i] || q->boolean == 0) {
+            break;
+        }
+    }
+    if (q->prefetch[i]) {
+        /* the block ended before the speculative bind was wanted */
+        q->unused_prefetch[i] = g_slist_prepend(q->unused_prefetch[i], q->prefetch[i]);
+        q->prefetch[i] = NULL;
+    }
+#if DEBUG_MERGE > 1
+printf("table after processing B%d:\n", i);
+fs_binding_print(q->bb[i], stdout);
+printf("\n");
+#endif
+}
+
+static void reap_prefetches(fs_query *q, int block)
+{
+    for (GSList *it = q->unused_prefetch[block]; it; it = it->next) {
+        fs_bind_prefetch_discard(it->data);
+    }
+    g_slist_free(q->unused_prefetch[block]);
+    q->unused_prefetch[block] = NULL;
+}
+
+struct block_job {
+    fs_query *q;
+    int block;
+};
+
+static gpointer execute_block_thread(gpointer data)
+{
+    struct block_job *job = data;
+
+    execute_block(job->q, job->block, 0);
+
+    return NULL;
+}
+
+/* Each block only writes to its own binding table and failure flag, and only
+ * reads the table of the block it copies from, so once that block has
+ * finished, sibling UNION branches and OPTIONALs can run at the same time.
+ * The failure flags are folded into q->boolean after each round is joined.
+ * The link serialises requests per segment, so the gain comes from
+ * overlapping one block's backend round trips with another's, and with the
+ * joins in the frontend */
+static void execute_blocks(fs_query *q, int explain)
+{
+    int dep[FS_MAX_BLOCKS];
+    int done[FS_MAX_BLOCKS];
+
+    for (int i=0; i <= q->block; i++) {
+        done[i] = (q->blocks[i].length == 0);
+        dep[i] = -1;
+        if (done[i] || q->bb[i]) continue;
+        /* the nearest ancestor that will have a binding table */
+        int tocopy = q->parent_block[i];
+        while (!q->bb[tocopy] && q->blocks[tocopy].length == 0) {
+            tocopy = q->parent_block[tocopy];
+            if (tocopy == 0) break;
+        }
+        dep[i] = tocopy;
+    }
+
+    const int parallel = !explain && g_thread_supported();
+    for (;;) {
+        int ready[FS_QUERY_BLOCK_THREADS];
+        int nready = 0;
+        for (int i=0; i <= q->block && nready < FS_QUERY_BLOCK_THREADS; i++) {
+            if (done[i]) continue;
+            if (dep[i] != -1 && !done[dep[i]]) continue;
+            ready[nready++] = i;
+            if (!parallel) break;
+        }
+        if (nready == 0) break;
+
+        struct block_job job[nready];
+        GThread *thread[nready];
+        for (int r=1; r<nready; r++) {
+            job[r].q = q;
+            job[r].block = ready[r];
+            thread[r] = g_thread_create(execute_block_thread, job+r, TRUE, NULL);
+            if (!thread[r]) {
+                execute_block(q, ready[r], explain);
+            }
+        }
+        execute_block(q, ready[0], explain);
+        for (int r=1; r<nready; r++) {
+            if (thread[r]) g_thread_join(thread[r]);
+        }
+        for (int r=0; r<nready; r++) {
+            done[ready[r]] = 1;
+            if (q->block_false[ready[r]]) q->boolean = 0;
+            reap_prefetches(q, ready[r]);
+        }
+        if (q->over_budget) break;
+    }
+}
+
+/* a query that went over its memory budget returns no rows at all, rather
+ * than whatever it had found so far */
+static void drop_results(fs_query *q)
+{
+    for (int i=0; i<=q->block; i++) {
+        if (q->bb[i]) fs_binding_truncate(q->bb[i], 0);
+    }
+    q->boolean = 0;
+}
+
 fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, const char *query, int flags, int opt_level, int soft_limit)
 {
     if (!qs) {
@@ -365,6 +558,11 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
     } else {
         q->soft_limit = FS_FANOUT_LIMIT;
     }
+    q->mem_budget = FS_QUERY_MEMORY_BUDGET;
+    if (getenv("FS_QUERY_MEMORY_BUDGET")) {
+        /* in MB, 0 removes the budget */
+        q->mem_budget = atoll(getenv("FS_QUERY_MEMORY_BUDGET")) * 1024 * 1024;
+    }
     q->boolean = 1;
     rasqal_query_set_warning_handler(rq, q, warning_handler);
     rasqal_query_set_error_handler(rq, q, error_handler);
@@ -434,9 +632,8 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
         while (!feof(errout)) {
             char tmp[1024];
             fgets(tmp, 1024, errout);
-            char *msg = g_strdup(tmp);
+            char *msg = fs_query_strdup(q, tmp);
             q->warnings = g_slist_prepend(q->warnings, msg);
-            fs_query_add_freeable(q, msg);
         }
         fclose(errout);
     }
@@ -575,88 +772,8 @@ fs_query *fs_query_execute(fs_query_state *qs, fsp_link *link, raptor_uri *bu, c
     }
 #endif
 
-    for (int i=0; i <= q->block; i++) {
-#if DEBUG_MERGE
-printf("Processing B%d, parent is B%d\n", i, q->parent_block[i]);
-#endif
-        if (q->blocks[i].length == 0) {
-            continue;
-        }
-        if (!q->bb[i]) {
-            int tocopy = q->parent_block[i];
-            while (!q->bb[tocopy]) {
-                tocopy = q->parent_block[tocopy];
-                if (tocopy == 0) break;
-            }
-            q->bb[i] = fs_binding_copy(q->bb[tocopy]);
-        }
-	for (int j=0; j<q->blocks[i].length; j++) {
-	    int chunk = fs_optimise_triple_pattern(q->qs, q, i,
-	       (rasqal_triple **)(q->blocks[i].data), q->blocks[i].length, j);
-	    /* execute triple pattern query */
-	    if (explain) {
-		printf("execute: ");
-		if (!q->blocks[i].data[j]) {
-		    printf("NULL");
-		} else {
-                    for (int k=0; k<chunk; k++) {
-                        if (k) printf(" ");
-                        rasqal_triple_print(q->blocks[i].data[j+k], stdout);
-                    }
-		}
-                if (q->flags & FS_BIND_DISTINCT) {
-                    printf(" DISTINCT");
-                }
-                if (q->flags & FS_BIND_SAME_MASK) {
-                    printf(" SAME(?)");
-                }
-                if (q->soft_limit > 0) {
-                    printf(" LIMIT %d", q->soft_limit);
-                }
-		printf("\n");
-	    }
-            int ret;
-            if (chunk == 1) {
-                ret = fs_handle_query_triple(q, i, q->blocks[i].data[j]);
-            } else {
-                rasqal_triple *in[chunk];
-                for (int k=0; k<chunk; k++) {
-                    in[k] = q->blocks[i].data[j+k];
-                }
-                ret = fs_handle_query_triple_multi(q, i, chunk, in);
-                j += chunk-1;
-            }
-	    if (explain) {
-		printf("%d bindings (%d)\n", fs_binding_length(q->bb[i]), ret);
-	    }
-            if (q->block < 2 && ret == 0) {
-                q->boolean = 0;
-            }
-            if (ret == 0) {
-                for (int var=0; q->bb[i][var].name; var++) {
-                    if (q->bb[0][var].appears == i) {
-                        fs_rid_vector_free(q->bb[i][var].vals);
-                        q->bb[i][var].vals = NULL;
-                        q->bb[i][var].vals = fs_rid_vector_new(fs_binding_length(q->bb[i]));
-                        q->bb[i][var].bound = 1;
-                        for (int r=0; r<q->bb[i][var].vals->length; r++) {
-                            q->bb[i][var].vals->data[r] = FS_RID_NULL;
-                        }
-                    }
-                }
-                break;
-            }
-            /* if the query is false it must have failed */
-            if (q->boolean == 0) {
-                break;
-            }
-	}
-#if DEBUG_MERGE > 1
-printf("table after processing B%d:\n", i);
-fs_binding_print(q->bb[i], stdout);
-printf("\n");
-#endif
-    }
+    execute_blocks(q, explain);
+    if (q->over_budget) drop_results(q);
 
     /* perform all the UNIONs */
     int first_in_union;
@@ -755,6 +872,8 @@ printf("\n");
         }
     }
 
+    if (q->over_budget) drop_results(q);
+
 #ifdef DEBUG_MERGE
     explain = flags & FS_QUERY_EXPLAIN;
 #endif
@@ -874,6 +993,10 @@ void fs_query_free(fs_query *q)
 	fs_binding_free(q->bb[0]);
 	if (q->resrow) free(q->resrow);
 	if (q->ordering) free(q->ordering);
+        fs_resolve_prefetch_free(q->res_prefetch);
+        for (int i=0; i<FS_MAX_BLOCKS; i++) {
+            reap_prefetches(q, i);
+        }
         if (q->pending) {
             for (int i=0; i<q->segments && q->pending; i++) {
                 fs_rid_vector_free(q->pending[i]);
@@ -897,6 +1020,7 @@ void fs_query_free(fs_query *q)
             g_free(it->data);
         }
 	g_slist_free(q->free_list);
+        fs_query_arena_free(q->arena);
 
         if (q->default_graphs) fs_rid_vector_free(q->default_graphs);
 
@@ -1468,29 +1592,15 @@ results = { vector->length > 0 )
 
 */
 
-static int process_results(fs_query *q, int block, fs_binding *oldb,
-        fs_binding *b, int flags,
-	fs_rid_vector *results[], char *varnames[], int numbindings,
-	fs_rid_vector *slot[4])
+/* join the bound columns of results into b, which must be empty, with the
+ * rows of oldb, which is left as it was. results is freed. Returns the
+ * number of values bound */
+static int merge_results(fs_query *q, int block, fs_binding *oldb,
+        fs_binding *b, fs_rid_vector *results[], char *varnames[],
+        int numbindings)
 {
     int ret = 0;
 
-    if (results) {
-        /* if there are no bindings in results, but it didn't fail */
-        if (!results[0]) {
-            for (int i=0; oldb[i].name; i++) {
-                fs_rid_vector_append_vector(b[i].vals, oldb[i].vals);
-                b[i].bound |= oldb[i].bound;
-            }
-            free(results);
-            for (int x=0; x<4; x++) {
-                fs_rid_vector_clear(slot[x]);
-            }
-            fs_binding_free(oldb);
-
-            return 1;
-        }
-
 	for (int col=0; col<numbindings; col++) {
 	    if (varnames[col]) {
                 fs_binding *bv = fs_binding_get(b, varnames[col]);
@@ -1538,9 +1648,43 @@ static int process_results(fs_query *q, int block, fs_binding *oldb,
 #endif
             
         fs_binding_merge(q, block, oldb, b);
+
+    return ret;
+}
+
+/* there was a match, but the bind had no columns, so b gets the rows of oldb
+ * unchanged */
+static void keep_rows(fs_binding *oldb, fs_binding *b)
+{
+    for (int i=0; oldb[i].name; i++) {
+        fs_rid_vector_append_vector(b[i].vals, oldb[i].vals);
+        b[i].bound |= oldb[i].bound;
+    }
+}
+
+static int process_results(fs_query *q, int block, fs_binding *oldb,
+        fs_binding *b, int flags,
+	fs_rid_vector *results[], char *varnames[], int numbindings,
+	fs_rid_vector *slot[4])
+{
+    int ret = 0;
+
+    if (results) {
+        /* if there are no bindings in results, but it didn't fail */
+        if (!results[0]) {
+            keep_rows(oldb, b);
+            free(results);
+            for (int x=0; x<4; x++) {
+                fs_rid_vector_clear(slot[x]);
+            }
+            fs_binding_free(oldb);
+
+            return 1;
+        }
+        ret = merge_results(q, block, oldb, b, results, varnames, numbindings);
     } else {
         if (!(flags & (FS_BIND_OPTIONAL | FS_BIND_UNION))) {
-            q->boolean = 0;
+            q->block_false[block] = 1;
         }
     }
     fs_binding_free(oldb);
@@ -1548,7 +1692,363 @@ static int process_results(fs_query *q, int block, fs_binding *oldb,
     return ret;
 }
 
-static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
+/* when a bind_all is driven by one of s or o and the other has at least this
+ * many values it's cheaper to send a Bloom filter of them, and let the
+ * backends traverse rather than search for each pair */
+#define FS_BIND_FILTER_MIN 1024
+
+/* do a bind_all with the non-driving s/o slot sent as a Bloom filter, then
+ * remove the false positives. Returns 0 if the bind wasn't suitable */
+static int bind_filtered(fs_query *q, int flags, fs_rid_vector *slot[4],
+                         fs_rid_vector ***results, int limit)
+{
+    const int fslot = (flags & FS_BIND_BY_OBJECT) ? 1 : 3;
+    const int drive = fslot == 1 ? 3 : 1;
+    const int fbit = fslot == 1 ? FS_BIND_SUBJECT : FS_BIND_OBJECT;
+
+    if (flags & FS_BIND_SAME_MASK || !(flags & fbit)) return 0;
+    if (fs_rid_vector_length(slot[fslot]) < FS_BIND_FILTER_MIN) return 0;
+    if (fs_rid_vector_length(slot[drive]) == 0) return 0;
+    for (int s=0; s<4; s++) {
+        if (slot[s]->length == 1 && slot[s]->data[0] == FS_RID_NULL) return 0;
+    }
+
+    fs_rid_vector *values = slot[fslot];
+    fs_rid_vector *empty = fs_rid_vector_new(0);
+    fs_rid_bloom *filter = fs_rid_bloom_new(values);
+
+    slot[fslot] = empty;
+    int ret = fsp_bind_limit_all_filter(q->link, flags, slot[0], slot[1],
+                    slot[2], slot[3], fslot, filter, results, -1, limit);
+    slot[fslot] = values;
+    fs_rid_vector_free(empty);
+    fs_rid_bloom_free(filter);
+    if (ret) {
+        fs_error(LOG_ERR, "bind failed in '%s', %d segments gave errors",
+                 fsp_kb_name(q->link), ret);
+
+        exit(1);
+    }
+
+    /* the column holding the filtered slot, and the number of columns */
+    int col = 0, cols = 0;
+    for (int s=0; s<4; s++) {
+        if (!(flags & (1 << s))) continue;
+        if (s == fslot) col = cols;
+        cols++;
+    }
+    fs_rid_vector **r = *results;
+    if (!r || !r[col]) return 1;
+
+    /* exact check, the backends only applied the filter */
+    fs_rid_vector *sorted = fs_rid_vector_copy(values);
+    fs_rid_vector_sort(sorted);
+    fs_rid_vector_uniq(sorted, 0);
+    int out = 0;
+    for (int row=0; row<r[col]->length; row++) {
+        if (!fs_rid_vector_contains_sorted(sorted, r[col]->data[row])) continue;
+        for (int c=0; c<cols; c++) {
+            if (r[c]) r[c]->data[out] = r[c]->data[row];
+        }
+        out++;
+    }
+    for (int c=0; c<cols; c++) {
+        if (r[c]) r[c]->length = out;
+    }
+    fs_rid_vector_free(sorted);
+
+    return 1;
+}
+
+/* true if the driving subjects or objects of a bind are too many to send in
+ * one go */
+static int bind_too_big(int flags, fs_rid_vector *slot[4])
+{
+    const int drive = (flags & FS_BIND_BY_OBJECT) ? 3 : 1;
+
+    return slot[drive]->length > FS_BIND_CHUNK_SIZE;
+}
+
+/* append the rows of from to to, which have the same variables */
+static void append_rows(fs_binding *to, fs_binding *from)
+{
+    const int length_t = fs_binding_length(to);
+    const int length_f = fs_binding_length(from);
+
+    for (int i=1; from[i].name; i++) {
+        if (!from[i].bound && !to[i].bound) continue;
+        while (to[i].vals->length < length_t) {
+            fs_rid_vector_append(to[i].vals, FS_RID_NULL);
+        }
+        for (int row=0; row<length_f; row++) {
+            fs_rid_vector_append(to[i].vals, row < from[i].vals->length ?
+                                 from[i].vals->data[row] : FS_RID_NULL);
+        }
+        to[i].bound |= from[i].bound;
+    }
+}
+
+/* bind in chunks of the driving subjects or objects, so that no one message
+ * gets too big, and join each chunk's results into b as they arrive, so only
+ * one chunk's worth is held besides the block table. This works as the merge
+ * treats each new row on its own. The soft limit applies to the bind as a
+ * whole, once it's used up the remaining chunks are skipped. Takes the place
+ * of process_results() */
+static int bind_chunked(fs_query *q, int block, int all, int flags,
+                        fs_rid_vector *slot[4], fs_binding *oldb, fs_binding *b,
+                        char *varnames[], int numbindings)
+{
+    const int limit = q->order ? -1 : q->soft_limit;
+    const int drive = (flags & FS_BIND_BY_OBJECT) ? 3 : 1;
+    fs_rid_vector *values = slot[drive];
+    fs_binding *empty = fs_binding_copy(b);
+    int matched = 0;
+    int rows = 0;
+    int ret = 0;
+
+    for (int start=0; start<values->length; start+=FS_BIND_CHUNK_SIZE) {
+        if (limit > 0 && rows >= limit) {
+            fsp_hit_limits_add(q->link, 1);
+            g_atomic_int_inc(&q->binds_truncated);
+            break;
+        }
+        int n = values->length - start;
+        if (n > FS_BIND_CHUNK_SIZE) n = FS_BIND_CHUNK_SIZE;
+        fs_rid_vector chunk = { .length = n, .size = n,
+                                .data = values->data + start };
+
+        fs_rid_vector **part = NULL;
+        slot[drive] = &chunk;
+        fs_bind_cache_wrapper(q->qs, q, all, flags, slot, &part, -1,
+                              limit > 0 ? limit - rows : limit);
+        slot[drive] = values;
+        if (!part) continue;
+
+        matched = 1;
+        /* with no columns we only need to know there's a match */
+        if (!part[0]) {
+            free(part);
+            keep_rows(oldb, b);
+            ret = 1;
+            break;
+        }
+        rows += part[0]->length;
+        fs_binding *nb = fs_binding_copy(empty);
+        ret += merge_results(q, block, oldb, nb, part, varnames, numbindings);
+        append_rows(b, nb);
+        fs_binding_free(nb);
+        if (fs_binding_account(q, block, b)) break;
+    }
+    if (!matched && !(flags & (FS_BIND_OPTIONAL | FS_BIND_UNION))) {
+        q->block_false[block] = 1;
+    }
+    for (int x=0; x<4; x++) {
+        fs_rid_vector_clear(slot[x]);
+    }
+    fs_binding_free(empty);
+    fs_binding_free(oldb);
+
+    return ret;
+}
+
+static fs_binding *bound_var(fs_binding *b, rasqal_literal *l)
+{
+    if (!l || l->type != RASQAL_LITERAL_VARIABLE) return NULL;
+    fs_binding *vb = fs_binding_get(b, (char *)l->value.variable->name);
+
+    return vb && vb->bound ? vb : NULL;
+}
+
+static int rid_pair_cmp(const void *va, const void *vb)
+{
+    const fs_rid *a = va;
+    const fs_rid *b = vb;
+
+    if (a[0] != b[0]) return a[0] < b[0] ? -1 : 1;
+    if (a[1] != b[1]) return a[1] < b[1] ? -1 : 1;
+
+    return 0;
+}
+
+/* when the subject and the object (or predicate) of t are both bound by
+ * earlier patterns, only the combinations that occur in the same row of b
+ * can join, so send those pairs rather than the two sets. Returns 0 if the
+ * bind wasn't suitable */
+static int bind_paired(fs_query *q, int all, int flags, fs_rid_vector *slot[4],
+                       fs_rid_vector ***results, fs_binding *b,
+                       rasqal_triple *t, int limit)
+{
+    int other, pair_flag;
+    fs_binding *sb = bound_var(b, t->subject), *ob;
+
+    if (flags & FS_BIND_SAME_MASK || !sb || !(flags & FS_BIND_SUBJECT)) {
+        return 0;
+    }
+    if ((ob = bound_var(b, t->object)) && flags & FS_BIND_OBJECT) {
+        other = 3;
+        pair_flag = FS_BIND_PAIR_SO;
+    } else if ((ob = bound_var(b, t->predicate)) && flags & FS_BIND_PREDICATE) {
+        other = 2;
+        pair_flag = FS_BIND_PAIR_SP;
+    } else {
+        return 0;
+    }
+    if (sb == ob || sb->vals->length != ob->vals->length) return 0;
+
+    const int rows = sb->vals->length;
+    fs_rid (*pairs)[2] = malloc((rows ? rows : 1) * sizeof(fs_rid[2]));
+    int n = 0;
+    for (int r=0; r<rows; r++) {
+        const fs_rid sr = sb->vals->data[r], orr = ob->vals->data[r];
+        if (sr == FS_RID_NULL || FS_IS_LITERAL(sr) || orr == FS_RID_NULL) {
+            continue;
+        }
+        if (other == 2 && FS_IS_LITERAL(orr)) continue;
+        pairs[n][0] = sr;
+        pairs[n][1] = orr;
+        n++;
+    }
+    qsort(pairs, n, sizeof(fs_rid[2]), rid_pair_cmp);
+    int out = 0;
+    for (int i=0; i<n; i++) {
+        if (out && !rid_pair_cmp(pairs[out-1], pairs[i])) continue;
+        pairs[out][0] = pairs[i][0];
+        pairs[out][1] = pairs[i][1];
+        out++;
+    }
+
+    /* only worth it if it's smaller than the cartesian product */
+    if (out == 0 || (long long)out >= (long long)slot[1]->length * slot[other]->length) {
+        free(pairs);
+
+        return 0;
+    }
+
+    fs_rid_vector *sv = fs_rid_vector_new(out);
+    fs_rid_vector *ov = fs_rid_vector_new(out);
+    for (int i=0; i<out; i++) {
+        sv->data[i] = pairs[i][0];
+        ov->data[i] = pairs[i][1];
+    }
+    free(pairs);
+
+    fs_rid_vector *save_s = slot[1], *save_o = slot[other];
+    slot[1] = sv;
+    slot[other] = ov;
+    fs_bind_cache_wrapper(q->qs, q, all, flags | pair_flag, slot, results, -1, limit);
+    slot[1] = save_s;
+    slot[other] = save_o;
+    fs_rid_vector_free(sv);
+    fs_rid_vector_free(ov);
+
+    return 1;
+}
+
+/* use the speculative bind for this block if it was for the same arguments,
+ * otherwise bind now. Then, before the caller starts joining, send the bind
+ * for next if it's safe to. Returns 0 if the bind is too big to send in one
+ * go, and has to be made with bind_chunked() instead */
+static int bind_with_prefetch(fs_query *q, int block, int all, int flags,
+                               fs_rid_vector *slot[4], fs_rid_vector ***results,
+                               fs_binding *b, rasqal_triple *t, rasqal_triple *next)
+{
+    const int limit = q->order ? -1 : q->soft_limit;
+    int done = 0;
+
+    if (q->prefetch[block]) {
+        fs_bind_prefetch *pf = q->prefetch[block];
+        q->prefetch[block] = NULL;
+        done = fs_bind_prefetch_finish(pf, all, flags, slot, results, -1, limit);
+        if (!done) {
+            /* don't wait for it now, it's reaped once the block is done */
+            q->unused_prefetch[block] = g_slist_prepend(q->unused_prefetch[block], pf);
+        }
+    }
+    if (!done) {
+        done = bind_paired(q, all, flags, slot, results, b, t, limit);
+    }
+    if (!done && all) {
+        done = bind_filtered(q, flags, slot, results, limit);
+    }
+    if (!done && bind_too_big(flags, slot)) {
+        return 0;
+    }
+    if (!done) {
+        fs_bind_cache_wrapper(q->qs, q, all, flags, slot, results, -1, limit);
+    }
+    if (next) {
+        prefetch_triple(q, block, b, t, next);
+    }
+
+    return 1;
+}
+
+static int triple_uses_var(rasqal_triple *t, const char *name)
+{
+    rasqal_literal *l[4] = { t->origin, t->subject, t->predicate, t->object };
+
+    for (int s=0; s<4; s++) {
+        if (l[s] && l[s]->type == RASQAL_LITERAL_VARIABLE &&
+            !strcmp((char *)l[s]->value.variable->name, name)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* if the bind for t can't be changed by joining the results of cur into b,
+ * send it now, so that the round trip overlaps with the join. This only holds
+ * when none of t's variables are bound in b, and cur doesn't mention them, so
+ * the arguments are made up of constants alone */
+static void prefetch_triple(fs_query *q, int block, fs_binding *b,
+                            rasqal_triple *cur, rasqal_triple *t)
+{
+    rasqal_literal *l[4] = { t->origin, t->subject, t->predicate, t->object };
+
+    if (q->prefetch[block]) return;
+
+    for (int s=0; s<4; s++) {
+        if (!l[s] || l[s]->type != RASQAL_LITERAL_VARIABLE) continue;
+        const char *name = (char *)l[s]->value.variable->name;
+        fs_binding *vb = fs_binding_get(b, name);
+        if (!vb || vb->bound) return;
+        if (triple_uses_var(cur, name)) return;
+    }
+
+    /* pick the same kind of bind fs_handle_query_triple() will */
+    int tobind = q->flags;
+    int all = 1;
+    int by = FS_BIND_BY_SUBJECT;
+    if (fs_opt_is_const(b, t->subject) &&
+        (fs_opt_num_vals(b, t->subject) <= fs_opt_num_vals(b, t->object) ||
+        (t->predicate->type == RASQAL_LITERAL_URI &&
+         !strcmp((char *)raptor_uri_as_string(t->predicate->value.uri), RDF_TYPE)))) {
+        tobind |= FS_BIND_SUBJECT;
+        all = 0;
+    } else if (fs_opt_is_const(b, t->object)) {
+        tobind |= FS_BIND_OBJECT;
+        by = FS_BIND_BY_OBJECT;
+    }
+
+    fs_rid_vector *slot[4];
+    for (int x=0; x<4; x++) {
+        slot[x] = fs_rid_vector_new(0);
+    }
+    char *varnames[4] = { NULL, NULL, NULL, NULL };
+    int numbindings = 0;
+    /* block -1 leaves the binding table and usage counts untouched */
+    if (!bind_pattern(q, -1, b, t, slot, varnames, &numbindings, &tobind)) {
+        q->prefetch[block] = fs_bind_prefetch_start(q->qs, q, all,
+                               tobind | by, slot, -1,
+                               q->order ? -1 : q->soft_limit);
+    }
+    for (int x=0; x<4; x++) {
+        fs_rid_vector_free(slot[x]);
+    }
+}
+
+static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t, rasqal_triple *next)
 {
     fs_rid_vector *slot[4];
     slot[0] = fs_rid_vector_new(0);
@@ -1596,15 +2096,19 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
 	    return 0;
 	}
 
-        fs_bind_cache_wrapper(q->qs, q, 0, tobind | FS_BIND_BY_SUBJECT,
-                 slot, &results, -1, q->order ? -1 : q->soft_limit);
+        const int whole = bind_with_prefetch(q, block, 0,
+                 tobind | FS_BIND_BY_SUBJECT, slot, &results, oldb, t, next);
 	if (explain) {
 	    char desc[4][DESC_SIZE];
 	    desc_action(tobind, slot, desc);
 	    printf("mmmms (%s,%s,%s,%s) -> %d\n", desc[0], desc[1], desc[2], desc[3], results ? (results[0] ? results[0]->length : -1) : -2);
 	}
 
-        ret = process_results(q, block, oldb, b, tobind, results, varnames, numbindings, slot);
+        if (whole) {
+            ret = process_results(q, block, oldb, b, tobind, results, varnames, numbindings, slot);
+        } else {
+            ret = bind_chunked(q, block, 0, tobind | FS_BIND_BY_SUBJECT, slot, oldb, b, varnames, numbindings);
+        }
         for (int x=0; x<4; x++) {
             fs_rid_vector_free(slot[x]);
         }
@@ -1630,8 +2134,8 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
 	}
 
         char *scope = NULL;
-        fs_bind_cache_wrapper(q->qs, q, 1, tobind | FS_BIND_BY_OBJECT,
-                 slot, &results, -1, q->order ? -1 : q->soft_limit);
+        const int whole = bind_with_prefetch(q, block, 1,
+                 tobind | FS_BIND_BY_OBJECT, slot, &results, oldb, t, next);
         scope = "NNNN";
 	if (explain) {
 	    char desc[4][DESC_SIZE];
@@ -1639,7 +2143,11 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
 	    printf("%so (%s,%s,%s,%s) -> %d\n", scope, desc[0], desc[1], desc[2], desc[3], results ? (results[0] ? results[0]->length : -1) : -2);
 	}
 
-	ret = process_results(q, block, oldb, b, tobind, results, varnames, numbindings, slot);
+        if (whole) {
+            ret = process_results(q, block, oldb, b, tobind, results, varnames, numbindings, slot);
+        } else {
+            ret = bind_chunked(q, block, 1, tobind | FS_BIND_BY_OBJECT, slot, oldb, b, varnames, numbindings);
+        }
         for (int x=0; x<4; x++) {
             fs_rid_vector_free(slot[x]);
         }
@@ -1662,15 +2170,19 @@ static int fs_handle_query_triple(fs_query *q, int block, rasqal_triple *t)
         return 0;
     }
 
-    fs_bind_cache_wrapper(q->qs, q, 1, tobind | FS_BIND_BY_SUBJECT,
-             slot, &results, -1, q->order ? -1 : q->soft_limit);
+    const int whole = bind_with_prefetch(q, block, 1,
+             tobind | FS_BIND_BY_SUBJECT, slot, &results, oldb, t, next);
     if (explain) {
         char desc[4][DESC_SIZE];
         desc_action(tobind, slot, desc);
         printf("nnnns (%s,%s,%s,%s) -> %d\n", desc[0], desc[1], desc[2], desc[3], results ? (results[0] ? results[0]->length : -1) : -2);
     }
 
-    ret = process_results(q, block, oldb, b, tobind, results, varnames, numbindings, slot);
+    if (whole) {
+        ret = process_results(q, block, oldb, b, tobind, results, varnames, numbindings, slot);
+    } else {
+        ret = bind_chunked(q, block, 1, tobind | FS_BIND_BY_SUBJECT, slot, oldb, b, varnames, numbindings);
+    }
     for (int x=0; x<4; x++) {
 	fs_rid_vector_free(slot[x]);
     }
@@ -1949,4 +2461,11 @@ int fs_query_errors(fs_query *q)
     return 1;
 }
 
+int fs_query_over_budget(fs_query *q)
+{
+    if (q) return q->over_budget;
+
+    return 0;
+}
+
 /* vi:set expandtab sts=4 sw=4: */
@@ -17,6 +17,8 @@ void fs_query_free(fs_query *q);
 double fs_query_start_time(fs_query *q);
 int fs_query_flags(fs_query *q);
 int fs_query_errors(fs_query *q);
+/* true if the query was stopped for using too much memory */
+int fs_query_over_budget(fs_query *q);
 int fs_bind_slot(fs_query *q, int block, fs_binding *b, 
         rasqal_literal *l, fs_rid_vector *v, int *bind, char **vname,
         int lit_allowed);
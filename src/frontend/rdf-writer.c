@@ -0,0 +1,394 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "rdf-writer.h"
+#include "outbuf.h"
+#include "common/error.h"
+#include "common/rdf-constants.h"
+
+/* the set of written statements stops growing at this many entries, 256MB
+ * of table, after that later duplicates may be written again */
+#define DEDUP_MAX (1 << 23)
+
+/* a written statement is only kept as a 128 bit fingerprint of its terms,
+ * so each entry has a fixed size however long the terms are. The chance of
+ * two different statements in one document sharing a fingerprint is too
+ * small to be worth keeping the terms to check */
+struct stmt_key {
+    uint64_t h1;
+    uint64_t h2;            /* both 0 for an empty slot */
+};
+
+struct prefix {
+    char *prefix;
+    char *uri;
+    size_t uri_length;
+};
+
+struct _fs_rdf_writer {
+    fs_rdf_syntax syntax;
+    fs_outbuf buf;
+    fs_outbuf term;         /* scratch space for one term */
+
+    /* Turtle state */
+    struct prefix *prefixes;
+    int nprefixes;
+    int started;
+    fs_outbuf subject;      /* last subject and predicate written */
+    fs_outbuf predicate;
+
+    /* open addressed set of written statements, NULL if not deduping */
+    struct stmt_key *seen;
+    size_t seen_size;
+    size_t seen_count;
+    int seen_full;
+};
+
+int fs_rdf_syntax_from_name(const char *name)
+{
+    if (!name) return -1;
+    if (!strcmp(name, "ntriples")) return FS_RDF_NTRIPLES;
+    if (!strcmp(name, "nquads")) return FS_RDF_NQUADS;
+    if (!strcmp(name, "turtle")) return FS_RDF_TURTLE;
+
+    return -1;
+}
+
+fs_rdf_writer *fs_rdf_writer_new(FILE *out, fs_rdf_syntax syntax, int dedup)
+{
+    fs_rdf_writer *w = calloc(1, sizeof(fs_rdf_writer));
+    w->syntax = syntax;
+    fs_outbuf_init(&w->buf, out);
+    fs_outbuf_init(&w->term, NULL);
+    fs_outbuf_init(&w->subject, NULL);
+    fs_outbuf_init(&w->predicate, NULL);
+    if (dedup) {
+        w->seen_size = 1024;
+        w->seen = calloc(w->seen_size, sizeof(struct stmt_key));
+    }
+
+    return w;
+}
+
+fs_rdf_syntax fs_rdf_writer_syntax(fs_rdf_writer *w)
+{
+    return w->syntax;
+}
+
+void fs_rdf_writer_prefix(fs_rdf_writer *w, const char *prefix, const char *uri)
+{
+    if (w->syntax != FS_RDF_TURTLE || w->started || !uri) return;
+
+    w->prefixes = realloc(w->prefixes, (w->nprefixes + 1) * sizeof(struct prefix));
+    struct prefix *p = w->prefixes + w->nprefixes++;
+    p->prefix = strdup(prefix ? prefix : "");
+    p->uri = strdup(uri);
+    p->uri_length = strlen(uri);
+
+    fs_outbuf_puts(&w->buf, "@prefix ");
+    fs_outbuf_puts(&w->buf, p->prefix);
+    fs_outbuf_puts(&w->buf, ": <");
+    fs_outbuf_puts(&w->buf, p->uri);
+    fs_outbuf_puts(&w->buf, "> .\n");
+}
+
+/* close any Turtle statement that's still open */
+static void turtle_end(fs_rdf_writer *w)
+{
+    if (w->subject.length) {
+        fs_outbuf_puts(&w->buf, " .\n");
+        w->subject.length = 0;
+        w->predicate.length = 0;
+    }
+}
+
+static void add_uri(fs_outbuf *b, const char *uri)
+{
+    fs_outbuf_putc(b, '<');
+    fs_outbuf_escape(b, uri, FS_ESCAPE_NT_URI);
+    fs_outbuf_putc(b, '>');
+}
+
+static void add_string(fs_outbuf *b, const char *str)
+{
+    fs_outbuf_putc(b, '"');
+    fs_outbuf_escape(b, str, FS_ESCAPE_NT_STRING);
+    fs_outbuf_putc(b, '"');
+}
+
+static void add_bnode(fs_outbuf *b, const char *label)
+{
+    fs_outbuf_add(b, "_:", 2);
+    for (const unsigned char *c = (const unsigned char *)label; *c; c++) {
+        if (((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+            (*c >= '0' && *c <= '9') || *c == '_') && *c != 'x') {
+            fs_outbuf_putc(b, *c);
+        } else {
+            /* keep labels distinct, x is its own escape */
+            char esc[4];
+            sprintf(esc, "x%02x", *c);
+            fs_outbuf_add(b, esc, 3);
+        }
+    }
+}
+
+/* true if local can be written after a prefix. This is the ASCII part of
+ * the Turtle name production, which is also a valid PN_LOCAL: it starts
+ * with a letter or _, and carries on with letters, digits, _ and -. The
+ * empty name is allowed too */
+static int local_name_ok(const char *local)
+{
+    const char *c = local;
+
+    if (*c == '\0') return 1;
+    if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || *c == '_')) {
+        return 0;
+    }
+    for (c++; *c; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') ||
+              (*c >= '0' && *c <= '9') || *c == '_' || *c == '-')) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static void add_term(fs_rdf_writer *w, fs_outbuf *b, const fs_rdf_term *t)
+{
+    switch (t->type) {
+    case FS_TYPE_URI:
+        if (w->syntax == FS_RDF_TURTLE) {
+            for (int i=0; i<w->nprefixes; i++) {
+                struct prefix *p = w->prefixes + i;
+                if (!strncmp(t->lex, p->uri, p->uri_length) &&
+                    local_name_ok(t->lex + p->uri_length)) {
+                    fs_outbuf_puts(b, p->prefix);
+                    fs_outbuf_putc(b, ':');
+                    fs_outbuf_puts(b, t->lex + p->uri_length);
+
+                    return;
+                }
+            }
+        }
+        add_uri(b, t->lex);
+        break;
+    case FS_TYPE_BNODE:
+        add_bnode(b, t->lex);
+        break;
+    case FS_TYPE_LITERAL:
+        add_string(b, t->lex);
+        if (t->lang && *t->lang) {
+            fs_outbuf_putc(b, '@');
+            fs_outbuf_puts(b, t->lang);
+        } else if (t->dt) {
+            fs_outbuf_add(b, "^^", 2);
+            fs_rdf_term dt = { FS_TYPE_URI, t->dt, NULL, NULL };
+            add_term(w, b, &dt);
+        }
+        break;
+    case FS_TYPE_NONE:
+        break;
+    }
+}
+
+/* append an encoding of t to the statement key in b, each string is
+ * tagged so that a NULL and an empty string differ, and ended by a NUL,
+ * which can't appear inside one */
+static void key_string(fs_outbuf *b, const char *str)
+{
+    if (!str) {
+        fs_outbuf_putc(b, 'N');
+
+        return;
+    }
+    fs_outbuf_putc(b, 'S');
+    fs_outbuf_add(b, str, strlen(str) + 1);
+}
+
+static void key_term(fs_outbuf *b, const fs_rdf_term *t)
+{
+    if (!t) {
+        fs_outbuf_putc(b, '-');
+
+        return;
+    }
+    fs_outbuf_putc(b, '0' + t->type);
+    key_string(b, t->lex);
+    key_string(b, t->dt);
+    key_string(b, t->lang);
+}
+
+/* returns true if the statement encoded in w->term was already in the set,
+ * adds it otherwise */
+static int seen_check(fs_rdf_writer *w)
+{
+    const unsigned char *key = (const unsigned char *) w->term.data;
+    const size_t length = w->term.length;
+
+    /* FNV-1a, and a multiply-rotate hash with unrelated constants */
+    uint64_t h1 = 0xcbf29ce484222325ULL;
+    uint64_t h2 = 0x9e3779b97f4a7c15ULL;
+    for (size_t i=0; i<length; i++) {
+        h1 = (h1 ^ key[i]) * 0x100000001b3ULL;
+        h2 = (h2 ^ key[i]) * 0xff51afd7ed558ccdULL;
+        h2 = (h2 << 31) | (h2 >> 33);
+    }
+    if (h1 == 0 && h2 == 0) h2 = 1;
+
+    size_t mask = w->seen_size - 1;
+    for (size_t pos = h1 & mask; 1; pos = (pos + 1) & mask) {
+        struct stmt_key *e = w->seen + pos;
+        if (e->h1 == 0 && e->h2 == 0) {
+            if (w->seen_count >= DEDUP_MAX) {
+                if (!w->seen_full) {
+                    fs_error(LOG_WARNING, "more than %d statements written, "
+                             "later duplicates will not be removed", DEDUP_MAX);
+                    w->seen_full = 1;
+                }
+
+                return 0;
+            }
+            e->h1 = h1;
+            e->h2 = h2;
+            w->seen_count++;
+            break;
+        }
+        if (e->h1 == h1 && e->h2 == h2) {
+            return 1;
+        }
+    }
+
+    if (w->seen_count * 2 > w->seen_size) {
+        struct stmt_key *old = w->seen;
+        size_t old_size = w->seen_size;
+        w->seen_size *= 2;
+        w->seen = calloc(w->seen_size, sizeof(struct stmt_key));
+        mask = w->seen_size - 1;
+        for (size_t i=0; i<old_size; i++) {
+            if (old[i].h1 == 0 && old[i].h2 == 0) continue;
+            size_t pos = old[i].h1 & mask;
+            while (w->seen[pos].h1 || w->seen[pos].h2) pos = (pos + 1) & mask;
+            w->seen[pos] = old[i];
+        }
+        free(old);
+    }
+
+    return 0;
+}
+
+static void turtle_statement(fs_rdf_writer *w, const fs_rdf_term *s,
+                const fs_rdf_term *p, const fs_rdf_term *o)
+{
+    w->term.length = 0;
+    add_term(w, &w->term, s);
+    if (w->subject.length == w->term.length &&
+        !memcmp(w->subject.data, w->term.data, w->term.length)) {
+        w->term.length = 0;
+        if (p->type == FS_TYPE_URI && !strcmp(p->lex, RDF_TYPE)) {
+            fs_outbuf_putc(&w->term, 'a');
+        } else {
+            add_term(w, &w->term, p);
+        }
+        if (w->predicate.length == w->term.length &&
+            !memcmp(w->predicate.data, w->term.data, w->term.length)) {
+            fs_outbuf_add(&w->buf, " ,\n        ", 11);
+        } else {
+            fs_outbuf_add(&w->buf, " ;\n    ", 7);
+            fs_outbuf_add(&w->buf, w->term.data, w->term.length);
+            fs_outbuf_putc(&w->buf, ' ');
+            w->predicate.length = 0;
+            fs_outbuf_add(&w->predicate, w->term.data, w->term.length);
+        }
+    } else {
+        turtle_end(w);
+        fs_outbuf_add(&w->buf, w->term.data, w->term.length);
+        fs_outbuf_putc(&w->buf, ' ');
+        w->subject.length = 0;
+        fs_outbuf_add(&w->subject, w->term.data, w->term.length);
+        w->term.length = 0;
+        if (p->type == FS_TYPE_URI && !strcmp(p->lex, RDF_TYPE)) {
+            fs_outbuf_putc(&w->term, 'a');
+        } else {
+            add_term(w, &w->term, p);
+        }
+        fs_outbuf_add(&w->buf, w->term.data, w->term.length);
+        fs_outbuf_putc(&w->buf, ' ');
+        w->predicate.length = 0;
+        fs_outbuf_add(&w->predicate, w->term.data, w->term.length);
+    }
+    add_term(w, &w->buf, o);
+}
+
+void fs_rdf_writer_statement(fs_rdf_writer *w, const fs_rdf_term *s,
+                const fs_rdf_term *p, const fs_rdf_term *o,
+                const fs_rdf_term *g)
+{
+    if (w->syntax != FS_RDF_NQUADS) g = NULL;
+
+    if (w->seen) {
+        w->term.length = 0;
+        key_term(&w->term, s);
+        key_term(&w->term, p);
+        key_term(&w->term, o);
+        key_term(&w->term, g);
+        if (seen_check(w)) return;
+    }
+
+    if (w->syntax == FS_RDF_TURTLE) {
+        if (!w->started && w->nprefixes) fs_outbuf_putc(&w->buf, '\n');
+        w->started = 1;
+        turtle_statement(w, s, p, o);
+    } else {
+        add_term(w, &w->buf, s);
+        fs_outbuf_putc(&w->buf, ' ');
+        add_term(w, &w->buf, p);
+        fs_outbuf_putc(&w->buf, ' ');
+        add_term(w, &w->buf, o);
+        if (g) {
+            fs_outbuf_putc(&w->buf, ' ');
+            add_term(w, &w->buf, g);
+        }
+        fs_outbuf_add(&w->buf, " .\n", 3);
+    }
+
+}
+
+void fs_rdf_writer_free(fs_rdf_writer *w)
+{
+    if (!w) return;
+
+    if (w->syntax == FS_RDF_TURTLE) turtle_end(w);
+    fs_outbuf_fini(&w->buf);
+    for (int i=0; i<w->nprefixes; i++) {
+        free(w->prefixes[i].prefix);
+        free(w->prefixes[i].uri);
+    }
+    free(w->prefixes);
+    fs_outbuf_fini(&w->term);
+    fs_outbuf_fini(&w->subject);
+    fs_outbuf_fini(&w->predicate);
+    free(w->seen);
+    free(w);
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -0,0 +1,46 @@
+#ifndef RDF_WRITER_H
+#define RDF_WRITER_H
+
+#include <stdio.h>
+
+#include "results.h"
+
+/* A streaming writer for the line based RDF syntaxes, used for CONSTRUCT and
+ * DESCRIBE output in place of a raptor serialiser. Output is collected in a
+ * buffer and written out in large blocks. */
+
+typedef enum {
+    FS_RDF_NTRIPLES,
+    FS_RDF_NQUADS,
+    FS_RDF_TURTLE
+} fs_rdf_syntax;
+
+/* a resolved term, lex of a bnode is its label without the "_:" */
+typedef struct {
+    fs_result_type type;
+    const char *lex;
+    const char *dt;
+    const char *lang;
+} fs_rdf_term;
+
+typedef struct _fs_rdf_writer fs_rdf_writer;
+
+/* returns -1 if there's no native writer for the named syntax */
+int fs_rdf_syntax_from_name(const char *name);
+
+/* if dedup is true statements that have already been written are skipped */
+fs_rdf_writer *fs_rdf_writer_new(FILE *out, fs_rdf_syntax syntax, int dedup);
+fs_rdf_syntax fs_rdf_writer_syntax(fs_rdf_writer *w);
+
+/* only has an effect in Turtle, and before the first statement */
+void fs_rdf_writer_prefix(fs_rdf_writer *w, const char *prefix, const char *uri);
+
+/* g may be NULL, and is ignored unless the syntax is N-Quads */
+void fs_rdf_writer_statement(fs_rdf_writer *w, const fs_rdf_term *s,
+                const fs_rdf_term *p, const fs_rdf_term *o,
+                const fs_rdf_term *g);
+
+/* finishes the document, flushes and frees the writer */
+void fs_rdf_writer_free(fs_rdf_writer *w);
+
+#endif
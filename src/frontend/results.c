@@ -21,16 +21,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "results.h"
 #include "query-datatypes.h"
 #include "query.h"
 #include "query-intl.h"
 #include "filter.h"
+#include "rdf-writer.h"
+#include "outbuf.h"
 #include "debug.h"
 #include "common/hash.h"
 #include "common/error.h"
 #include "common/rdf-constants.h"
+#include "common/params.h"
 
 #define CACHE_SIZE 65536
 #define CACHE_MASK (CACHE_SIZE-1)
@@ -49,6 +53,11 @@ static fs_resource res_l2_cache[CACHE_SIZE];
 
 static GHashTable *res_l1_cache = NULL;
 
+/* RIDs some thread is fetching with resolve_precache_all(), and the condition
+ * signalled when a batch lands, only used once threads are running */
+static GHashTable *res_in_flight = NULL;
+static GCond *resolve_cond = NULL;
+
 guint rid_hash(gconstpointer p)
 {
     const fs_rid *r = p;
@@ -70,6 +79,33 @@ static void setup_l1_cache(void)
     res_l1_cache = g_hash_table_new_full(rid_hash, rid_equal, NULL, NULL);
 }
 
+static void resource_free(gpointer data)
+{
+    fs_resource *res = data;
+
+    free(res->lex);
+    free(res);
+}
+
+struct _fs_resolve_prefetch {
+    GThread *thread;
+    fsp_link *link;
+    int segments;
+    int start;              /* first row of the window */
+    fs_rid_vector **rids;   /* per segment */
+    GHashTable *staged;     /* the resources, until the output reaches start */
+};
+
+/* look for rid in L1, or among the resources q fetched ahead, must hold mutex
+ * to call this function */
+static gpointer l1_lookup(fs_query *q, fs_rid rid)
+{
+    gpointer hit = g_hash_table_lookup(res_l1_cache, &rid);
+    if (hit || !q || !q->res_prefetch) return hit;
+
+    return g_hash_table_lookup(q->res_prefetch->staged, &rid);
+}
+
 static int resolve(fs_query *q, fs_rid rid, fs_resource *res)
 {
     if (rid == FS_RID_NULL) {
@@ -82,8 +118,7 @@ static int resolve(fs_query *q, fs_rid rid, fs_resource *res)
     if (FS_IS_BNODE(rid)) {
 	res->rid = rid;
 	res->attr = FS_RID_NULL;
-	res->lex = g_strdup_printf("_:b%llx", FS_BNODE_NUM(rid));
-        fs_query_add_freeable(q, res->lex);
+	res->lex = fs_query_strdup_printf(q, "_:b%llx", FS_BNODE_NUM(rid));
 
 	return 0;
     }
@@ -99,12 +134,25 @@ static int resolve(fs_query *q, fs_rid rid, fs_resource *res)
         setup_l1_cache();
     }
     gpointer hit;
-    if ((hit = g_hash_table_lookup(res_l1_cache, &rid))) {
+    if ((hit = l1_lookup(q, rid))) {
 	memcpy(res, hit, sizeof(fs_resource));
         g_static_mutex_unlock (&cache_mutex);
 
         return 0;
     }
+    /* if a batch that includes this RID is on its way, wait for it rather
+     * than asking again */
+    if (res_in_flight && g_hash_table_lookup(res_in_flight, &rid)) {
+        while (g_hash_table_lookup(res_in_flight, &rid)) {
+            g_cond_wait(resolve_cond, g_static_mutex_get_mutex(&cache_mutex));
+        }
+        if ((hit = l1_lookup(q, rid))) {
+            memcpy(res, hit, sizeof(fs_resource));
+            g_static_mutex_unlock (&cache_mutex);
+
+            return 0;
+        }
+    }
     g_static_mutex_unlock (&cache_mutex);
 
     fs_rid_vector *r = fs_rid_vector_new(1);
@@ -403,30 +451,62 @@ fs_value fs_expression_eval(fs_query *q, int row, int block, rasqal_expression *
     return fs_value_error(FS_ERROR_INVALID_TYPE, "unhandled operator");
 }
 
-static int resolve_precache_all(fsp_link *l, fs_rid_vector *rv[], int segments)
+/* resolve the RIDs in rv[] into L1, or if ahead is not NULL, into that table
+ * of resources for rows a query will output later */
+static int resolve_precache_all(fsp_link *l, fs_rid_vector *rv[], int segments, GHashTable *ahead)
 {
+    int deferred = 0;
+
     g_static_mutex_lock (&cache_mutex);
     if (!res_l1_cache) {
         setup_l1_cache();
     }
-    g_static_mutex_unlock (&cache_mutex);
+    if (!res_in_flight && g_thread_supported()) {
+        res_in_flight = g_hash_table_new(rid_hash, rid_equal);
+        resolve_cond = g_cond_new();
+    }
 
-    fs_resource *res[segments];
+    /* drop RIDs we already know, and any another thread is resolving right
+     * now - we'll wait for those below, rather than ask for them again */
+    fs_rid_vector *wait[segments];
     for (int s=0; s<segments; s++) {
         fs_rid_vector_sort(rv[s]);
         fs_rid_vector_uniq(rv[s], 0);
+        wait[s] = NULL;
+        int out = 0;
+        for (int i=0; i<rv[s]->length; i++) {
+            fs_rid rid = rv[s]->data[i];
+            if (res_l2_cache[rid & CACHE_MASK].rid == rid) continue;
+            if (g_hash_table_lookup(res_l1_cache, &rid)) continue;
+            if (res_in_flight && g_hash_table_lookup(res_in_flight, &rid)) {
+                if (!wait[s]) wait[s] = fs_rid_vector_new(0);
+                fs_rid_vector_append(wait[s], rid);
+                deferred++;
+                continue;
+            }
+            rv[s]->data[out++] = rid;
+        }
+        rv[s]->length = out;
+        if (res_in_flight) {
+            for (int i=0; i<rv[s]->length; i++) {
+                g_hash_table_insert(res_in_flight, rv[s]->data+i, rv[s]->data+i);
+            }
+        }
+    }
+    g_static_mutex_unlock (&cache_mutex);
+
+    fs_resource *res[segments];
+    for (int s=0; s<segments; s++) {
         res[s] = malloc(rv[s]->length * sizeof(fs_resource));
     }
     int ret = fsp_resolve_all(l, rv, res);
     if (ret) {
         fs_error(LOG_CRIT, "resolve_all failed");
-
-        return 1;
     }
 
     g_static_mutex_lock (&cache_mutex);
     for (int s=0; s<segments; s++) {
-        for (int i=0; i<rv[s]->length; i++) {
+        for (int i=0; !ret && i<rv[s]->length; i++) {
             if (res[s][i].rid == FS_RID_NULL) break;
             fs_rid *trid = malloc(sizeof(fs_rid));
             fs_resource *tres = malloc(sizeof(fs_resource));
@@ -434,16 +514,40 @@ static int resolve_precache_all(fsp_link *l, fs_rid_vector *rv[], int segments)
             tres->rid = res[s][i].rid;
             tres->attr = res[s][i].attr;
             tres->lex = res[s][i].lex;
-            g_hash_table_insert(res_l1_cache, trid, tres);
+            g_hash_table_insert(ahead ? ahead : res_l1_cache, trid, tres);
+        }
+        if (res_in_flight) {
+            for (int i=0; i<rv[s]->length; i++) {
+                g_hash_table_remove(res_in_flight, rv[s]->data+i);
+            }
+        }
+    }
+    if (res_in_flight) g_cond_broadcast(resolve_cond);
+
+    /* if the other thread's resolve failed or its results have since been
+     * evicted, resolve() will look them up one at a time */
+    while (deferred) {
+        deferred = 0;
+        for (int s=0; s<segments && !deferred; s++) {
+            for (int i=0; wait[s] && i<wait[s]->length; i++) {
+                if (g_hash_table_lookup(res_in_flight, wait[s]->data+i)) {
+                    deferred = 1;
+                    break;
+                }
+            }
+        }
+        if (deferred) {
+            g_cond_wait(resolve_cond, g_static_mutex_get_mutex(&cache_mutex));
         }
     }
     g_static_mutex_unlock (&cache_mutex);
 
     for (int s=0; s<segments; s++) {
         free(res[s]);
+        fs_rid_vector_free(wait[s]);
     }
 
-    return 0;
+    return ret ? 1 : 0;
 }
 
 static raptor_identifier_type slot_fill_from_rid(fs_query *q, void **data, fs_rid rid, raptor_uri **dt, const unsigned char **tag)
@@ -452,8 +556,7 @@ static raptor_identifier_type slot_fill_from_rid(fs_query *q, void **data, fs_ri
     resolve(q, rid, &r);
 
     if (FS_IS_BNODE(rid)) {
-        *data = g_strdup(r.lex+2);
-        fs_query_add_freeable(q, *data);
+        *data = fs_query_strdup(q, r.lex+2);
 
 	return RAPTOR_IDENTIFIER_TYPE_ANONYMOUS;
     } else if (FS_IS_URI(rid)) {
@@ -461,16 +564,14 @@ static raptor_identifier_type slot_fill_from_rid(fs_query *q, void **data, fs_ri
 
         return RAPTOR_IDENTIFIER_TYPE_RESOURCE;
     } else if (FS_IS_LITERAL(rid)) {
-        *data = g_strdup(r.lex);
-        fs_query_add_freeable(q, *data);
+        *data = fs_query_strdup(q, r.lex);
         if (r.attr && r.attr != FS_RID_NULL) {
             fs_resource ar;
             resolve(q, r.attr, &ar);
             if (FS_IS_URI(r.attr)) {
                 *dt = raptor_new_uri((unsigned char *)ar.lex);
             } else {
-                *tag = (unsigned char *)g_strdup(ar.lex);
-                fs_query_add_freeable(q, (void *)*tag);
+                *tag = (unsigned char *)fs_query_strdup(q, ar.lex);
             }
         }
 	return RAPTOR_IDENTIFIER_TYPE_LITERAL;
@@ -490,8 +591,7 @@ static raptor_identifier_type slot_fill(fs_query *q, void **data,
 	return RAPTOR_IDENTIFIER_TYPE_RESOURCE;
 
     case RASQAL_LITERAL_BLANK:
-        *data = g_strdup_printf("%s_%d", l->string, q->row);
-        fs_query_add_freeable(q, *data);
+        *data = fs_query_strdup_printf(q, "%s_%d", l->string, q->row);
 
 	return RAPTOR_IDENTIFIER_TYPE_ANONYMOUS;
 
@@ -587,12 +687,11 @@ static void insert_slot_fill(fs_query *q, fs_rid *rid,
         break;
 
     case RASQAL_LITERAL_BLANK:
-        res.lex = g_strdup_printf("%s_%d", l->string, q->row);
+        res.lex = fs_query_strdup_printf(q, "%s_%d", l->string, q->row);
 	/* TODO this should be a bNode, but it's tricky to summon a bNode RID
          * from here */
         res.rid = fs_hash_uri(res.lex);
         res.attr = FS_RID_NULL;
-        fs_query_add_freeable(q, res.lex);
 
 	break;
 
@@ -726,334 +825,410 @@ static int apply_constraints(fs_query *q, int row)
     return 1;
 }
 
-static int uri_needs_escape(const char *str, int *escaped_length)
+/* fill t from a RID, returns 0 if it can't be written */
+static int term_from_rid(fs_query *q, fs_rdf_term *t, fs_rid rid)
 {
-    int esc_len = 0;
-    int escape = 0;
-
-    if (!str) return 0;
-
-    for (const char *c = str; *c; c++) {
-        switch (*c) {
-        case ' ':
-        case '\t':
-        case '\r':
-        case '\n':
-        case '<':
-        case '>':
-            esc_len += 3;
-            escape = 1;
-            break;
-        default:
-            esc_len += 1;
+    fs_resource r;
+    resolve(q, rid, &r);
+
+    t->dt = NULL;
+    t->lang = NULL;
+    if (FS_IS_BNODE(rid)) {
+        t->type = FS_TYPE_BNODE;
+        t->lex = r.lex + 2;
+    } else if (FS_IS_URI(rid)) {
+        t->type = FS_TYPE_URI;
+        t->lex = r.lex;
+    } else {
+        t->type = FS_TYPE_LITERAL;
+        t->lex = r.lex;
+        if (r.attr && r.attr != FS_RID_NULL) {
+            fs_resource ar;
+            resolve(q, r.attr, &ar);
+            if (FS_IS_URI(r.attr)) {
+                t->dt = ar.lex;
+            } else {
+                t->lang = ar.lex;
+            }
         }
     }
-    *escaped_length = esc_len;
 
-    return escape;
+    return t->lex != NULL;
 }
 
-static char *uri_escape(const char *str, int length)
+/* as slot_fill(), but for the native writer */
+static int term_fill(fs_query *q, fs_rdf_term *t, rasqal_literal *l, fs_row *row)
 {
-    char *to = malloc(length+1);
-    char *outp = to;
-
-    for (const char *inp = str; *inp; inp++) {
-        switch (*inp) {
-        case ' ':
-            *outp++ = '%';
-            *outp++ = '2';
-            *outp++ = '0';
-            break;
-        case '\t':
-            *outp++ = '%';
-            *outp++ = '0';
-            *outp++ = '9';
-            break;
-        case '\n':
-            *outp++ = '%';
-            *outp++ = '0';
-            *outp++ = 'A';
-            break;
-        case '\r':
-            *outp++ = '%';
-            *outp++ = '0';
-            *outp++ = 'D';
-            break;
-        case '<':
-            *outp++ = '%';
-            *outp++ = '3';
-            *outp++ = 'C';
-            break;
-        case '>':
-            *outp++ = '%';
-            *outp++ = '3';
-            *outp++ = 'E';
-            break;
-        default:
-            *outp++ = *inp;
-            break;
+    t->lex = NULL;
+    t->dt = NULL;
+    t->lang = NULL;
+    t->type = FS_TYPE_LITERAL;
+
+    switch (l->type) {
+    case RASQAL_LITERAL_URI:
+        t->type = FS_TYPE_URI;
+        t->lex = (const char *)raptor_uri_as_string(l->value.uri);
+        break;
+
+    case RASQAL_LITERAL_BLANK:
+        t->type = FS_TYPE_BNODE;
+        t->lex = fs_query_strdup_printf(q, "%s_%d", l->string, q->row);
+        break;
+
+#if RASQAL_VERSION >= 917
+    case RASQAL_LITERAL_XSD_STRING:
+    case RASQAL_LITERAL_UDT:
+#endif
+    case RASQAL_LITERAL_STRING:
+    case RASQAL_LITERAL_BOOLEAN:
+        t->lex = (const char *)l->string;
+        t->lang = l->language;
+        if (l->datatype) {
+            t->dt = (const char *)raptor_uri_as_string(l->datatype);
         }
-    }
-    *outp = '\0';
+        break;
 
-    return to;
-}
+    case RASQAL_LITERAL_INTEGER:
+        t->lex = (const char *)l->string;
+        t->dt = XSD_INTEGER;
+        break;
 
-static int tsv_needs_escape(const char *str, int *escaped_length)
-{
-    int esc_len = 0;
-    int escape = 0;
-
-    if (!str) return 0;
-
-    for (const char *c = str; *c; c++) {
-        switch (*c) {
-        case '\\':
-        case '\t':
-        case '\r':
-        case '\n':
-        case '"':
-            esc_len += 2;
-            escape = 1;
+    case RASQAL_LITERAL_DECIMAL:
+        t->lex = (const char *)l->string;
+        t->dt = XSD_DECIMAL;
+        break;
+
+    case RASQAL_LITERAL_DOUBLE:
+    case RASQAL_LITERAL_FLOAT:
+        t->lex = (const char *)l->string;
+        t->dt = XSD_DOUBLE;
+        break;
+
+    case RASQAL_LITERAL_DATETIME:
+        t->lex = (const char *)l->string;
+        t->dt = XSD_DATETIME;
+        break;
+
+    case RASQAL_LITERAL_VARIABLE:
+        for (int col=0; row && row[col].name; col++) {
+            if (strcmp((char *)l->value.variable->name, row[col].name)) {
+                continue;
+            }
+            if (row[col].rid == FS_RID_NULL) break;
+            t->type = row[col].type;
+            t->lex = row[col].lex;
+            if (t->type == FS_TYPE_BNODE) {
+                t->lex += 2;
+            } else if (t->type == FS_TYPE_LITERAL) {
+                t->dt = row[col].dt;
+                t->lang = row[col].lang;
+            }
             break;
-        default:
-            esc_len += 1;
         }
+        break;
+
+    /* this should never happen */
+    case RASQAL_LITERAL_PATTERN:
+    case RASQAL_LITERAL_QNAME:
+    case RASQAL_LITERAL_UNKNOWN:
+	break;
     }
-    *escaped_length = esc_len;
 
-    return escape;
+    return t->lex != NULL && t->type != FS_TYPE_NONE;
 }
 
-static char *tsv_escape(const char *str, int length)
+static fs_rdf_writer *rdf_writer_start(fs_query *q, fs_rdf_syntax syntax, FILE *output)
 {
-    char *to = malloc(length+1);
-    char *outp = to;
-
-    for (const char *inp = str; *inp; inp++) {
-        switch (*inp) {
-        case '\t':
-            *outp++ = '\\';
-            *outp++ = 't';
-            break;
-        case '\r':
-            *outp++ = '\\';
-            *outp++ = 'r';
-            break;
-        case '\n':
-            *outp++ = '\\';
-            *outp++ = 'n';
-            break;
-        case '\\':
-        case '"':
-            *outp++ = '\\';
-            *outp++ = *inp;
-            break;
-        default:
-            *outp++ = *inp;
-            break;
-        }
+    fs_rdf_writer *w = fs_rdf_writer_new(output, syntax, 1);
+    for (int i=0; 1; i++) {
+        rasqal_prefix *p = rasqal_query_get_prefix(q->rq, i);
+        if (!p) break;
+        fs_rdf_writer_prefix(w, (const char *)p->prefix,
+                             (const char *)raptor_uri_as_string(p->uri));
     }
-    *outp = '\0';
 
-    return to;
+    return w;
 }
 
-static int json_needs_escape(const char *str, int *escaped_length)
+/* the RID a DESCRIBE term stands for in row, or FS_RID_NULL */
+static fs_rid describe_rid(rasqal_literal *l, fs_row *row)
 {
-    int esc_len = 0;
-    int escape = 0;
-
-    if (!str) return 0;
-
-    for (const char *c = str; *c; c++) {
-        switch (*c) {
-        case '\\':
-        case '\t':
-        case '\r':
-        case '\n':
-        case '"':
-            esc_len += 2;
-            escape = 1;
-            break;
-        default:
-            esc_len += 1;
+    if (l->type == RASQAL_LITERAL_URI) {
+        return fs_hash_uri((char *)raptor_uri_as_string(l->value.uri));
+    }
+    for (int col=0; row && row[col].name; col++) {
+        if (!strcmp((char *)l->value.variable->name, row[col].name)) {
+            if (FS_IS_LITERAL(row[col].rid)) return FS_RID_NULL;
+
+            return row[col].rid;
         }
     }
-    *escaped_length = esc_len;
 
-    return escape;
+    return FS_RID_NULL;
 }
 
-static char *json_escape(const char *str, int length)
+/* the position of rid in the sorted vector v, or -1 */
+static int describe_index(const fs_rid_vector *v, fs_rid rid)
 {
-    char *to = malloc(length+1);
-    char *outp = to;
-
-    for (const char *inp = str; *inp; inp++) {
-        switch (*inp) {
-        case '\t':
-            *outp++ = '\\';
-            *outp++ = 't';
-            break;
-        case '\r':
-            *outp++ = '\\';
-            *outp++ = 'r';
-            break;
-        case '\n':
-            *outp++ = '\\';
-            *outp++ = 'n';
-            break;
-        case '\\':
-        case '"':
-            *outp++ = '\\';
-            *outp++ = *inp;
-            break;
-        default:
-            *outp++ = *inp;
-            break;
+    int lo = 0, hi = v->length - 1;
+
+    while (lo <= hi) {
+        const int mid = (lo + hi) / 2;
+        if (v->data[mid] < rid) {
+            lo = mid + 1;
+        } else if (v->data[mid] > rid) {
+            hi = mid - 1;
+        } else {
+            return mid;
         }
     }
-    *outp = '\0';
 
-    return to;
+    return -1;
 }
 
-static int xml_needs_escape(const char *str, int *escaped_length)
+static void describe_append_row(fs_rid_vector **to, fs_rid_vector **from,
+                                int cols, int row)
 {
-    int esc_len = 0;
-    int escape = 0;
-
-    if (!str) return 0;
-
-    for (const char *c = str; *c; c++) {
-	switch (*c) {
-	    case '<':
-		esc_len += 4;
-		escape = 1;
-		break;
-	    case '>':
-		esc_len += 4;
-		escape = 1;
-		break;
-	    case '&':
-		esc_len += 5;
-		escape = 1;
-		break;
-	    default:
-		esc_len++;
-		break;
-	}
+    for (int col=0; col<cols; col++) {
+        fs_rid_vector_append(to[col], from[col]->data[row]);
     }
-
-    *escaped_length = esc_len;
-
-    return escape;
 }
 
-static char *xml_escape(const char *from, int len)
+/* fetch the arcs of the resources in chunk, which must be sorted and unique,
+ * by subject for outbound arcs or by object for inbound ones. The soft
+ * limit applies to each resource, as it did when they were described one at
+ * a time */
+static fs_rid_vector **describe_bind(fs_query *q, fs_rid_vector *chunk,
+                                     int by, int g)
 {
-    char *to = malloc(len+1);
-    char *outp = to;
-
-    for (const char *inp = from; *inp; inp++) {
-	switch (*inp) {
-	    case '<':
-		strcpy(outp, "&lt;");
-		outp += 4;
-		break;
-	    case '>':
-		strcpy(outp, "&gt;");
-		outp += 4;
-		break;
-	    case '&':
-		strcpy(outp, "&amp;");
-		outp += 5;
-		break;
-	    default:
-		*outp++ = *inp;
-		break;
-	}
+    const int flags = by | FS_BIND_SUBJECT | FS_BIND_PREDICATE |
+                      FS_BIND_OBJECT | (g ? FS_BIND_MODEL : 0);
+    const int cols = 3 + g;
+    const int key = by == FS_BIND_BY_SUBJECT ? g : g + 2;
+
+    int limit = -1;
+    if (q->soft_limit > 0) {
+        long long l = (long long)q->soft_limit * chunk->length;
+        limit = l > INT_MAX ? INT_MAX : l;
     }
 
-    *outp++ = '\0';
+    fs_rid_vector *ms = fs_rid_vector_new(0);
+    fs_rid_vector *ps = fs_rid_vector_new(0);
+    fs_rid_vector *empty = fs_rid_vector_new(0);
+    fs_rid_vector **result = NULL;
+    fsp_bind_limit_many(q->link, flags, ms,
+        by == FS_BIND_BY_SUBJECT ? chunk : empty, ps,
+        by == FS_BIND_BY_OBJECT ? chunk : empty, &result, 0, limit);
+    if (!result || limit < 0) {
+        fs_rid_vector_free(ms);
+        fs_rid_vector_free(ps);
+        fs_rid_vector_free(empty);
+
+        return result;
+    }
+
+    /* the bind's limit was shared by the whole chunk, so cut each resource
+     * back to its own share. If the bind hit the limit, a resource with less
+     * than its share may have lost arcs to the others, so those are fetched
+     * again one at a time */
+    const int truncated = result[0]->length >= limit;
+    int *total = calloc(chunk->length * 2, sizeof(int));
+    int *kept = total + chunk->length;
+    for (int row=0; row<result[0]->length; row++) {
+        const int i = describe_index(chunk, result[key]->data[row]);
+        if (i >= 0) total[i]++;
+    }
+    fs_rid_vector **out = calloc(cols, sizeof(fs_rid_vector *));
+    for (int col=0; col<cols; col++) {
+        out[col] = fs_rid_vector_new(0);
+    }
+    for (int row=0; row<result[0]->length; row++) {
+        const int i = describe_index(chunk, result[key]->data[row]);
+        if (i < 0 || kept[i] == q->soft_limit) continue;
+        if (truncated && total[i] < q->soft_limit) continue;
+        kept[i]++;
+        describe_append_row(out, result, cols, row);
+    }
+    for (int i=0; truncated && i<chunk->length; i++) {
+        if (total[i] >= q->soft_limit) continue;
+        fs_rid_vector one = { .length = 1, .size = 1, .data = chunk->data + i };
+        fs_rid_vector **single = NULL;
+        fsp_bind_limit_many(q->link, flags, ms,
+            by == FS_BIND_BY_SUBJECT ? &one : empty, ps,
+            by == FS_BIND_BY_OBJECT ? &one : empty, &single, 0, q->soft_limit);
+        if (!single) continue;
+        for (int row=0; row<single[0]->length; row++) {
+            describe_append_row(out, single, cols, row);
+        }
+        for (int col=0; col<cols; col++) {
+            fs_rid_vector_free(single[col]);
+        }
+        free(single);
+    }
+    for (int col=0; col<cols; col++) {
+        fs_rid_vector_free(result[col]);
+    }
+    free(result);
+    free(total);
+    fs_rid_vector_free(ms);
+    fs_rid_vector_free(ps);
+    fs_rid_vector_free(empty);
 
-    return to;
+    return out;
 }
 
-static void describe_uri(fs_query *q, fs_rid rid, raptor_uri *uri)
+/* serialise the arcs of the resources in chunk, a slice of ss, in one
+ * direction. Their lexical forms are fetched in one resolve per segment */
+static void describe_chunk(fs_query *q, fs_rid_vector *ss, fs_rid_vector *chunk,
+                           int by, int g, fs_rdf_writer *w)
 {
-    if (rid == FS_RID_NULL) {
-        rid = fs_hash_uri((char *)raptor_uri_as_string(uri));
+    fs_rid_vector **result = describe_bind(q, chunk, by, g);
+    if (!result) return;
+
+    fs_rid_vector *pending[q->segments];
+    for (int s=0; s<q->segments; s++) {
+        pending[s] = fs_rid_vector_new(0);
+    }
+    for (int col=0; col<3+g; col++) {
+        for (int row=0; row<result[col]->length; row++) {
+            fs_rid rid = result[col]->data[row];
+            if (FS_IS_BNODE(rid)) continue;
+            fs_rid_vector_append(pending[FS_RID_SEGMENT(rid, q->segments)], rid);
+        }
     }
-    raptor_statement st;
-    fs_rid_vector *ms = fs_rid_vector_new(0);
-    fs_rid_vector *ss = fs_rid_vector_new_from_args(1, rid);
-    fs_rid_vector *ps = fs_rid_vector_new(0);
-    fs_rid_vector *os = fs_rid_vector_new(0);
-    fs_rid_vector **result = NULL;
-    fsp_bind_limit(q->link, FS_RID_SEGMENT(rid, q->segments),
-        FS_BIND_BY_SUBJECT | FS_BIND_PREDICATE | FS_BIND_OBJECT, ms, ss,
-        ps, os, &result, 0, q->soft_limit);
-    st.object_literal_datatype = NULL;
-    st.object_literal_language = NULL;
-    st.subject = uri;
-    if (FS_IS_BNODE(rid)) {
-        st.subject_type = RAPTOR_IDENTIFIER_TYPE_ANONYMOUS;
-    } else {
-        st.subject_type = RAPTOR_IDENTIFIER_TYPE_RESOURCE;
+    resolve_precache_all(q->link, pending, q->segments, NULL);
+    for (int s=0; s<q->segments; s++) {
+        fs_rid_vector_free(pending[s]);
     }
+
     for (int row = 0; row < result[0]->length; row++) {
-        st.predicate_type = slot_fill_from_rid(q, (void **)&(st.predicate), result[0]->data[row], NULL, NULL);
-        st.object_type = slot_fill_from_rid(q, (void **)&(st.object), result[1]->data[row], &(st.object_literal_datatype), &(st.object_literal_language));
-        raptor_serialize_statement(q->ser, &st);
+        /* arcs between two described resources are written as outbound */
+        if (by == FS_BIND_BY_OBJECT &&
+            describe_index(ss, result[g]->data[row]) >= 0) {
+            continue;
+        }
+        if (w) {
+            fs_rdf_term t[4];
+            if (g && !term_from_rid(q, t+3, result[0]->data[row])) continue;
+            if (term_from_rid(q, t, result[g]->data[row]) &&
+                term_from_rid(q, t+1, result[g+1]->data[row]) &&
+                term_from_rid(q, t+2, result[g+2]->data[row])) {
+                fs_rdf_writer_statement(w, t, t+1, t+2, g ? t+3 : NULL);
+            }
+        } else {
+            raptor_statement st;
+            st.object_literal_datatype = NULL;
+            st.object_literal_language = NULL;
+            st.subject_type = slot_fill_from_rid(q, (void **)&(st.subject), result[0]->data[row], NULL, NULL);
+            st.predicate_type = slot_fill_from_rid(q, (void **)&(st.predicate), result[1]->data[row], NULL, NULL);
+            st.object_type = slot_fill_from_rid(q, (void **)&(st.object), result[2]->data[row], &(st.object_literal_datatype), &(st.object_literal_language));
+            raptor_serialize_statement(q->ser, &st);
+        }
+    }
+    for (int col=0; col<3+g; col++) {
+        fs_rid_vector_free(result[col]);
+    }
+    free(result);
+}
+
+/* serialise the outbound and then the inbound arcs of all the resources in
+ * ss, which must be sorted and unique, with one bind per chunk of resources
+ * in each direction */
+static void describe_rids(fs_query *q, fs_rid_vector *ss, fs_rdf_writer *w)
+{
+    /* N-Quads output needs the graph as well */
+    const int g = w && fs_rdf_writer_syntax(w) == FS_RDF_NQUADS ? 1 : 0;
+    const int by[2] = { FS_BIND_BY_SUBJECT, FS_BIND_BY_OBJECT };
+
+    for (int d=0; d<2; d++) {
+        for (int start=0; start < ss->length; start += FS_BIND_CHUNK_SIZE) {
+            int len = ss->length - start;
+            if (len > FS_BIND_CHUNK_SIZE) len = FS_BIND_CHUNK_SIZE;
+            fs_rid_vector chunk = { .length = len, .size = len,
+                                    .data = ss->data + start };
+            describe_chunk(q, ss, &chunk, by[d], g, w);
+        }
     }
 }
 
 static void handle_describe(fs_query *q, const char *type, FILE *output)
 {
 #if RASQAL_VERSION >= 917
-    q->ser = raptor_new_serializer(type);
-    for (int i=0; 1; i++) {
-        rasqal_prefix *p = rasqal_query_get_prefix(q->rq, i);
-        if (!p) break;
-        raptor_serialize_set_namespace(q->ser, p->uri, p->prefix);
+    fs_rdf_writer *w = NULL;
+    const int syntax = fs_rdf_syntax_from_name(type);
+    if (syntax >= 0) {
+        w = rdf_writer_start(q, syntax, output);
+    } else {
+        q->ser = raptor_new_serializer(type);
+        for (int i=0; 1; i++) {
+            rasqal_prefix *p = rasqal_query_get_prefix(q->rq, i);
+            if (!p) break;
+            raptor_serialize_set_namespace(q->ser, p->uri, p->prefix);
+        }
+        raptor_serialize_start_to_file_handle(q->ser, q->base, output);
     }
-    raptor_serialize_start_to_file_handle(q->ser, q->base, output);
 
+    /* gather every resource to be described, then fetch them together */
+    fs_rid_vector *ss = fs_rid_vector_new(0);
     fs_p_vector *vars = fs_p_vector_new(0);
     raptor_sequence *desc = rasqal_query_get_describe_sequence(q->rq);
     for (int i=0; 1; i++) {
         rasqal_literal *l = raptor_sequence_get_at(desc, i);
         if (!l) break;
         if (l->type == RASQAL_LITERAL_URI) {
-            describe_uri(q, FS_RID_NULL, l->value.uri);
+            fs_rid_vector_append(ss, describe_rid(l, NULL));
         } else if (l->type == RASQAL_LITERAL_VARIABLE) {
             fs_p_vector_append(vars, l);
         }
     }
 
     fs_row *row;
-    while ((row = fs_query_fetch_row(q))) {
+    while (vars->length && (row = fs_query_fetch_row(q))) {
         for (int i=0; i<vars->length; i++) {
-            raptor_uri *duri;
-            slot_fill(q, (void **)&duri, vars->data[i], row, NULL);
-            describe_uri(q, row[i].rid, duri);
+            fs_rid rid = describe_rid(vars->data[i], row);
+            if (rid != FS_RID_NULL) fs_rid_vector_append(ss, rid);
         }
     }
-    raptor_serialize_end(q->ser);
-    raptor_free_serializer(q->ser);
+    fs_rid_vector_sort(ss);
+    fs_rid_vector_uniq(ss, 0);
+    describe_rids(q, ss, w);
+
+    if (w) {
+        fs_rdf_writer_free(w);
+    } else {
+        raptor_serialize_end(q->ser);
+        raptor_free_serializer(q->ser);
+    }
+    fs_rid_vector_free(ss);
     fs_p_vector_free(vars);
 #else
     fprintf(output, "<?xml version=\"1.0\"?>\n<rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\"><!-- sorry, DESCRIBE is not supported by this version of rasqal --></rdf:RDF>\n");
 #endif
 }
 
+/* write the CONSTRUCT template for one row with the native writer */
+static void construct_row(fs_query *q, fs_rdf_writer *w, fs_row *row)
+{
+    for (int i=0; 1; i++) {
+        rasqal_triple *trip = rasqal_query_get_construct_triple(q->rq, i);
+        if (!trip) break;
+
+        fs_rdf_term s, p, o;
+        if (term_fill(q, &s, trip->subject, row) &&
+            term_fill(q, &p, trip->predicate, row) &&
+            term_fill(q, &o, trip->object, row) &&
+            s.type != FS_TYPE_LITERAL && p.type == FS_TYPE_URI) {
+            fs_rdf_writer_statement(w, &s, &p, &o, NULL);
+        }
+    }
+}
+
 static void handle_construct(fs_query *q, const char *type, FILE *output)
 {
     const int cols = fs_query_get_columns(q);
     fs_row *row;
+    fs_rdf_writer *w = NULL;
+    const int syntax = fs_rdf_syntax_from_name(type);
     fs_rid quad[4] = { FS_RID_NULL, FS_RID_NULL, FS_RID_NULL,
                        FS_RID_NULL };
 
@@ -1068,6 +1243,8 @@ static void handle_construct(fs_query *q, const char *type, FILE *output)
         fs_rid_vector *models = fs_rid_vector_new(1);
         models->data[0] = quad[0];
         fsp_new_model_all(q->link, models);
+    } else if (syntax >= 0) {
+        w = rdf_writer_start(q, syntax, output);
     } else {
         q->ser = raptor_new_serializer(type);
         for (int i=0; 1; i++) {
@@ -1091,6 +1268,8 @@ static void handle_construct(fs_query *q, const char *type, FILE *output)
                 insert_slot_fill(q, quad+3, trip->object, row);
                 fsp_quad_import(q->link, FS_RID_SEGMENT(quad[1], q->segments), FS_BIND_BY_SUBJECT, 1, &quad);
             }
+        } else if (w) {
+            construct_row(q, w, row);
         } else {
             raptor_statement st;
             st.object_literal_datatype = NULL;
@@ -1133,6 +1312,8 @@ static void handle_construct(fs_query *q, const char *type, FILE *output)
                 insert_slot_fill(q, quad+3, trip->object, row);
                 fsp_quad_import(q->link, FS_RID_SEGMENT(quad[1], q->segments), FS_BIND_BY_SUBJECT, 1, &quad);
             }
+        } else if (w) {
+            construct_row(q, w, row);
         } else {
             raptor_statement st;
             st.object_literal_datatype = NULL;
@@ -1168,6 +1349,8 @@ static void handle_construct(fs_query *q, const char *type, FILE *output)
             fsp_quad_import_commit(q->link, s, FS_BIND_BY_SUBJECT);
         }
         fsp_stop_import_all(q->link);
+    } else if (w) {
+        fs_rdf_writer_free(w);
     } else {
         raptor_serialize_end(q->ser);
         raptor_free_serializer(q->ser);
@@ -1194,26 +1377,25 @@ static void output_sparql(fs_query *q, int flags, FILE *out)
         handle_describe(q, "rdfxml", out);
     } else {
 	/* XML output */
+        fs_outbuf ob;
+        fs_outbuf_init(&ob, out);
 
-	fprintf(out, "<?xml version=\"1.0\"?>\n"
+	fs_outbuf_puts(&ob, "<?xml version=\"1.0\"?>\n"
 		"<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n");
 	row = fs_query_fetch_header_row(q);
-	fprintf(out, "  <head>\n");
+	fs_outbuf_puts(&ob, "  <head>\n");
 	for (int c=0; c<cols; c++) {
-	    fprintf(out, "    <variable name=\"%s\"/>\n", row[c].name);
+	    fs_outbuf_puts(&ob, "    <variable name=\"");
+	    fs_outbuf_puts(&ob, row[c].name);
+	    fs_outbuf_puts(&ob, "\"/>\n");
 	}
-	fprintf(out, "  </head>\n");
+	fs_outbuf_puts(&ob, "  </head>\n");
         if (q->warnings) {
             GSList *it;
             for (it = q->warnings; it; it = it->next) {
-                int esc_len;
-		if (xml_needs_escape(it->data, &esc_len)) {
-		    char *lex = xml_escape(it->data, esc_len);
-                    fprintf(out, "<!-- %s -->\n", lex);
-                    free(lex);
-                } else {
-                    fprintf(out, "<!-- %s -->\n", (char *)it->data);
-                }
+                fs_outbuf_puts(&ob, "<!-- ");
+                fs_outbuf_escape(&ob, it->data, FS_ESCAPE_XML);
+                fs_outbuf_puts(&ob, " -->\n");
             }
             g_slist_free(q->warnings);
             q->warnings = NULL;
@@ -1221,52 +1403,52 @@ static void output_sparql(fs_query *q, int flags, FILE *out)
         if (q->ask) {
             while (q->boolean && fs_query_fetch_row(q));
             if (q->boolean) {
-                fprintf(out, "  <boolean>true</boolean>\n");
+                fs_outbuf_puts(&ob, "  <boolean>true</boolean>\n");
             } else {
-                fprintf(out, "  <boolean>false</boolean>\n");
+                fs_outbuf_puts(&ob, "  <boolean>false</boolean>\n");
             }
         } else {
-            fprintf(out, "  <results>\n");
+            fs_outbuf_puts(&ob, "  <results>\n");
             while ((row = fs_query_fetch_row(q))) {
-                fprintf(out, "    <result>\n");
+                fs_outbuf_puts(&ob, "    <result>\n");
                 for (int c=0; c<cols; c++) {
-                    int esc_len;
-                    char *lex;
-                    int need_free = 0;
-                    if (xml_needs_escape(row[c].lex, &esc_len)) {
-                        lex = xml_escape(row[c].lex, esc_len);
-                        need_free = 1;
-                    } else {
-                        lex = (char *)row[c].lex;
-                    }
                     if (row[c].type == FS_TYPE_NONE) continue;
-                    fprintf(out, "      <binding name=\"%s\">", row[c].name);
+                    fs_outbuf_puts(&ob, "      <binding name=\"");
+                    fs_outbuf_puts(&ob, row[c].name);
+                    fs_outbuf_puts(&ob, "\">");
                     switch (row[c].type) {
                         case FS_TYPE_NONE:
                             break;
                         case FS_TYPE_URI:
-                            fprintf(out, "<uri>%s</uri>", lex);
+                            fs_outbuf_puts(&ob, "<uri>");
+                            fs_outbuf_escape(&ob, row[c].lex, FS_ESCAPE_XML);
+                            fs_outbuf_puts(&ob, "</uri>");
                             break;
                         case FS_TYPE_LITERAL:
                             if (row[c].lang) {
-                                fprintf(out, "<literal xml:lang=\"%s\">%s</literal>", row[c].lang, lex);
+                                fs_outbuf_puts(&ob, "<literal xml:lang=\"");
+                                fs_outbuf_puts(&ob, row[c].lang);
+                                fs_outbuf_puts(&ob, "\">");
                             } else if (row[c].dt) {
-                                fprintf(out, "<literal datatype=\"%s\">%s</literal>", row[c].dt, lex);
+                                fs_outbuf_puts(&ob, "<literal datatype=\"");
+                                fs_outbuf_puts(&ob, row[c].dt);
+                                fs_outbuf_puts(&ob, "\">");
                             } else {
-                                fprintf(out, "<literal>%s</literal>", lex);
+                                fs_outbuf_puts(&ob, "<literal>");
                             }
+                            fs_outbuf_escape(&ob, row[c].lex, FS_ESCAPE_XML);
+                            fs_outbuf_puts(&ob, "</literal>");
                             break;
                         case FS_TYPE_BNODE:
-                            fprintf(out, "<bnode>%s</bnode>", lex+2);
-                    }
-                    fprintf(out, "</binding>\n");
-                    if (need_free) {
-                        free(lex);
+                            fs_outbuf_puts(&ob, "<bnode>");
+                            fs_outbuf_escape(&ob, row[c].lex+2, FS_ESCAPE_XML);
+                            fs_outbuf_puts(&ob, "</bnode>");
                     }
+                    fs_outbuf_puts(&ob, "</binding>\n");
                 }
-                fprintf(out, "    </result>\n");
+                fs_outbuf_puts(&ob, "    </result>\n");
             }
-            fprintf(out, "  </results>\n");
+            fs_outbuf_puts(&ob, "  </results>\n");
         }
         if (q->warnings) {
             GSList *it;
@@ -1274,17 +1456,13 @@ static void output_sparql(fs_query *q, int flags, FILE *out)
             for (it = q->warnings; it; it = it->next) {
                 if (it->data == last) continue;
                 last = it->data;
-                int esc_len;
-                if (xml_needs_escape(it->data, &esc_len)) {
-                    char *lex = xml_escape(it->data, esc_len);
-                    fprintf(out, "<!-- warning: %s -->\n", lex);
-                    free(lex);
-                } else {
-                    fprintf(out, "<!-- warning: %s -->\n", (char *)it->data);
-                }
+                fs_outbuf_puts(&ob, "<!-- warning: ");
+                fs_outbuf_escape(&ob, it->data, FS_ESCAPE_XML);
+                fs_outbuf_puts(&ob, " -->\n");
             }
         }
-	fprintf(out, "</sparql>\n");
+	fs_outbuf_puts(&ob, "</sparql>\n");
+        fs_outbuf_fini(&ob);
     }
 }
 
@@ -1328,44 +1506,40 @@ static void output_text(fs_query *q, int flags, FILE *out)
     if (q->construct) {
         handle_construct(q, "ntriples", out);
     } else {
+        fs_outbuf ob;
+        fs_outbuf_init(&ob, out);
 	while ((row = fs_query_fetch_row(q))) {
 	    for (int c=0; c<cols; c++) {
-		int esclen = 0;
-		char *escd = NULL;
-		const char *lex = row[c].lex;
-		if (c) fputc('\t', out);
+		if (c) fs_outbuf_putc(&ob, '\t');
 		switch (row[c].type) {
 		    case FS_TYPE_NONE:
-			fprintf(out, "NULL");
+			fs_outbuf_add(&ob, "NULL", 4);
 			break;
 		    case FS_TYPE_URI:
-                        if (uri_needs_escape(row[c].lex, &esclen)) {
-                            escd = uri_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
-			fprintf(out, "<%s>", lex);
-                        if (escd) free(escd);
+			fs_outbuf_putc(&ob, '<');
+			fs_outbuf_escape(&ob, row[c].lex, FS_ESCAPE_URI);
+			fs_outbuf_putc(&ob, '>');
 			break;
 		    case FS_TYPE_LITERAL:
-                        if (tsv_needs_escape(row[c].lex, &esclen)) {
-                            escd = tsv_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
+			fs_outbuf_putc(&ob, '"');
+			fs_outbuf_escape(&ob, row[c].lex, FS_ESCAPE_TSV);
+			fs_outbuf_putc(&ob, '"');
                         if (row[c].lang) {
-			    fprintf(out, "\"%s\"@%s", lex, row[c].lang);
+			    fs_outbuf_putc(&ob, '@');
+			    fs_outbuf_puts(&ob, row[c].lang);
                         } else if (row[c].dt) {
-			    fprintf(out, "\"%s\"^^<%s>", lex, row[c].dt);
-                        } else {
-			    fprintf(out, "\"%s\"", lex);
+			    fs_outbuf_add(&ob, "^^<", 3);
+			    fs_outbuf_puts(&ob, row[c].dt);
+			    fs_outbuf_putc(&ob, '>');
                         }
-                        if (escd) free(escd);
 			break;
 		    case FS_TYPE_BNODE:
-			fprintf(out, "%s", row[c].lex);
+			fs_outbuf_puts(&ob, row[c].lex);
 		}
 	    }
-	    fprintf(out, "\n");
+	    fs_outbuf_putc(&ob, '\n');
 	}
+        fs_outbuf_fini(&ob);
     }
 
     if (q->warnings) {
@@ -1417,102 +1591,99 @@ static void output_json(fs_query *q, int flags, FILE *out)
     }
 
     const int cols = fs_query_get_columns(q);
+    fs_outbuf ob;
+    fs_outbuf_init(&ob, out);
 
     fs_row *header = fs_query_fetch_header_row(q);
-    fprintf(out, "{\"head\":{\"vars\":[");
+    fs_outbuf_puts(&ob, "{\"head\":{\"vars\":[");
     for (int i=0; i<cols; i++) {
-        if (i) fputs(",", out);
-        fprintf(out, "\"%s\"", header[i].name);
+        if (i) fs_outbuf_putc(&ob, ',');
+        fs_outbuf_putc(&ob, '"');
+        fs_outbuf_puts(&ob, header[i].name);
+        fs_outbuf_putc(&ob, '"');
     }
-    fprintf(out, "]},\n");
+    fs_outbuf_puts(&ob, "]},\n");
 
-    fprintf(out, " \"results\": {\n");
-    fprintf(out, "  \"bindings\":[");
+    fs_outbuf_puts(&ob, " \"results\": {\n");
+    fs_outbuf_puts(&ob, "  \"bindings\":[");
     if (q->ask) {
         while (q->boolean && fs_query_fetch_row(q));
         if (q->boolean) {
-            fprintf(out, "{\"boolean\": true}");
+            fs_outbuf_puts(&ob, "{\"boolean\": true}");
         } else {
-            fprintf(out, "{\"boolean\": false}");
+            fs_outbuf_puts(&ob, "{\"boolean\": false}");
         }
     } else {
         fs_row *row;
         int rownum = 0;
         while ((row = fs_query_fetch_row(q))) {
             if (rownum++ > 0) {
-                fprintf(out, ",\n");
+                fs_outbuf_puts(&ob, ",\n");
             } else {
-                fprintf(out, "\n");
+                fs_outbuf_putc(&ob, '\n');
             }
-            fprintf(out, "   {");
+            fs_outbuf_puts(&ob, "   {");
             for (int c=0; c<cols; c++) {
-                if (c) fputs(",\n    ", out);
-                fprintf(out, "\"%s\":{", header[c].name);
-                int esclen = 0;
-                char *escd = NULL;
-                const char *lex = row[c].lex;
+                if (c) fs_outbuf_puts(&ob, ",\n    ");
+                fs_outbuf_putc(&ob, '"');
+                fs_outbuf_puts(&ob, header[c].name);
+                fs_outbuf_puts(&ob, "\":{");
                 switch (row[c].type) {
                     case FS_TYPE_NONE:
                         break;
                     case FS_TYPE_URI:
-                        if (json_needs_escape(row[c].lex, &esclen)) {
-                            escd = json_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
-                        fprintf(out, "\"type\":\"uri\",\"value\":\"%s\"", lex);
-                        if (escd) free(escd);
+                        fs_outbuf_puts(&ob, "\"type\":\"uri\",\"value\":\"");
+                        fs_outbuf_escape(&ob, row[c].lex, FS_ESCAPE_JSON);
+                        fs_outbuf_putc(&ob, '"');
                         break;
                     case FS_TYPE_LITERAL:
-                        if (json_needs_escape(row[c].lex, &esclen)) {
-                            escd = json_escape(row[c].lex, esclen);
-                            lex = escd;
-                        }
+                        fs_outbuf_puts(&ob, "\"type\":\"literal\",\"value\":\"");
+                        fs_outbuf_escape(&ob, row[c].lex, FS_ESCAPE_JSON);
+                        fs_outbuf_putc(&ob, '"');
                         if (row[c].lang) {
-                            fprintf(out, "\"type\":\"literal\",\"value\":\"%s\",\"xml:lang\":\"%s\"", lex, row[c].lang);
+                            fs_outbuf_puts(&ob, ",\"xml:lang\":\"");
+                            fs_outbuf_puts(&ob, row[c].lang);
+                            fs_outbuf_putc(&ob, '"');
                         } else if (row[c].dt) {
-                            fprintf(out, "\"type\":\"literal\",\"value\":\"%s\",\"datatype\":\"%s\"", lex, row[c].dt);
-                        } else {
-                            fprintf(out, "\"type\":\"literal\",\"value\":\"%s\"", lex);
+                            fs_outbuf_puts(&ob, ",\"datatype\":\"");
+                            fs_outbuf_puts(&ob, row[c].dt);
+                            fs_outbuf_putc(&ob, '"');
                         }
-                        if (escd) free(escd);
                         break;
                     case FS_TYPE_BNODE:
-                        fprintf(out, "\"type\":\"bnode\",\"value\":\"%s\"", row[c].lex + 2);
+                        fs_outbuf_puts(&ob, "\"type\":\"bnode\",\"value\":\"");
+                        fs_outbuf_escape(&ob, row[c].lex + 2, FS_ESCAPE_JSON);
+                        fs_outbuf_putc(&ob, '"');
                 }
-                fputs("}", out);
+                fs_outbuf_putc(&ob, '}');
             }
-            fputs("}", out);
+            fs_outbuf_putc(&ob, '}');
         }
         if (rownum) {
-            fputs("\n  ", out);
+            fs_outbuf_puts(&ob, "\n  ");
         }
     }
-    fprintf(out, "]\n }");
+    fs_outbuf_puts(&ob, "]\n }");
 
     if (q->warnings) {
-        fprintf(out, ",\n \"warnings\": [");
+        fs_outbuf_puts(&ob, ",\n \"warnings\": [");
         GSList *it;
         int count = 0;
         for (it = q->warnings; it; it = it->next) {
             if (count++) {
-                printf(", ");
-            }
-            char *text = it->data;
-            char *escd = NULL;
-            int esclen = 0;
-            if (json_needs_escape(text, &esclen)) {
-                escd = json_escape(text, esclen);
-                text = escd;
+                fs_outbuf_puts(&ob, ", ");
             }
-            fprintf(out, "\"%s\"", text);
-            if (escd) free(escd);
+            fs_outbuf_putc(&ob, '"');
+            fs_outbuf_escape(&ob, it->data, FS_ESCAPE_JSON);
+            fs_outbuf_putc(&ob, '"');
         }
         g_slist_free(q->warnings);
         q->warnings = NULL;
-        fprintf(out, "]\n");
+        fs_outbuf_puts(&ob, "]\n");
     }
 
-    fprintf(out, "}\n");
+    fs_outbuf_puts(&ob, "}\n");
+    fs_outbuf_fini(&ob);
 }
 
 static void output_testcase(fs_query *q, int flags, FILE *out)
@@ -1647,6 +1818,99 @@ static gboolean cache_dump(gpointer key, gpointer value, gpointer user_data)
     return 1;
 }
 
+/* move a resource fetched ahead into L1, call with mutex held only */
+static gboolean cache_promote(gpointer key, gpointer value, gpointer user_data)
+{
+    fs_resource *res = value;
+
+    if (g_hash_table_lookup(res_l1_cache, key)) {
+        free(res->lex);
+        free(res);
+        free(key);
+    } else {
+        g_hash_table_insert(res_l1_cache, key, res);
+    }
+
+    return 1;
+}
+
+/* add the RIDs of rows [start, end) that are not in L2 to pending[], call
+ * with mutex held only */
+static void window_rids(fs_query *q, int start, int end, fs_rid_vector **pending)
+{
+    /* FILTERs evaluated at output time may need values that aren't
+     * projected */
+    int filters = 0;
+    for (int block=q->block; block >= 0; block--) {
+        if (q->constraints[block]) filters = 1;
+    }
+
+    for (int row=start; row < end && row < q->length; row++) {
+        const int r = q->ordering ? q->ordering[row] : row;
+	for (int col=1; q->bt[col].name; col++) {
+            if (col > q->num_vars && !(filters && q->bt[col].need_val)) {
+                continue;
+            }
+            if (!q->bt[col].bound || r >= q->bt[col].vals->length) continue;
+	    fs_rid rid = q->bt[col].vals->data[r];
+	    if (rid == FS_RID_NULL || FS_IS_BNODE(rid)) continue;
+	    if (res_l2_cache[rid & CACHE_MASK].rid == rid) continue;
+	    fs_rid_vector_append(pending[FS_RID_SEGMENT(rid, q->segments)], rid);
+	}
+    }
+}
+
+static gpointer resolve_prefetch_thread(gpointer data)
+{
+    fs_resolve_prefetch *rp = data;
+
+    resolve_precache_all(rp->link, rp->rids, rp->segments, rp->staged);
+
+    return NULL;
+}
+
+/* start looking up rows [start, end) in the background, their resources are
+ * moved into L1 when the output reaches row start */
+static fs_resolve_prefetch *resolve_prefetch_start(fs_query *q, int start, int end)
+{
+    if (!g_thread_supported()) return NULL;
+
+    fs_resolve_prefetch *rp = calloc(1, sizeof(fs_resolve_prefetch));
+    rp->link = q->link;
+    rp->segments = q->segments;
+    rp->start = start;
+    rp->rids = calloc(q->segments, sizeof(fs_rid_vector *));
+    rp->staged = g_hash_table_new_full(rid_hash, rid_equal, free, resource_free);
+    for (int s=0; s<q->segments; s++) {
+        rp->rids[s] = fs_rid_vector_new(0);
+    }
+    g_static_mutex_lock (&cache_mutex);
+    window_rids(q, start, end, rp->rids);
+    g_static_mutex_unlock (&cache_mutex);
+
+    rp->thread = g_thread_create(resolve_prefetch_thread, rp, TRUE, NULL);
+    if (!rp->thread) {
+        fs_resolve_prefetch_free(rp);
+
+        return NULL;
+    }
+
+    return rp;
+}
+
+void fs_resolve_prefetch_free(fs_resolve_prefetch *rp)
+{
+    if (!rp) return;
+
+    if (rp->thread) g_thread_join(rp->thread);
+    for (int s=0; s<rp->segments; s++) {
+        fs_rid_vector_free(rp->rids[s]);
+    }
+    free(rp->rids);
+    g_hash_table_destroy(rp->staged);
+    free(rp);
+}
+
 fs_row *fs_query_fetch_row(fs_query *q)
 {
     if (!q) return NULL;
@@ -1673,9 +1937,15 @@ nextrow: ;
     if (q->row >= rows) {
 	if (fsp_hit_limits(q->link)) {
 	    fs_error(LOG_ERR, "hit soft limit %d times", fsp_hit_limits(q->link));
-	    char *msg = g_strdup_printf("hit complexity limit %d times, increasing soft limit may give more results", fsp_hit_limits(q->link));
+	    char *msg = fs_query_strdup_printf(q, "hit complexity limit %d times, increasing soft limit may give more results", fsp_hit_limits(q->link));
+	    q->warnings = g_slist_prepend(q->warnings, msg);
+	}
+	if (q->binds_truncated) {
+	    char *msg = fs_query_strdup_printf(q, "%d large pattern matches "
+		"stopped at the soft limit of %d, results are incomplete, use "
+		"a soft limit of -1 for complete results", q->binds_truncated,
+		q->soft_limit);
 	    q->warnings = g_slist_prepend(q->warnings, msg);
-	    fs_query_add_freeable(q, msg);
 	}
 	return NULL;
     }
@@ -1687,7 +1957,7 @@ nextrow: ;
     if (q->flags & FS_QUERY_COUNT) {
         if (q->row == 0) {
             q->resrow[0].rid = 1; // fake RID number
-            q->resrow[0].lex = g_strdup_printf("%d", rows);
+            q->resrow[0].lex = fs_query_strdup_printf(q, "%d", rows);
             q->resrow[0].dt = XSD_INTEGER;
             q->resrow[0].lang = NULL;
             q->resrow[0].type = FS_TYPE_LITERAL;
@@ -1706,36 +1976,47 @@ nextrow: ;
 	    if (q->pending) fs_rid_vector_clear(q->pending[i]);
 	}
 
-        /* dump L1 cache into L2 */
+        /* the window may already have been looked up in the background */
+        fs_resolve_prefetch *rp = q->res_prefetch;
+        q->res_prefetch = NULL;
+        int fetched = 0;
+        if (rp) {
+            if (rp->thread) g_thread_join(rp->thread);
+            rp->thread = NULL;
+            fetched = rp->start == q->row;
+        }
+
+        /* dump L1 cache into L2, then bring in what this query fetched
+         * ahead, so the window being output is all in L1 */
         g_static_mutex_lock (&cache_mutex);
-        if (res_l1_cache) g_hash_table_foreach_steal(res_l1_cache, cache_dump, NULL);
+        if (res_l1_cache) {
+            g_hash_table_foreach_steal(res_l1_cache, cache_dump, NULL);
+        }
+        if (fetched) {
+            if (!res_l1_cache) setup_l1_cache();
+            g_hash_table_foreach_steal(rp->staged, cache_promote, NULL);
+        }
 
         int lookup_buffer_size = RESOURCE_LOOKUP_BUFFER;
         if (q->limit > 0 && q->limit < RESOURCE_LOOKUP_BUFFER) {
             lookup_buffer_size = q->limit * 2;
         }
-	for (int row=q->row; row < q->row + lookup_buffer_size && row < rows; row++) {
-	    for (int col=1; col < q->num_vars; col++) {
-		fs_rid rid;
-		if (row < q->bt[col].vals->length) {
-                    if (q->ordering) {
-                        rid = q->bt[col].vals->data[q->ordering[row]];
-                    } else {
-                        rid = q->bt[col].vals->data[row];
-                    }
-		} else {
-		    rid = FS_RID_NULL;
-		}
-		if (FS_IS_BNODE(rid)) continue;
-		if (res_l2_cache[rid & CACHE_MASK].rid == rid) continue;
-		fs_rid_vector_append(q->pending[FS_RID_SEGMENT(rid, q->segments)], rid);
-	    }
-	}
+        if (!fetched && q->pending) {
+            window_rids(q, q->row, q->row + lookup_buffer_size, q->pending);
+        }
         g_static_mutex_unlock (&cache_mutex);
-        if (q->pending) {
-            resolve_precache_all(q->link, q->pending, q->segments);
+        fs_resolve_prefetch_free(rp);
+        if (!fetched && q->pending) {
+            resolve_precache_all(q->link, q->pending, q->segments, NULL);
         }
 	q->lastrow = q->row + lookup_buffer_size;
+
+        /* fetch the next window while this one is being output, unless a
+         * small LIMIT means we're unlikely to get there */
+        if (q->lastrow < rows && lookup_buffer_size == RESOURCE_LOOKUP_BUFFER) {
+            q->res_prefetch = resolve_prefetch_start(q, q->lastrow,
+                                q->lastrow + lookup_buffer_size);
+        }
     }
 
     const int row = q->ordering ? q->ordering[q->row] : q->row;
@@ -1800,6 +2081,43 @@ nextrow: ;
     return q->resrow;
 }
 
+/* CONSTRUCT and DESCRIBE results in one of the native writer's syntaxes,
+ * other queries get the text output */
+static void output_rdf(fs_query *q, const char *fmt, int flags, FILE *out)
+{
+    if (!q) return;
+
+    if (!q->construct && !q->describe) {
+        output_text(q, flags, out);
+
+        return;
+    }
+
+    if (flags & FS_RESULT_FLAG_HEADERS) {
+        const char *mime = "text/plain";
+        if (!strcmp(fmt, "turtle")) {
+            mime = "text/turtle";
+        } else if (!strcmp(fmt, "nquads")) {
+            mime = "text/x-nquads";
+        }
+        fprintf(out, "Content-Type: %s; charset=utf-8\r\n\r\n", mime);
+    }
+
+    if (q->warnings) {
+        for (GSList *it = q->warnings; it; it = it->next) {
+            if (it->data) fprintf(out, "# %s\n", (char *)it->data);
+        }
+        g_slist_free(q->warnings);
+        q->warnings = NULL;
+    }
+
+    if (q->construct) {
+        handle_construct(q, fmt, out);
+    } else {
+        handle_describe(q, fmt, out);
+    }
+}
+
 void fs_query_results_output(fs_query *q, const char *fmt, int flags, FILE *out)
 {
     if (fs_query_flags(q) & FS_QUERY_EXPLAIN) {
@@ -1816,6 +2134,8 @@ void fs_query_results_output(fs_query *q, const char *fmt, int flags, FILE *out)
 	output_json(q, flags, out);
     } else if (!strcmp(fmt, "testcase")) {
 	output_testcase(q, flags, out);
+    } else if (fs_rdf_syntax_from_name(fmt) >= 0) {
+	output_rdf(q, fmt, flags, out);
     } else {
 	fprintf(out, "unknown format: %s\n", fmt);
     }
@@ -1827,8 +2147,7 @@ void fs_value_to_row(fs_query *q, fs_value v, fs_row *r)
         r->rid = 1;
         r->dt = NULL;
         r->lang = NULL;
-        r->lex = g_strdup_printf("error: %s", v.lex);
-        fs_query_add_freeable(q, (char *)r->lex);
+        r->lex = fs_query_strdup_printf(q, "error: %s", v.lex);
 
 	return;
     }
@@ -1839,69 +2158,63 @@ void fs_value_to_row(fs_query *q, fs_value v, fs_row *r)
         r->lang = NULL;
         r->type = FS_TYPE_LITERAL;
         if (v.lex) {
-            r->lex = g_strdup(v.lex);
+            r->lex = fs_query_strdup(q, v.lex);
         } else {
-            r->lex = g_strdup_printf("%g", v.fp);
+            r->lex = fs_query_strdup_printf(q, "%g", v.fp);
         }
-        fs_query_add_freeable(q, (char *)r->lex);
     } else if (v.attr == fs_c.xsd_float) {
         r->rid = 1;
         r->dt = XSD_FLOAT;
         r->lang = NULL;
         r->type = FS_TYPE_LITERAL;
         if (v.lex) {
-            r->lex = g_strdup(v.lex);
+            r->lex = fs_query_strdup(q, v.lex);
         } else {
-            r->lex = g_strdup_printf("%g", v.fp);
+            r->lex = fs_query_strdup_printf(q, "%g", v.fp);
         }
-        fs_query_add_freeable(q, (char *)r->lex);
     } else if (v.attr == fs_c.xsd_decimal) {
         r->rid = 1;
         r->dt = XSD_DECIMAL;
         r->lang = NULL;
         r->type = FS_TYPE_LITERAL;
         if (v.lex) {
-            r->lex = g_strdup(v.lex);
+            r->lex = fs_query_strdup(q, v.lex);
         } else {
             r->lex = fs_decimal_to_lex(&v.de);
+            fs_query_add_freeable(q, (char *)r->lex);
         }
-        fs_query_add_freeable(q, (char *)r->lex);
     } else if (v.attr == fs_c.xsd_integer) {
         r->rid = 1;
         r->dt = XSD_INTEGER;
         r->lang = NULL;
         r->type = FS_TYPE_LITERAL;
         if (v.lex) {
-            r->lex = g_strdup(v.lex);
+            r->lex = fs_query_strdup(q, v.lex);
         } else {
-            r->lex = g_strdup_printf("%lld", (long long)v.in);
+            r->lex = fs_query_strdup_printf(q, "%lld", (long long)v.in);
         }
-        fs_query_add_freeable(q, (char *)r->lex);
     } else if (v.attr == fs_c.xsd_boolean) {
         r->rid = 1;
         r->dt = XSD_BOOLEAN;
         r->lang = NULL;
         r->type = FS_TYPE_LITERAL;
         if (v.lex) {
-            r->lex = g_strdup(v.lex);
+            r->lex = fs_query_strdup(q, v.lex);
         } else {
-            r->lex = g_strdup_printf("%lld", (long long)v.in);
+            r->lex = fs_query_strdup_printf(q, "%lld", (long long)v.in);
         }
-        fs_query_add_freeable(q, (char *)r->lex);
     } else if (v.attr == fs_c.xsd_string) {
         r->rid = 1;
         r->dt = XSD_STRING;
         r->lang = NULL;
         r->type = FS_TYPE_LITERAL;
-        r->lex = g_strdup(v.lex);
-        fs_query_add_freeable(q, (char *)r->lex);
+        r->lex = fs_query_strdup(q, v.lex);
     } else if (v.attr == fs_c.xsd_datetime) {
         r->rid = 1;
         r->dt = XSD_DATETIME;
         r->lang = NULL;
         r->type = FS_TYPE_LITERAL;
-        r->lex = g_strdup(v.lex);
-        fs_query_add_freeable(q, (char *)r->lex);
+        r->lex = fs_query_strdup(q, v.lex);
     } else if (v.attr == fs_c.empty || v.attr == FS_RID_NULL) {
 	if (v.rid == FS_RID_NULL) {
 	} else if (FS_IS_BNODE(v.rid)) {
@@ -1909,21 +2222,19 @@ void fs_value_to_row(fs_query *q, fs_value v, fs_row *r)
             r->dt = NULL;
             r->lang = NULL;
             r->type = FS_TYPE_BNODE;
-            r->lex = g_strdup_printf("_:b%llx", FS_BNODE_NUM(v.rid));
+            r->lex = fs_query_strdup_printf(q, "_:b%llx", FS_BNODE_NUM(v.rid));
         } else if (FS_IS_URI(v.rid)) {
             r->rid = 1;
             r->dt = NULL;
             r->lang = NULL;
             r->type = FS_TYPE_URI;
-            r->lex = g_strdup(v.lex);
-            fs_query_add_freeable(q, (char *)r->lex);
+            r->lex = fs_query_strdup(q, v.lex);
 	} else {
             r->rid = 1;
             r->dt = NULL;
             r->lang = NULL;
             r->type = FS_TYPE_LITERAL;
-            r->lex = g_strdup(v.lex);
-            fs_query_add_freeable(q, (char *)r->lex);
+            r->lex = fs_query_strdup(q, v.lex);
 	}
     } else {
         fs_resource res;
@@ -1937,8 +2248,7 @@ void fs_value_to_row(fs_query *q, fs_value v, fs_row *r)
             r->lang = res.lex;
         }
         r->type = FS_TYPE_LITERAL;
-        r->lex = g_strdup(v.lex);
-        fs_query_add_freeable(q, (char *)r->lex);
+        r->lex = fs_query_strdup(q, v.lex);
     }
 }
 
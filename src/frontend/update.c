@@ -48,6 +48,7 @@ struct update_context {
     rasqal_literal *graph;
     rasqal_update_operation *op;
     int opid;
+    int *uncommitted;
 };
 
 static int inited = 0;
@@ -189,6 +190,11 @@ static void error_handler(void *user_data, raptor_locator* locator, const char *
 
 static int update_op(struct update_context *ct)
 {
+    /* anything other than a plain insert has to see earlier inserts */
+    if (ct->op->type != RASQAL_UPDATE_TYPE_UPDATE || ct->op->delete_templates) {
+        fs_update_commit(ct->link, ct->uncommitted);
+    }
+
     switch (ct->op->type) {
     case RASQAL_UPDATE_TYPE_UNKNOWN:
         add_message(ct, "Unknown update operation", 0);
@@ -283,11 +289,44 @@ static int update_op(struct update_context *ct)
         fsp_quad_import(ct->link, FS_RID_SEGMENT(quad_buf[0][1], ct->segments), FS_BIND_BY_SUBJECT, 1, quad_buf);
 //printf("I %016llx %016llx %016llx %016llx\n", quad_buf[0][0], quad_buf[0][1], quad_buf[0][2], quad_buf[0][3]);
     }
+    if (inslen) {
+        *ct->uncommitted = 1;
+    }
 
     return 0;
 }
 
+int fs_update_commit(fsp_link *l, int *uncommitted)
+{
+    if (!*uncommitted) {
+        return 0;
+    }
+    *uncommitted = 0;
+
+    int ret = 0;
+    if (fsp_res_import_commit_all(l)) {
+        fs_error(LOG_ERR, "resource commit failed");
+        ret = 1;
+    }
+    if (fsp_quad_import_commit_all(l, FS_BIND_BY_SUBJECT)) {
+        fs_error(LOG_ERR, "quad commit failed");
+        ret = 1;
+    }
+
+    return ret;
+}
+
 int fs_update(fsp_link *l, char *update, char **message, int unsafe)
+{
+    int uncommitted = 0;
+    int ret = fs_update_grouped(l, update, message, unsafe, &uncommitted);
+    fs_update_commit(l, &uncommitted);
+
+    return ret;
+}
+
+int fs_update_grouped(fsp_link *l, char *update, char **message, int unsafe,
+                      int *uncommitted)
 {
     rasqal_world *rworld = rasqal_new_world();
     rasqal_world_open(rworld);
@@ -307,6 +346,7 @@ int fs_update(fsp_link *l, char *update, char **message, int unsafe)
     uctxt.segments = fsp_link_segments(l);
     uctxt.rw = rworld;
     uctxt.rq = rq;
+    uctxt.uncommitted = uncommitted;
     rasqal_query_prepare(rq, (unsigned char *)update, NULL);
 
     int ok = 1;
@@ -322,9 +362,6 @@ int fs_update(fsp_link *l, char *update, char **message, int unsafe)
             break;
         }
     }
-    fsp_res_import_commit_all(l);
-    fsp_quad_import_commit_all(l, FS_BIND_BY_SUBJECT);
-
     rasqal_free_query(rq);
     rasqal_free_world(rworld);
 
@@ -11,4 +11,14 @@ network operations, eg. LOAD */
 
 int fs_update(fsp_link *l, char *update, char **message, int unsafe);
 
+/* As fs_update, but inserted quads are left uncommitted so that several
+small updates can share one backend commit. *uncommitted is set while there
+are inserts waiting, and belongs to the caller, starting at 0. Deletes and
+other operations commit any earlier inserts first, so the updates still apply
+in order. fs_update_commit must be called once the group is done. */
+
+int fs_update_grouped(fsp_link *l, char *update, char **message, int unsafe,
+                      int *uncommitted);
+int fs_update_commit(fsp_link *l, int *uncommitted);
+
 #endif
@@ -39,6 +39,7 @@
 #include "common/4store.h"
 #include "common/error.h"
 #include "common/hash.h"
+#include "common/params.h"
 
 #include "frontend/query.h"
 #include "frontend/import.h"
@@ -59,6 +60,7 @@ static int global_import_count = 0;
 static int unsafe = 0;
 static int default_graph = 0;
 static int soft_limit = 0; /* default value for soft limit */
+static int diff_replace = 0; /* PUT only sends changes to the graph */
 
 static fs_query_state *query_state;
 
@@ -66,7 +68,8 @@ static GThreadPool* pool;
 #define QUERY_THREAD_POOL_SIZE 16
 
 static gboolean recv_fn (GIOChannel *source, GIOCondition condition, gpointer data);
-static void http_import_queue_remove(client_ctxt *ctxt);
+static void http_import_start(client_ctxt *ctxt);
+static void http_spool_finished(client_ctxt *ctxt, const char *msg);
 static void http_put_finished(client_ctxt *ctxt, const char *msg);
 
 static FILE *ql_file = NULL;
@@ -297,6 +300,12 @@ static void client_free(client_ctxt *ctxt)
   if (ctxt->partial) {
     g_byte_array_free(ctxt->partial, TRUE);
   }
+  if (ctxt->import_fd != -1) {
+    close(ctxt->import_fd);
+  }
+  g_free(ctxt->import_uri);
+  g_free(ctxt->import_type);
+  g_free(ctxt->update_string);
   g_hash_table_destroy(ctxt->headers);
   free(ctxt->request);
   g_free(ctxt);
@@ -319,20 +328,26 @@ static void http_query_worker(gpointer data, gpointer user_data)
   ctxt->start_time = fs_time();
   ctxt->qr = fs_query_execute(query_state, fsplink, bu, ctxt->query_string, ctxt->query_flags, 3 /* opt_level */, ctxt->soft_limit);
 
-  http_send(ctxt, "HTTP/1.0 200 OK\r\n");
-  http_send(ctxt, "Server: 4s-httpd/" GIT_REV "\r\n");
+  /* a query that was stopped part way has no results worth sending */
+  FILE *fp = NULL;
+  if (fs_query_over_budget(ctxt->qr)) {
+    http_error(ctxt, "500 query exceeded its memory budget");
+  } else {
+    http_send(ctxt, "HTTP/1.0 200 OK\r\n");
+    http_send(ctxt, "Server: 4s-httpd/" GIT_REV "\r\n");
+    fcntl(ctxt->sock, F_SETFL, 0 /* not O_NONBLOCK */); /* blocking */
+    fp = fdopen(dup(ctxt->sock), "a+");
+  }
   const char *accept = g_hash_table_lookup(ctxt->headers, "accept");
 
-  fcntl(ctxt->sock, F_SETFL, 0 /* not O_NONBLOCK */); /* blocking */
-  FILE *fp = fdopen(dup(ctxt->sock), "a+");
   if (fp != NULL) {
     const char *type = "sparql"; /* default */
     int flags = FS_RESULT_FLAG_HEADERS;
 
     if (ctxt->output) {
       type = ctxt->output;
-    } else if (ctxt->qr->construct && accept && strstr(accept, "text/turtle")) {
-      type = "text";
+    } else if ((ctxt->qr->construct || ctxt->qr->describe) && accept && strstr(accept, "text/turtle")) {
+      type = "turtle";
       fprintf(fp, "Content-Type: text/turtle\r\n\r\n");
       flags = 0;
     } else if (ctxt->qr->construct && accept && strstr(accept, "application/rdf+xml")) {
@@ -351,17 +366,16 @@ static void http_query_worker(gpointer data, gpointer user_data)
       flags = 0;
     }
     fs_query_results_output(ctxt->qr, type, flags, fp);
-    fs_query_free(ctxt->qr);
-    ctxt->qr = NULL;
-    free(ctxt->query_string);
-    ctxt->query_string = NULL;
-    if (ctxt->output) {
-      g_free(ctxt->output);
-      ctxt->output = NULL;
-    }
-
     fclose(fp);
   }
+  fs_query_free(ctxt->qr);
+  ctxt->qr = NULL;
+  free(ctxt->query_string);
+  ctxt->query_string = NULL;
+  if (ctxt->output) {
+    g_free(ctxt->output);
+    ctxt->output = NULL;
+  }
   http_close(ctxt);
   if (ql_file) {
     fprintf(ql_file, "#### execution time for Q%u: %fs\n", ctxt->query_id, fs_time() - ctxt->start_time);
@@ -387,160 +401,324 @@ static gboolean import_watchdog (gpointer data)
   /* something has gone wrong, we need to recover */
   fs_error(LOG_ERR, "import watchdog fired");
 
-  http_put_finished(ctxt, "500 watchdog timeout fired");
+  http_spool_finished(ctxt, "500 watchdog timeout fired");
   return FALSE;
 }
 
-static void http_import_start(client_ctxt *ctxt)
+/* request bodies are spooled to an unlinked temporary file before joining
+ * the import queue, so a slow upload doesn't hold up every other writer */
+static int http_spool_start(client_ctxt *ctxt)
 {
-  /* If it's an update operation, we have a different path */
-  if (ctxt->update_string) {
-    char *message = NULL;
-    int ret = fs_update(fsplink, ctxt->update_string, &message, unsafe);
-    fs_query_cache_flush(query_state, 0);
-    http_import_queue_remove(ctxt);
-    if (ret == 0) {
-      http_send(ctxt, "HTTP/1.0 200 OK\r\n");
-    } else {
-      http_send(ctxt, "HTTP/1.0 400 Bad argument\r\n");
+  char *filename = g_strdup(FS_TMP_PATH "/httpd-importXXXXXX");
+  ctxt->import_fd = mkstemp(filename);
+  if (ctxt->import_fd == -1) {
+    fs_error(LOG_ERR, "cannot create spool file “%s”: %s", filename, strerror(errno));
+    g_free(filename);
+    return 1;
+  }
+  unlink(filename);
+  g_free(filename);
+
+  return 0;
+}
+
+static int http_spool_write(client_ctxt *ctxt, const char *data, gsize length)
+{
+  while (length > 0) {
+    ssize_t wrote = write(ctxt->import_fd, data, length);
+    if (wrote == -1) {
+      if (errno == EINTR) continue;
+      fs_error(LOG_ERR, "write to spool file failed: %s", strerror(errno));
+      return 1;
     }
-    http_send(ctxt, "Server: 4s-httpd/" GIT_REV "\r\n");
-    http_send(ctxt, "Content-Type: text/plain; charset=utf-8\r\n\r\n");
-    if (message) {
-      http_send(ctxt, message);
+    data += wrote;
+    length -= wrote;
+  }
+
+  return 0;
+}
+
+/* the queue holds waiting and running imports and updates in the order they
+ * arrived. Imports into different graphs run side by side, but an import
+ * waits for every earlier request that could touch its graph, so writes to
+ * one graph are applied in order. Updates, and imports in formats that can
+ * name their own graphs, wait for everything ahead of them */
+#define IMPORT_MAX_RUNNING 8
+#define UPDATE_GROUP_MAX 64
+
+static int import_exclusive(client_ctxt *ctxt)
+{
+  if (ctxt->update_string || !ctxt->import_uri || !ctxt->import_type) {
+    return 1;
+  }
+
+  return strstr(ctxt->import_type, "trig") || strstr(ctxt->import_type, "nquads");
+}
+
+static int import_can_start(GSList *pos)
+{
+  client_ctxt *ctxt = (client_ctxt *) pos->data;
+  const int exclusive = import_exclusive(ctxt);
+
+  for (GSList *it = import_queue; it != pos; it = it->next) {
+    client_ctxt *ahead = (client_ctxt *) it->data;
+    if (exclusive || import_exclusive(ahead) ||
+        !strcmp(ahead->import_uri, ctxt->import_uri)) {
+      return 0;
     }
-    http_send(ctxt, "\n");
+  }
+
+  return 1;
+}
+
+/* waiting requests are started from the main loop rather than directly,
+ * so requests that have already arrived get a chance to join the queue
+ * first, and updates can be grouped together */
+static gboolean http_import_next(gpointer data)
+{
+  int running = 0;
+  GSList *it = import_queue;
+
+  while (it && running < IMPORT_MAX_RUNNING) {
+    client_ctxt *ctxt = (client_ctxt *) it->data;
+    /* starting can take ctxt, and maybe others, off the queue */
+    GSList *next = it->next;
+    if (ctxt->import_running) {
+      running++;
+    } else if (import_can_start(it)) {
+      ctxt->import_running = 1;
+      running++;
+      http_import_start(ctxt);
+      it = import_queue;
+      running = 0;
+      continue;
+    }
+    it = next;
+  }
+
+  return FALSE;
+}
+
+static void http_import_queue_add(client_ctxt *ctxt)
+{
+  ctxt->import_running = 0;
+  import_queue = g_slist_append(import_queue, ctxt);
+  g_idle_add_full(G_PRIORITY_DEFAULT, http_import_next, NULL, NULL);
+}
+
+static void http_import_queue_remove(client_ctxt *ctxt)
+{
+  import_queue = g_slist_remove(import_queue, ctxt);
+  if (import_queue) {
+    g_idle_add_full(G_PRIORITY_DEFAULT, http_import_next, NULL, NULL);
+  }
+}
+
+static void http_spool_finished(client_ctxt *ctxt, const char *msg)
+{
+  if (ctxt->watchdog) {
+    g_source_remove(ctxt->watchdog);
+    ctxt->watchdog = 0;
+  }
+  ctxt->importing = 0;
+
+  if (msg) {
+    fs_error(LOG_INFO, "abandoned upload to %s", ctxt->import_uri);
+    http_error(ctxt, msg);
     http_close(ctxt);
 
     return;
   }
 
-  const char *length = g_hash_table_lookup(ctxt->headers, "content-length");
-  ctxt->bytes_left = atol(length);
+  /* stop watching the socket while we wait our turn */
+  g_source_remove_by_user_data(ctxt);
+  http_import_queue_add(ctxt);
+}
 
-  ctxt->importing = 1;
-  fs_error(LOG_INFO, "starting import %s (%ld bytes)", ctxt->import_uri, ctxt->bytes_left);
+static gboolean http_import_chunk(gpointer data)
+{
+  client_ctxt *ctxt = (client_ctxt *) data;
+  gchar buffer[65536];
 
-  g_io_add_watch(ctxt->ioch, G_IO_IN, recv_fn, ctxt);
+  ssize_t got = read(ctxt->import_fd, buffer, sizeof(buffer));
+  if (got > 0) {
+    fs_import_stream_data(fsplink, ctxt->import_stream, (unsigned char *) buffer, got);
 
-  const char *expect = g_hash_table_lookup(ctxt->headers, "expect");
-  if (expect && !strcasecmp(expect, "100-continue")) {
-    http_send(ctxt, "HTTP/1.0 100 Continue\r\n\r\n");
+    return TRUE;
+  }
+  if (got == -1) {
+    fs_error(LOG_ERR, "read from spool file failed: %s", strerror(errno));
+    http_put_finished(ctxt, "500 I/O error");
+  } else {
+    http_put_finished(ctxt, NULL);
   }
 
-  if (fsp_start_import_all(fsplink)) {
-    fs_error(LOG_ERR, "fsp_start_import_all failed");
+  return FALSE;
+}
+
+static void http_update_reply(client_ctxt *ctxt, int ret, char *message)
+{
+  if (ret == 0) {
+    http_send(ctxt, "HTTP/1.0 200 OK\r\n");
+  } else {
+    http_send(ctxt, "HTTP/1.0 400 Bad argument\r\n");
+  }
+  http_send(ctxt, "Server: 4s-httpd/" GIT_REV "\r\n");
+  http_send(ctxt, "Content-Type: text/plain; charset=utf-8\r\n\r\n");
+  if (message) {
+    http_send(ctxt, message);
+  }
+  http_send(ctxt, "\n");
+  g_free(message);
+  http_close(ctxt);
+}
+
+/* updates waiting directly behind ctxt in the queue are applied along with
+ * it and share one backend commit, none of them are answered until that
+ * commit is done */
+static void http_update_group(client_ctxt *ctxt)
+{
+  client_ctxt *group[UPDATE_GROUP_MAX];
+  char *messages[UPDATE_GROUP_MAX];
+  int rets[UPDATE_GROUP_MAX];
+  int count = 0;
+
+  group[count++] = ctxt;
+  for (GSList *it = import_queue->next; it && count < UPDATE_GROUP_MAX; it = it->next) {
+    client_ctxt *next = (client_ctxt *) it->data;
+    if (!next->update_string) break;
+    group[count++] = next;
+  }
+
+  int uncommitted = 0;
+  for (int i=0; i<count; i++) {
+    messages[i] = NULL;
+    rets[i] = fs_update_grouped(fsplink, group[i]->update_string, &messages[i], unsafe, &uncommitted);
+  }
+  if (fs_update_commit(fsplink, &uncommitted)) {
+    fs_error(LOG_ERR, "commit failed for group of %d updates", count);
+    for (int i=0; i<count; i++) {
+      rets[i] = 1;
+    }
+  }
+  fs_query_cache_flush(query_state, 0);
+
+  /* the head goes last, removing it starts the next import */
+  for (int i=1; i<count; i++) {
+    import_queue = g_slist_remove(import_queue, group[i]);
+    http_update_reply(group[i], rets[i], messages[i]);
+  }
+  http_import_queue_remove(ctxt);
+  http_update_reply(ctxt, rets[0], messages[0]);
+}
+
+static void http_import_start(client_ctxt *ctxt)
+{
+  /* If it's an update operation, we have a different path */
+  if (ctxt->update_string) {
+    http_update_group(ctxt);
+
+    return;
+  }
+
+  /* in diff_replace mode the existing graph is left in place and the
+   * changes are worked out when the import finishes */
+  const int replace = !ctxt->import_append && diff_replace;
+
+  fs_error(LOG_INFO, "starting import %s (%ld bytes)", ctxt->import_uri, ctxt->import_size);
+
+  if (lseek(ctxt->import_fd, 0, SEEK_SET) == -1) {
+    fs_error(LOG_ERR, "cannot rewind spool file: %s", strerror(errno));
     http_import_queue_remove(ctxt);
     http_error(ctxt, "500 failed during import-start");
     http_close(ctxt);
     return;
   }
 
-  fs_rid_vector *mvec = fs_rid_vector_new(0);
-  fs_rid muri = fs_hash_uri(ctxt->import_uri);
-  fs_rid_vector_append(mvec, muri);
-
-  if (fsp_delete_model_all(fsplink, mvec) || fsp_new_model_all(fsplink, mvec)) {
-    fs_error(LOG_ERR, "fsp_{delete,new}_model_all failed");
-    fs_rid_vector_free(mvec);
-    fsp_stop_import_all(fsplink);
+  /* parsing doesn't touch the graph, nothing is written to it until the
+   * import finishes, see http_import_write() */
+  ctxt->import_replace = replace;
+  if (replace) {
+    ctxt->import_stream = fs_import_stream_replace_start(fsplink, ctxt->import_uri, ctxt->import_type, has_o_index, &global_import_count);
+  } else {
+    ctxt->import_stream = fs_import_stream_start(fsplink, ctxt->import_uri, ctxt->import_type, has_o_index, &global_import_count);
+  }
+  if (!ctxt->import_stream) {
     http_import_queue_remove(ctxt);
     http_error(ctxt, "500 failed during import-start");
     http_close(ctxt);
     return;
   }
 
-  fs_rid_vector_free(mvec);
-  char *type = just_content_type(ctxt);
-  fs_import_stream_start(fsplink, ctxt->import_uri, type, has_o_index, &global_import_count);
-  g_free(type);
-
-  guint timeout = 30 + (ctxt->bytes_left / WATCHDOG_RATE);
-  ctxt->watchdog = g_timeout_add(1000 * timeout, import_watchdog, ctxt);
-  if (ctxt->bytes_left == 0) {
-    http_put_finished(ctxt, NULL);
-  }
+  /* feed the parser from the main loop, so we keep answering queries */
+  g_idle_add_full(G_PRIORITY_DEFAULT, http_import_chunk, ctxt, NULL);
 }
 
 static void http_post_data(client_ctxt *ctxt, char *model, const char *content_type, char *data)
 {
-  ctxt->importing = 1;
   long int length = strlen(data);
-  fs_error(LOG_INFO, "starting add to %s (%ld bytes)", model, length);
 
-  if (fsp_start_import_all(fsplink)) {
-    fs_error(LOG_ERR, "fsp_start_import_all failed");
-    http_import_queue_remove(ctxt);
+  if (http_spool_start(ctxt) || http_spool_write(ctxt, data, length)) {
     http_error(ctxt, "500 failed during import-start");
     http_close(ctxt);
     return;
   }
 
-  fs_import_stream_start(fsplink, model, content_type, has_o_index, &global_import_count);
-
-  guint timeout = 30 + (ctxt->bytes_left / WATCHDOG_RATE);
-  ctxt->watchdog = g_timeout_add(1000 * timeout, import_watchdog, ctxt);
+  ctxt->import_uri = g_strdup(model);
+  ctxt->import_type = g_strdup(content_type);
+  ctxt->import_size = length;
+  ctxt->import_append = 1;
+  ctxt->update_string = NULL;
 
-  fs_import_stream_data(fsplink, (unsigned char *)data, length);
+  http_spool_finished(ctxt, NULL);
+}
 
-  if (ctxt->watchdog) {
-    g_source_remove(ctxt->watchdog);
-    ctxt->watchdog = 0;
+/* the parsed quads are written in one synchronous step, so imports that
+ * were parsed side by side are still applied one at a time */
+static int http_import_write(client_ctxt *ctxt, int *error_count)
+{
+  if (ctxt->import_replace) {
+    return fs_import_stream_finish(fsplink, ctxt->import_stream, &global_import_count, error_count);
   }
 
-  int error_count = -1;
-  fs_import_stream_finish(fsplink, &global_import_count, &error_count);
-  all_time_import_count += global_import_count;
-  global_import_count = 0;
-  fsp_stop_import_all(fsplink);
-
-  fs_query_cache_flush(query_state, 0);
-
-  ctxt->importing = 0;
-  fs_error(LOG_INFO, "finished add to %s", model);
-
-  http_import_queue_remove(ctxt);
-
-  if (error_count == -1) {
-    fs_error(LOG_ERR, "import_stream_finish didn't complete successfully");
-    http_error(ctxt, "500 server problem while importing");
-  } else if (error_count > 0) {
-    http_error(ctxt, "400 RDF parser reported errors");
-  } else {
-    http_code(ctxt, "200 added successfully");
+  if (fsp_start_import_all(fsplink)) {
+    fs_error(LOG_ERR, "fsp_start_import_all failed");
+    fs_import_stream_finish(fsplink, ctxt->import_stream, &global_import_count, error_count);
+    return 1;
   }
-  http_close(ctxt);
-}
 
-static void http_import_queue_remove(client_ctxt *ctxt)
-{
-  import_queue = g_slist_remove(import_queue, ctxt);
-  if (import_queue) {
-    http_import_start((client_ctxt *) import_queue->data);
+  if (!ctxt->import_append) {
+    fs_rid_vector *mvec = fs_rid_vector_new(0);
+    fs_rid_vector_append(mvec, fs_hash_uri(ctxt->import_uri));
+    if (fsp_delete_model_all(fsplink, mvec) || fsp_new_model_all(fsplink, mvec)) {
+      fs_error(LOG_ERR, "fsp_{delete,new}_model_all failed");
+      fs_rid_vector_free(mvec);
+      fs_import_stream_finish(fsplink, ctxt->import_stream, &global_import_count, error_count);
+      fsp_stop_import_all(fsplink);
+      return 1;
+    }
+    fs_rid_vector_free(mvec);
   }
+
+  int ret = fs_import_stream_finish(fsplink, ctxt->import_stream, &global_import_count, error_count);
+  fsp_stop_import_all(fsplink);
+
+  return ret;
 }
 
 static void http_put_finished(client_ctxt *ctxt, const char *msg)
 {
-  if (ctxt->watchdog) {
-    g_source_remove(ctxt->watchdog);
-    ctxt->watchdog = 0;
-  }
-
   int error_count = -1;
-  fs_import_stream_finish(fsplink, &global_import_count, &error_count);
+  if (http_import_write(ctxt, &error_count)) {
+    error_count = -1;
+  }
+  ctxt->import_stream = NULL;
   all_time_import_count += global_import_count;
   global_import_count = 0;
-  fsp_stop_import_all(fsplink);
 
   fs_query_cache_flush(query_state, 0);
 
-  ctxt->importing = 0;
-  if (ctxt->bytes_left) {
-    fs_error(LOG_INFO, "finished import %s (%ld bytes left)", ctxt->import_uri, ctxt->bytes_left);
-  } else {
-    fs_error(LOG_INFO, "finished import %s", ctxt->import_uri);
-  }
+  fs_error(LOG_INFO, "finished import %s", ctxt->import_uri);
   g_free(ctxt->import_uri);
   ctxt->import_uri = NULL;
 
@@ -553,6 +731,8 @@ static void http_put_finished(client_ctxt *ctxt, const char *msg)
     http_error(ctxt, "500 server problem while importing");
   } else if (error_count > 0) {
     http_error(ctxt, "400 RDF parser reported errors");
+  } else if (ctxt->import_append) {
+    http_code(ctxt, "200 added successfully");
   } else {
     http_code(ctxt, "201 imported successfully");
   }
@@ -575,22 +755,37 @@ static void http_put_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
     return;
   }
 
-  if (!g_hash_table_lookup(ctxt->headers, "content-length")) {
+  const char *length = g_hash_table_lookup(ctxt->headers, "content-length");
+  if (!length) {
     http_error(ctxt, "411 content length required");
     http_close(ctxt);
     return;
   }
 
+  if (http_spool_start(ctxt)) {
+    http_error(ctxt, "500 failed during import-start");
+    http_close(ctxt);
+    return;
+  }
+
   ctxt->import_uri = g_strdup(url);
+  ctxt->import_type = just_content_type(ctxt);
+  ctxt->import_size = ctxt->bytes_left = atol(length);
   ctxt->update_string = NULL;
 
-  g_source_remove_by_user_data(ctxt);
-  if (import_queue) {
-    import_queue = g_slist_append(import_queue, ctxt);
-  } else {
-    import_queue = g_slist_append(import_queue, ctxt);
-    http_import_start(ctxt);
+  const char *expect = g_hash_table_lookup(ctxt->headers, "expect");
+  if (expect && !strcasecmp(expect, "100-continue")) {
+    http_send(ctxt, "HTTP/1.0 100 Continue\r\n\r\n");
+  }
+
+  if (ctxt->bytes_left == 0) {
+    http_spool_finished(ctxt, NULL);
+    return;
   }
+
+  ctxt->importing = 1;
+  guint timeout = 30 + (ctxt->bytes_left / WATCHDOG_RATE);
+  ctxt->watchdog = g_timeout_add(1000 * timeout, import_watchdog, ctxt);
 }
 
 static void http_delete_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
@@ -662,12 +857,16 @@ static void http_status_report(client_ctxt *ctxt)
     GSList *queue;
     for (queue = import_queue; queue; queue = queue->next) {
       client_ctxt *import_ctxt = (client_ctxt *) queue->data;
-      http_send(ctxt, import_ctxt->import_uri);
+      if (import_ctxt->update_string) {
+        http_send(ctxt, "SPARQL update");
+      } else {
+        http_send(ctxt, import_ctxt->import_uri);
+      }
+      if (!import_ctxt->import_running) {
+        http_send(ctxt, " (waiting)");
+      }
       http_send(ctxt, "<br>\n");
     }
-    char *flushed = g_strdup_printf("<p># triples from this import so far: %d</p>\n", global_import_count);
-    http_send(ctxt, flushed);
-    g_free(flushed);
   }
 
   char *triples = g_strdup_printf("<p>Total # triples imported: %ld</p>\n", all_time_import_count);
@@ -1048,14 +1247,11 @@ static void http_post_request(client_ctxt *ctxt, gchar *url, gchar *protocol)
       qs = next;
     }
     if (update) {
-      ctxt->update_string = update;
+      /* form is freed below, but we may have to wait in the queue */
+      ctxt->update_string = g_strdup(update);
+      ctxt->import_size = strlen(update);
       g_source_remove_by_user_data(ctxt);
-      if (import_queue) {
-        import_queue = g_slist_append(import_queue, ctxt);
-      } else {
-        import_queue = g_slist_append(import_queue, ctxt);
-        http_import_start(ctxt);
-      }
+      http_import_queue_add(ctxt);
     } else {
       http_error(ctxt, "500 SPARQL protocol error");
       http_close(ctxt);
@@ -1239,22 +1435,23 @@ static gboolean recv_fn (GIOChannel *source, GIOCondition condition, gpointer da
     switch (result) {
       case G_IO_STATUS_NORMAL:
         ctxt->bytes_left -= read;
-        fs_import_stream_data(fsplink, (unsigned char *) buffer, read);
-        if (ctxt->bytes_left == 0) {
-          http_put_finished(ctxt, NULL);
+        if (http_spool_write(ctxt, buffer, read)) {
+          http_spool_finished(ctxt, "500 I/O error");
+        } else if (ctxt->bytes_left == 0) {
+          http_spool_finished(ctxt, NULL);
         }
         break;
       case G_IO_STATUS_EOF:
         /* possible early EOF, but still some sort of success */
-        http_put_finished(ctxt, NULL);
+        http_spool_finished(ctxt, NULL);
         break;
       case G_IO_STATUS_ERROR:
         fs_error(LOG_ERR, "I/O error: %s during import", err ? err->message : "unknown");
-        http_put_finished(ctxt, "500 I/O error");
+        http_spool_finished(ctxt, "500 I/O error");
         break;
       case G_IO_STATUS_AGAIN:
         fs_error(LOG_ERR, "unexpected G_IO_STATUS_AGAIN during import");
-        http_put_finished(ctxt, "500 AGAIN error");
+        http_spool_finished(ctxt, "500 AGAIN error");
         break;
       default:
         fs_error(LOG_ERR, "unexpected GIOStatus during import");
@@ -1309,6 +1506,7 @@ static gboolean recv_fn (GIOChannel *source, GIOCondition condition, gpointer da
 gboolean accept_fn (GIOChannel *source, GIOCondition condition, gpointer data)
 {
   client_ctxt *ctxt = g_new0(client_ctxt, 1);
+  ctxt->import_fd = -1;
   ctxt->headers = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
   ctxt->sock = accept(g_io_channel_unix_get_fd(source), NULL, NULL);
   ctxt->query_flags = 0; /* FS_QUERY_RESTRICTED; default to unrestricted */
@@ -1596,7 +1794,7 @@ int main(int argc, char *argv[])
   const char *port = "8080";
 
   int o;
-  while ((o = getopt(argc, argv, "DH:p:Uds:")) != -1) {
+  while ((o = getopt(argc, argv, "DH:p:UdRs:")) != -1) {
     switch (o) {
       case 'D':
         daemonize = 0;
@@ -1613,6 +1811,9 @@ int main(int argc, char *argv[])
       case 'd':
 	default_graph = 1;
 	break;
+      case 'R':
+	diff_replace = 1;
+	break;
       case 's':
 	soft_limit = atoi(optarg);
 	break;
@@ -1621,12 +1822,13 @@ int main(int argc, char *argv[])
 
   if (optind >= argc) {
     fprintf(stderr, "%s revision %s\n", argv[0], GIT_REV);
-    fprintf(stderr, "Usage: %s [-D] [-H host] [-p port] [-U] [-s limit] <kbname>\n", basename(argv[0]));
+    fprintf(stderr, "Usage: %s [-D] [-H host] [-p port] [-U] [-R] [-s limit] <kbname>\n", basename(argv[0]));
     fprintf(stderr, "       -H   specify host to listen on\n");
     fprintf(stderr, "       -p   specify port to listen on\n");
     fprintf(stderr, "       -D   do not daemonise\n");
     fprintf(stderr, "       -U   enable unsafe operations (eg. LOAD)\n");
     fprintf(stderr, "       -d   enable SPARQL default graph support\n");
+    fprintf(stderr, "       -R   PUT replaces graphs by sending only the differences\n");
     fprintf(stderr, "       -s   default soft limit (-1 to disable)\n");
 
     return 1;
@@ -9,6 +9,13 @@ typedef struct {
   GHashTable *headers;
   int importing;
   char *import_uri;
+  char *import_type;
+  int import_fd;
+  long import_size;
+  int import_append;
+  int import_replace;
+  int import_running;
+  fs_import_stream *import_stream;
   long bytes_left;
   GByteArray *partial;
   char *query_string;
@@ -0,0 +1,92 @@
+/*
+    4store - a clustered RDF storage and query engine
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <libgen.h>
+#include <glib.h>
+
+#include "common/params.h"
+#include "common/error.h"
+#include "backend/backend.h"
+#include "backend/compact.h"
+#include "backend/lock.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "%s revision %s\n", argv[0], FS_BACKEND_VER);
+        fprintf(stderr, "Usage: %s <kbname> [segment ...]\n", basename(argv[0]));
+        fprintf(stderr, "       the KB must not be running\n");
+
+        return 1;
+    }
+
+    const char *kbname = argv[1];
+
+    /* 4s-backend holds this lock for as long as it runs */
+    if (fs_lock_kb(kbname)) {
+        fprintf(stderr, "%s: KB “%s” is in use, stop its backend first\n",
+                basename(argv[0]), kbname);
+
+        return 1;
+    }
+
+    fs_backend *be = fs_backend_init(kbname, 0);
+    if (!be) {
+        return 1;
+    }
+
+    int segments[FS_MAX_SEGMENTS];
+    int num_segments = fs_segments(be, segments);
+    if (argc > 2) {
+        num_segments = 0;
+        for (int i=2; i<argc; i++) {
+            segments[num_segments++] = atoi(argv[i]);
+        }
+    }
+
+    int errs = 0;
+    for (int i=0; i<num_segments; i++) {
+        printf("freezing segment %d\n", segments[i]);
+        if (fs_backend_open_files(be, segments[i], O_RDWR, FS_OPEN_ALL)) {
+            fs_error(LOG_ERR, "failed to open files for segment %d", segments[i]);
+            errs++;
+
+            continue;
+        }
+        if (fs_backend_freeze(be, segments[i])) {
+            fs_error(LOG_ERR, "failed to freeze segment %d", segments[i]);
+            errs++;
+
+            continue;
+        }
+        /* the pair rows the ptrees used are no longer referenced */
+        if (fs_backend_open_files(be, segments[i], O_RDWR, FS_OPEN_ALL) ||
+            fs_backend_compact(be, segments[i])) {
+            fs_error(LOG_ERR, "failed to compact segment %d", segments[i]);
+            errs++;
+        }
+    }
+    fs_backend_fini(be);
+
+    return errs ? 2 : 0;
+}
+
+/* vi:set expandtab sts=4 sw=4: */
@@ -30,3 +30,9 @@ function delete {
 	uriescape $2;
 	curl -s -X 'DELETE' $1/data/$escaped | sed 's/ v[.0-9a-z-]*/ [VERSION]/'
 }
+
+# usage: update $endpoint $update
+function update {
+	echo "Update: $2"
+	curl -s --data-urlencode "update=$2" "$1/update/"
+}